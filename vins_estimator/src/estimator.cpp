@@ -27,9 +27,6 @@ void Estimator::clearState()
         Vs[i].setZero();
         Bas[i].setZero();
         Bgs[i].setZero();
-        dt_buf[i].clear();
-        linear_acceleration_buf[i].clear();
-        angular_velocity_buf[i].clear();
 
         if (pre_integrations[i] != nullptr)
         {
@@ -37,6 +34,7 @@ void Estimator::clearState()
         }
         pre_integrations[i] = nullptr;
     }
+    imu_samples.clearState();
 
     for (int i = 0; i < NUM_OF_CAM; i++)
     {
@@ -69,7 +67,7 @@ void Estimator::clearState()
     f_manager.clearState();
 }
 
-void Estimator::processIMU(double dt, const Vector3d &linear_acceleration, const Vector3d &angular_velocity)
+void Estimator::processIMU(double dt, const Vector3d &linear_acceleration, const Vector3d &angular_velocity, int sum_num)
 {
     if (!first_imu)
     {
@@ -77,34 +75,93 @@ void Estimator::processIMU(double dt, const Vector3d &linear_acceleration, const
         acc_0 = linear_acceleration;
         gyr_0 = angular_velocity;
     }
+    // pre-summed step, the rates are means over the whole interval
+    if (sum_num > 0)
+    {
+        acc_0 = linear_acceleration;
+        gyr_0 = angular_velocity;
+    }
 
     if (!pre_integrations[frame_count])
     {
-        pre_integrations[frame_count] = new IntegrationBase{acc_0, gyr_0, Bas[frame_count], Bgs[frame_count]};
+        pre_integrations[frame_count] = new IntegrationBase{&imu_samples, acc_0, gyr_0, Bas[frame_count], Bgs[frame_count]};
     }
     if (frame_count != 0)
     {
-        pre_integrations[frame_count]->push_back(dt, linear_acceleration, angular_velocity);
+        long idx = imu_samples.push_back(dt, linear_acceleration, angular_velocity, sum_num);
+        pre_integrations[frame_count]->push_back(idx);
         //if(solver_flag != NON_LINEAR)
-            tmp_pre_integration->push_back(dt, linear_acceleration, angular_velocity);
-
-        dt_buf[frame_count].push_back(dt);
-        linear_acceleration_buf[frame_count].push_back(linear_acceleration);
-        angular_velocity_buf[frame_count].push_back(angular_velocity);
-
-        int j = frame_count;         
-        Vector3d un_acc_0 = Rs[j] * (acc_0 - Bas[j]) - g;
-        Vector3d un_gyr = 0.5 * (gyr_0 + angular_velocity) - Bgs[j];
-        Rs[j] *= Utility::deltaQ(un_gyr * dt).toRotationMatrix();
-        Vector3d un_acc_1 = Rs[j] * (linear_acceleration - Bas[j]) - g;
-        Vector3d un_acc = 0.5 * (un_acc_0 + un_acc_1);
-        Ps[j] += dt * Vs[j] + 0.5 * dt * dt * un_acc;
-        Vs[j] += dt * un_acc;
+            tmp_pre_integration->push_back(idx);
+
+        predictNewest(dt, linear_acceleration, angular_velocity);
     }
     acc_0 = linear_acceleration;
     gyr_0 = angular_velocity;
 }
 
+void Estimator::processIMU(const ImuSampleRing &frame_samples, IntegrationBase *frame_pre_integration)
+{
+    // only a preintegration that continues the newest frame from the last sample can be taken over
+    bool adopt = first_imu && frame_count != 0 &&
+                 (!pre_integrations[frame_count] || pre_integrations[frame_count]->sample_begin == pre_integrations[frame_count]->sample_end) &&
+                 frame_pre_integration->linearized_acc == acc_0 && frame_pre_integration->linearized_gyr == gyr_0;
+    if (!adopt)
+    {
+        delete frame_pre_integration;
+        for (long i = frame_samples.begin(); i < frame_samples.end(); i++)
+        {
+            const ImuSample &sample = frame_samples[i];
+            processIMU(sample.dt, sample.acc, sample.gyr, sample.sum_num);
+        }
+        return;
+    }
+
+    long begin = imu_samples.end();
+    for (long i = frame_samples.begin(); i < frame_samples.end(); i++)
+    {
+        const ImuSample &sample = frame_samples[i];
+        imu_samples.push_back(sample.dt, sample.acc, sample.gyr, sample.sum_num);
+    }
+    frame_pre_integration->rebase(&imu_samples, begin);
+
+    // it was linearized at the bias of an earlier estimate, the evaluation corrects small
+    // offsets to first order
+    int j = frame_count;
+    if ((Bas[j] - frame_pre_integration->linearized_ba).norm() > 0.10 ||
+        (Bgs[j] - frame_pre_integration->linearized_bg).norm() > 0.01)
+        frame_pre_integration->repropagate(Bas[j], Bgs[j]);
+    delete pre_integrations[j];
+    pre_integrations[j] = frame_pre_integration;
+    delete tmp_pre_integration;
+    tmp_pre_integration = new IntegrationBase(*frame_pre_integration);
+
+    for (long i = begin; i < imu_samples.end(); i++)
+    {
+        const ImuSample &sample = imu_samples[i];
+        if (sample.sum_num > 0)
+        {
+            acc_0 = sample.acc;
+            gyr_0 = sample.gyr;
+        }
+        predictNewest(sample.dt, sample.acc, sample.gyr);
+        acc_0 = sample.acc;
+        gyr_0 = sample.gyr;
+    }
+}
+
+// propagates the newest frame's state by one step from acc_0, gyr_0
+void Estimator::predictNewest(double dt, const Vector3d &linear_acceleration, const Vector3d &angular_velocity)
+{
+    int j = frame_count;
+    Vector3d un_acc_0 = Rs[j] * (acc_0 - Bas[j]) - g;
+    Vector3d un_gyr = 0.5 * (gyr_0 + angular_velocity) - Bgs[j];
+    Rs[j] *= Utility::deltaQ(un_gyr * dt).toRotationMatrix();
+    Vector3d un_acc_1 = Rs[j] * (linear_acceleration - Bas[j]) - g;
+    Vector3d un_acc = 0.5 * (un_acc_0 + un_acc_1);
+    Ps[j] += dt * Vs[j] + 0.5 * dt * dt * un_acc;
+    Vs[j] += dt * un_acc;
+}
+
 void Estimator::processImage(const map<int, vector<pair<int, Vector3d>>> &image, const std_msgs::Header &header)
 {
     ROS_DEBUG("new image coming ------------------------------------------");
@@ -123,7 +180,7 @@ void Estimator::processImage(const map<int, vector<pair<int, Vector3d>>> &image,
     ImageFrame imageframe(image, header.stamp.toSec());
     imageframe.pre_integration = tmp_pre_integration;
     all_image_frame.insert(make_pair(header.stamp.toSec(), imageframe));
-    tmp_pre_integration = new IntegrationBase{acc_0, gyr_0, Bas[frame_count], Bgs[frame_count]};
+    tmp_pre_integration = new IntegrationBase{&imu_samples, acc_0, gyr_0, Bas[frame_count], Bgs[frame_count]};
 
     if(ESTIMATE_EXTRINSIC == 2)
     {
@@ -639,10 +696,14 @@ bool Estimator::failureDetection()
 
 void Estimator::optimization()
 {
-    ceres::Problem problem;
-    ceres::LossFunction *loss_function;
-    //loss_function = new ceres::HuberLoss(1.0);
-    loss_function = new ceres::CauchyLoss(1.0);
+    // the loss is shared with the feature track factors, which apply it themselves. The ones
+    // kept for marginalization outlive this call, so they hold a reference to it
+    ceres::Problem::Options problem_options;
+    problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+    ceres::Problem problem(problem_options);
+    std::shared_ptr<ceres::LossFunction> loss_function;
+    //loss_function = std::make_shared<ceres::HuberLoss>(1.0);
+    loss_function = std::make_shared<ceres::CauchyLoss>(1.0);
     for (int i = 0; i < WINDOW_SIZE + 1; i++)
     {
         ceres::LocalParameterization *local_parameterization = new PoseLocalParameterization();
@@ -694,6 +755,8 @@ void Estimator::optimization()
         int imu_i = it_per_id.start_frame, imu_j = imu_i - 1;
         
         Vector3d pts_i = it_per_id.feature_per_frame[0].point;
+        vector<Vector3d> pts_j;
+        vector<double *> parameter_blocks{para_Pose[imu_i], para_Ex_Pose[0], para_Feature[feature_index]};
 
         for (auto &it_per_frame : it_per_id.feature_per_frame)
         {
@@ -702,59 +765,53 @@ void Estimator::optimization()
             {
                 continue;
             }
-            Vector3d pts_j = it_per_frame.point;
-            ProjectionFactor *f = new ProjectionFactor(pts_i, pts_j);
-            problem.AddResidualBlock(f, loss_function, para_Pose[imu_i], para_Pose[imu_j], para_Ex_Pose[0], para_Feature[feature_index]);
+            pts_j.push_back(it_per_frame.point);
+            parameter_blocks.push_back(para_Pose[imu_j]);
             f_m_cnt++;
         }
+        ProjectionTrackFactor *f = new ProjectionTrackFactor(pts_i, pts_j, loss_function);
+        problem.AddResidualBlock(f, NULL, parameter_blocks);
     }
     relocalize = false;
     //loop close factor
+    // window slot of every relocalization frame, -1 if it has left the window
+    vector<int> retrive_window_index(retrive_data_vector.size(), -1);
     if(LOOP_CLOSURE)
     {
-        int loop_constraint_num = 0;
         for (int k = 0; k < (int)retrive_data_vector.size(); k++)
-        {    
+        {
             for(int i = 0; i < WINDOW_SIZE; i++)
             {
                 if(retrive_data_vector[k].header == Headers[i].stamp.toSec())
-                {
-                    relocalize = true;
-                    ceres::LocalParameterization *local_parameterization = new PoseLocalParameterization();
-                    problem.AddParameterBlock(retrive_data_vector[k].loop_pose, SIZE_POSE, local_parameterization);
-                    loop_window_index = i;
-                    loop_constraint_num++;
-                    int retrive_feature_index = 0;
-                    int feature_index = -1;
-                    for (auto &it_per_id : f_manager.feature)
-                    {
-                        it_per_id.used_num = it_per_id.feature_per_frame.size();
-                        if (!(it_per_id.used_num >= 2 && it_per_id.start_frame < WINDOW_SIZE - 2))
-                            continue;
-
-                        ++feature_index;
-                        int start = it_per_id.start_frame;
-                        if(start <= i)
-                        {   
-                            while(retrive_data_vector[k].features_ids[retrive_feature_index] < it_per_id.feature_id)
-                            {
-                                retrive_feature_index++;
-                            }
-
-                            if(retrive_data_vector[k].features_ids[retrive_feature_index] == it_per_id.feature_id)
-                            {
-                                Vector3d pts_j = Vector3d(retrive_data_vector[k].measurements[retrive_feature_index].x, retrive_data_vector[k].measurements[retrive_feature_index].y, 1.0);
-                                Vector3d pts_i = it_per_id.feature_per_frame[0].point;
-                                
-                                ProjectionFactor *f = new ProjectionFactor(pts_i, pts_j);
-                                problem.AddResidualBlock(f, loss_function, para_Pose[start], retrive_data_vector[k].loop_pose, para_Ex_Pose[0], para_Feature[feature_index]);
-                            
-                                retrive_feature_index++;
-                            }     
-                        }
-                    }
-                            
-                }
+                    retrive_window_index[k] = i;
+            }
+        }
+
+        // optimized features by id, with their index into para_Feature
+        unordered_map<int, pair<int, FeaturePerId *>> feature_by_id = f_manager.getOptimizedFeatureIndex();
+
+        int loop_constraint_num = 0;
+        for (int k = 0; k < (int)retrive_data_vector.size(); k++)
+        {
+            int i = retrive_window_index[k];
+            if (i < 0)
+                continue;
+
+            relocalize = true;
+            ceres::LocalParameterization *local_parameterization = new PoseLocalParameterization();
+            problem.AddParameterBlock(retrive_data_vector[k].loop_pose, SIZE_POSE, local_parameterization);
+            loop_window_index = i;
+            loop_constraint_num++;
+            for (auto &match : FeatureManager::matchLoopFeatures(feature_by_id, retrive_data_vector[k].features_ids, i))
+            {
+                int retrive_feature_index = match.first;
+                FeaturePerId &it_per_id = *match.second.second;
+                int start = it_per_id.start_frame;
+                Vector3d pts_j = Vector3d(retrive_data_vector[k].measurements[retrive_feature_index].x, retrive_data_vector[k].measurements[retrive_feature_index].y, 1.0);
+                Vector3d pts_i = it_per_id.feature_per_frame[0].point;
+
+                ProjectionFactor *f = new ProjectionFactor(pts_i, pts_j);
+                problem.AddResidualBlock(f, loss_function.get(), para_Pose[start], retrive_data_vector[k].loop_pose, para_Ex_Pose[0], para_Feature[match.second.first]);
             }
         }
         ROS_DEBUG("loop constraint num: %d", loop_constraint_num);
@@ -787,27 +844,24 @@ void Estimator::optimization()
     { 
         for (int k = 0; k < (int)retrive_data_vector.size(); k++)
         {
-            for(int i = 0; i< WINDOW_SIZE; i++)
-            {
-                if(retrive_data_vector[k].header == Headers[i].stamp.toSec())
-                {
-                    retrive_data_vector[k].relative_pose = true;
-                    Matrix3d Rs_i = Quaterniond(para_Pose[i][6], para_Pose[i][3], para_Pose[i][4], para_Pose[i][5]).normalized().toRotationMatrix();
-                    Vector3d Ps_i = Vector3d(para_Pose[i][0], para_Pose[i][1], para_Pose[i][2]);
-                    Quaterniond Qs_loop;
-                    Qs_loop = Quaterniond(retrive_data_vector[k].loop_pose[6],  retrive_data_vector[k].loop_pose[3],  retrive_data_vector[k].loop_pose[4],  retrive_data_vector[k].loop_pose[5]).normalized().toRotationMatrix();
-                    Matrix3d Rs_loop = Qs_loop.toRotationMatrix();
-                    Vector3d Ps_loop = Vector3d( retrive_data_vector[k].loop_pose[0],  retrive_data_vector[k].loop_pose[1],  retrive_data_vector[k].loop_pose[2]);
-
-                    retrive_data_vector[k].relative_t = Rs_loop.transpose() * (Ps_i - Ps_loop);
-                    retrive_data_vector[k].relative_q = Rs_loop.transpose() * Rs_i;
-                    retrive_data_vector[k].relative_yaw = Utility::normalizeAngle(Utility::R2ypr(Rs_i).x() - Utility::R2ypr(Rs_loop).x());
-                    if (abs(retrive_data_vector[k].relative_yaw) > 30.0 || retrive_data_vector[k].relative_t.norm() > 20.0)
-                        retrive_data_vector[k].relative_pose = false;
-                        
-                }
-            } 
-        } 
+            int i = retrive_window_index[k];
+            if (i < 0)
+                continue;
+
+            retrive_data_vector[k].relative_pose = true;
+            Matrix3d Rs_i = Quaterniond(para_Pose[i][6], para_Pose[i][3], para_Pose[i][4], para_Pose[i][5]).normalized().toRotationMatrix();
+            Vector3d Ps_i = Vector3d(para_Pose[i][0], para_Pose[i][1], para_Pose[i][2]);
+            Quaterniond Qs_loop;
+            Qs_loop = Quaterniond(retrive_data_vector[k].loop_pose[6],  retrive_data_vector[k].loop_pose[3],  retrive_data_vector[k].loop_pose[4],  retrive_data_vector[k].loop_pose[5]).normalized().toRotationMatrix();
+            Matrix3d Rs_loop = Qs_loop.toRotationMatrix();
+            Vector3d Ps_loop = Vector3d( retrive_data_vector[k].loop_pose[0],  retrive_data_vector[k].loop_pose[1],  retrive_data_vector[k].loop_pose[2]);
+
+            retrive_data_vector[k].relative_t = Rs_loop.transpose() * (Ps_i - Ps_loop);
+            retrive_data_vector[k].relative_q = Rs_loop.transpose() * Rs_i;
+            retrive_data_vector[k].relative_yaw = Utility::normalizeAngle(Utility::R2ypr(Rs_i).x() - Utility::R2ypr(Rs_loop).x());
+            if (abs(retrive_data_vector[k].relative_yaw) > 30.0 || retrive_data_vector[k].relative_t.norm() > 20.0)
+                retrive_data_vector[k].relative_pose = false;
+        }
     }
 
     double2vector();
@@ -862,6 +916,8 @@ void Estimator::optimization()
                     continue;
 
                 Vector3d pts_i = it_per_id.feature_per_frame[0].point;
+                vector<Vector3d> pts_j;
+                vector<double *> parameter_blocks{para_Pose[imu_i], para_Ex_Pose[0], para_Feature[feature_index]};
 
                 for (auto &it_per_frame : it_per_id.feature_per_frame)
                 {
@@ -869,13 +925,13 @@ void Estimator::optimization()
                     if (imu_i == imu_j)
                         continue;
 
-                    Vector3d pts_j = it_per_frame.point;
-                    ProjectionFactor *f = new ProjectionFactor(pts_i, pts_j);
-                    ResidualBlockInfo *residual_block_info = new ResidualBlockInfo(f, loss_function,
-                                                                                   vector<double *>{para_Pose[imu_i], para_Pose[imu_j], para_Ex_Pose[0], para_Feature[feature_index]},
-                                                                                   vector<int>{0, 3});
-                    marginalization_info->addResidualBlockInfo(residual_block_info);
+                    pts_j.push_back(it_per_frame.point);
+                    parameter_blocks.push_back(para_Pose[imu_j]);
                 }
+                ProjectionTrackFactor *f = new ProjectionTrackFactor(pts_i, pts_j, loss_function);
+                ResidualBlockInfo *residual_block_info = new ResidualBlockInfo(f, NULL, parameter_blocks,
+                                                                               vector<int>{0, 2});
+                marginalization_info->addResidualBlockInfo(residual_block_info);
             }
         }
 
@@ -987,10 +1043,6 @@ void Estimator::slideWindow()
 
                 std::swap(pre_integrations[i], pre_integrations[i + 1]);
 
-                dt_buf[i].swap(dt_buf[i + 1]);
-                linear_acceleration_buf[i].swap(linear_acceleration_buf[i + 1]);
-                angular_velocity_buf[i].swap(angular_velocity_buf[i + 1]);
-
                 Headers[i] = Headers[i + 1];
                 Ps[i].swap(Ps[i + 1]);
                 Vs[i].swap(Vs[i + 1]);
@@ -1005,11 +1057,9 @@ void Estimator::slideWindow()
             Bgs[WINDOW_SIZE] = Bgs[WINDOW_SIZE - 1];
 
             delete pre_integrations[WINDOW_SIZE];
-            pre_integrations[WINDOW_SIZE] = new IntegrationBase{acc_0, gyr_0, Bas[WINDOW_SIZE], Bgs[WINDOW_SIZE]};
-
-            dt_buf[WINDOW_SIZE].clear();
-            linear_acceleration_buf[WINDOW_SIZE].clear();
-            angular_velocity_buf[WINDOW_SIZE].clear();
+            pre_integrations[WINDOW_SIZE] = new IntegrationBase{&imu_samples, acc_0, gyr_0, Bas[WINDOW_SIZE], Bgs[WINDOW_SIZE]};
+            // later frames and all_image_frame only reference samples after the new first frame
+            imu_samples.discardBefore(pre_integrations[0]->sample_begin);
 
             if (true || solver_flag == INITIAL)
             {
@@ -1027,18 +1077,9 @@ void Estimator::slideWindow()
     {
         if (frame_count == WINDOW_SIZE)
         {
-            for (unsigned int i = 0; i < dt_buf[frame_count].size(); i++)
-            {
-                double tmp_dt = dt_buf[frame_count][i];
-                Vector3d tmp_linear_acceleration = linear_acceleration_buf[frame_count][i];
-                Vector3d tmp_angular_velocity = angular_velocity_buf[frame_count][i];
-
-                pre_integrations[frame_count - 1]->push_back(tmp_dt, tmp_linear_acceleration, tmp_angular_velocity);
-
-                dt_buf[frame_count - 1].push_back(tmp_dt);
-                linear_acceleration_buf[frame_count - 1].push_back(tmp_linear_acceleration);
-                angular_velocity_buf[frame_count - 1].push_back(tmp_angular_velocity);
-            }
+            // the samples of the dropped frame directly follow those of the previous one
+            for (long i = pre_integrations[frame_count]->sample_begin; i < pre_integrations[frame_count]->sample_end; i++)
+                pre_integrations[frame_count - 1]->push_back(i);
 
             Headers[frame_count - 1] = Headers[frame_count];
             Ps[frame_count - 1] = Ps[frame_count];
@@ -1048,11 +1089,7 @@ void Estimator::slideWindow()
             Bgs[frame_count - 1] = Bgs[frame_count];
 
             delete pre_integrations[WINDOW_SIZE];
-            pre_integrations[WINDOW_SIZE] = new IntegrationBase{acc_0, gyr_0, Bas[WINDOW_SIZE], Bgs[WINDOW_SIZE]};
-
-            dt_buf[WINDOW_SIZE].clear();
-            linear_acceleration_buf[WINDOW_SIZE].clear();
-            angular_velocity_buf[WINDOW_SIZE].clear();
+            pre_integrations[WINDOW_SIZE] = new IntegrationBase{&imu_samples, acc_0, gyr_0, Bas[WINDOW_SIZE], Bgs[WINDOW_SIZE]};
 
             slideWindowNew();
         }
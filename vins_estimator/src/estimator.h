@@ -15,6 +15,7 @@
 #include "factor/imu_factor.h"
 #include "factor/pose_local_parameterization.h"
 #include "factor/projection_factor.h"
+#include "factor/projection_track_factor.h"
 #include "factor/marginalization_factor.h"
 
 #include <unordered_map>
@@ -47,7 +48,9 @@ class Estimator
     void setParameter();
 
     // interface
-    void processIMU(double t, const Vector3d &linear_acceleration, const Vector3d &angular_velocity);
+    void processIMU(double t, const Vector3d &linear_acceleration, const Vector3d &angular_velocity, int sum_num = 0);
+    // takes over frame_pre_integration, preintegrated over frame_samples off the estimator thread
+    void processIMU(const ImuSampleRing &frame_samples, IntegrationBase *frame_pre_integration);
     void processImage(const map<int, vector<pair<int, Vector3d>>> &image, const std_msgs::Header &header);
 
     // internal
@@ -56,6 +59,7 @@ class Estimator
     bool visualInitialAlign();
     bool relativePose(Matrix3d &relative_R, Vector3d &relative_T, int &l);
     void slideWindow();
+    void predictNewest(double dt, const Vector3d &linear_acceleration, const Vector3d &angular_velocity);
     void solveOdometry();
     void slideWindowNew();
     void slideWindowOld();
@@ -99,9 +103,7 @@ class Estimator
     IntegrationBase *pre_integrations[(WINDOW_SIZE + 1)];
     Vector3d acc_0, gyr_0;
 
-    vector<double> dt_buf[(WINDOW_SIZE + 1)];
-    vector<Vector3d> linear_acceleration_buf[(WINDOW_SIZE + 1)];
-    vector<Vector3d> angular_velocity_buf[(WINDOW_SIZE + 1)];
+    ImuSampleRing imu_samples;
 
     int frame_count;
     int sum_of_outlier, sum_of_back, sum_of_front, sum_of_invalid;
@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <queue>
+#include <deque>
 #include <map>
+#include <memory>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 #include <ros/ros.h>
 #include <cv_bridge/cv_bridge.h>
@@ -10,44 +13,86 @@
 
 #include "estimator.h"
 #include "parameters.h"
+#include "factor/imu_presum.h"
+#include "imu_propagator.h"
+#include "measurement_sync.h"
 #include "utility/visualization.h"
+#include "utility/spsc_ring.h"
 #include "loop-closure/loop_closure.h"
 #include "loop-closure/keyframe.h"
 #include "loop-closure/keyframe_database.h"
+#include "loop-closure/keyframe_queue.h"
 #include "camodocal/camera_models/CameraFactory.h"
 #include "camodocal/camera_models/CataCamera.h"
 #include "camodocal/camera_models/PinholeCamera.h"
 
 Estimator estimator;
+ImuPreSum imu_presum;
+ImuPropagator imu_propagator;
+// set by the estimator thread once the propagator holds a non linear estimate, the imu
+// callback publishes the propagated state only then and never reads the estimator itself
+std::atomic<bool> odometry_ready(false);
 
 std::condition_variable con;
 double current_time = -1;
-queue<sensor_msgs::ImuConstPtr> imu_buf;
-queue<sensor_msgs::PointCloudConstPtr> feature_buf;
+// filled by the ros callbacks, drained by the process thread. A full feature ring drops the
+// new image, the subscriber queue in front of it is sized the same. Imu samples are never
+// dropped, every one of them is already in the propagated state: on a full imu ring the
+// callback waits until the process thread has taken samples out.
+const int IMU_RING_SIZE = 2048;
+const int FEATURE_RING_SIZE = 128;
+SpscRing<sensor_msgs::ImuConstPtr> imu_ring(IMU_RING_SIZE);
+SpscRing<sensor_msgs::PointCloudConstPtr> feature_ring(FEATURE_RING_SIZE);
+std::condition_variable con_imu_ring;
+std::mutex m_imu_ring;
+// messages taken from the rings but not yet paired, process thread only
+MeasurementSync measurement_sync;
 std::mutex m_posegraph_buf;
 queue<int> optimize_posegraph_buf;
-queue<KeyFrame*> keyframe_buf;
+// keyframes waiting for loop detection, bounded by LOOP_QUEUE_SIZE
+KeyFrameQueue keyframe_queue;
 queue<RetriveData> retrive_data_buf;
 
-int sum_of_wait = 0;
-
-std::mutex m_buf;
-std::mutex m_state;
+// one image with its imu, decoded and ready for the estimator
+struct EstimatorFrame
+{
+    // the frame's imu steps, preintegrated at the bias of the last estimate
+    std::unique_ptr<ImuSampleRing> imu_samples;
+    std::unique_ptr<IntegrationBase> pre_integration;
+    double imu_time;
+    map<int, vector<pair<int, Vector3d>>> image;
+    std_msgs::Header header;
+    TicToc t_s;
+};
+// frames handed from the preprocessing to the estimator thread when ESTIMATOR_PIPELINE is on
+queue<EstimatorFrame> estimator_frame_buf;
+// last imu step of the preprocessing thread, and the bias the next frame is preintegrated at
+ImuPreSumStep last_imu_step;
+bool has_last_imu_step = false;
+std::mutex m_latest_bias;
+Vector3d latest_ba{Vector3d::Zero()};
+Vector3d latest_bg{Vector3d::Zero()};
+const int ESTIMATOR_FRAME_BUF_SIZE = 1;
+std::condition_variable con_estimator_frame;
+// estimator results waiting for the publisher thread. Every frame's record is published, of
+// the visualizations only the newest one waiting: a new one replaces it and counts as skipped.
+deque<EstimatorRecord> record_buf;
+EstimatorRecord last_record;
+bool has_last_record = false;
+EstimatorSnapshot pending_snapshot;
+bool has_pending_snapshot = false;
+unsigned long skipped_snapshot_cnt = 0;
+std::condition_variable con_snapshot;
+
+std::mutex m_con;
 std::mutex i_buf;
 std::mutex m_loop_drift;
 std::mutex m_keyframedatabase_resample;
 std::mutex m_update_visualization;
-std::mutex m_keyframe_buf;
 std::mutex m_retrive_data_buf;
+std::mutex m_estimator_frame_buf;
+std::mutex m_snapshot_buf;
 
-double latest_time;
-Eigen::Vector3d tmp_P;
-Eigen::Quaterniond tmp_Q;
-Eigen::Vector3d tmp_V;
-Eigen::Vector3d tmp_Ba;
-Eigen::Vector3d tmp_Bg;
-Eigen::Vector3d acc_0;
-Eigen::Vector3d gyr_0;
 
 queue<pair<cv::Mat, double>> image_buf;
 LoopClosure *loop_closure;
@@ -62,108 +107,66 @@ Eigen::Vector3d relocalize_t{Eigen::Vector3d(0, 0, 0)};
 Eigen::Matrix3d relocalize_r{Eigen::Matrix3d::Identity()};
 
 
-void predict(const sensor_msgs::ImuConstPtr &imu_msg)
+// hands the new window head to the imu-rate propagator
+void update(double t)
 {
-    double t = imu_msg->header.stamp.toSec();
-    double dt = t - latest_time;
-    latest_time = t;
-
-    double dx = imu_msg->linear_acceleration.x;
-    double dy = imu_msg->linear_acceleration.y;
-    double dz = imu_msg->linear_acceleration.z;
-    Eigen::Vector3d linear_acceleration{dx, dy, dz};
-
-    double rx = imu_msg->angular_velocity.x;
-    double ry = imu_msg->angular_velocity.y;
-    double rz = imu_msg->angular_velocity.z;
-    Eigen::Vector3d angular_velocity{rx, ry, rz};
-
-    Eigen::Vector3d un_acc_0 = tmp_Q * (acc_0 - tmp_Ba - tmp_Q.inverse() * estimator.g);
-
-    Eigen::Vector3d un_gyr = 0.5 * (gyr_0 + angular_velocity) - tmp_Bg;
-    tmp_Q = tmp_Q * Utility::deltaQ(un_gyr * dt);
-
-    Eigen::Vector3d un_acc_1 = tmp_Q * (linear_acceleration - tmp_Ba - tmp_Q.inverse() * estimator.g);
-
-    Eigen::Vector3d un_acc = 0.5 * (un_acc_0 + un_acc_1);
-
-    tmp_P = tmp_P + dt * tmp_V + 0.5 * dt * dt * un_acc;
-    tmp_V = tmp_V + dt * un_acc;
-
-    acc_0 = linear_acceleration;
-    gyr_0 = angular_velocity;
+    imu_propagator.correct(t,
+                           relocalize_r * estimator.Ps[WINDOW_SIZE] + relocalize_t,
+                           Quaterniond(relocalize_r * estimator.Rs[WINDOW_SIZE]),
+                           relocalize_r * estimator.Vs[WINDOW_SIZE],
+                           estimator.Bas[WINDOW_SIZE],
+                           estimator.Bgs[WINDOW_SIZE],
+                           estimator.g);
 }
 
-void update()
+// wakes the process thread, m_con is only ever held for its wait predicate
+void notify_process()
 {
-    TicToc t_predict;
-    latest_time = current_time;
-    tmp_P = relocalize_r * estimator.Ps[WINDOW_SIZE] + relocalize_t;
-    tmp_Q = relocalize_r * estimator.Rs[WINDOW_SIZE];
-    tmp_V = estimator.Vs[WINDOW_SIZE];
-    tmp_Ba = estimator.Bas[WINDOW_SIZE];
-    tmp_Bg = estimator.Bgs[WINDOW_SIZE];
-    acc_0 = estimator.acc_0;
-    gyr_0 = estimator.gyr_0;
-
-    queue<sensor_msgs::ImuConstPtr> tmp_imu_buf = imu_buf;
-    for (sensor_msgs::ImuConstPtr tmp_imu_msg; !tmp_imu_buf.empty(); tmp_imu_buf.pop())
-        predict(tmp_imu_buf.front());
-
+    {
+        std::lock_guard<std::mutex> lk(m_con);
+    }
+    con.notify_one();
 }
 
-std::vector<std::pair<std::vector<sensor_msgs::ImuConstPtr>, sensor_msgs::PointCloudConstPtr>>
-getMeasurements()
+// wakes an imu callback waiting for room in the imu ring
+void notify_imu_ring()
 {
-    std::vector<std::pair<std::vector<sensor_msgs::ImuConstPtr>, sensor_msgs::PointCloudConstPtr>> measurements;
-
-    while (true)
     {
-        if (imu_buf.empty() || feature_buf.empty())
-            return measurements;
-
-        if (!(imu_buf.back()->header.stamp > feature_buf.front()->header.stamp))
-        {
-            ROS_WARN("wait for imu, only should happen at the beginning");
-            sum_of_wait++;
-            return measurements;
-        }
-
-        if (!(imu_buf.front()->header.stamp < feature_buf.front()->header.stamp))
-        {
-            ROS_WARN("throw img, only should happen at the beginning");
-            feature_buf.pop();
-            continue;
-        }
-        sensor_msgs::PointCloudConstPtr img_msg = feature_buf.front();
-        feature_buf.pop();
-
-        std::vector<sensor_msgs::ImuConstPtr> IMUs;
-        while (imu_buf.front()->header.stamp <= img_msg->header.stamp)
-        {
-            IMUs.emplace_back(imu_buf.front());
-            imu_buf.pop();
-        }
-
-        measurements.emplace_back(IMUs, img_msg);
+        std::lock_guard<std::mutex> lk(m_imu_ring);
     }
-    return measurements;
+    con_imu_ring.notify_one();
 }
 
 void imu_callback(const sensor_msgs::ImuConstPtr &imu_msg)
 {
-    m_buf.lock();
-    imu_buf.push(imu_msg);
-    m_buf.unlock();
-    con.notify_one();
+    // integrate before the estimator can see the message, its estimate then always has a
+    // propagated state to be matched against
+    imu_propagator.propagate(imu_msg->header.stamp.toSec(),
+                             Vector3d(imu_msg->linear_acceleration.x, imu_msg->linear_acceleration.y, imu_msg->linear_acceleration.z),
+                             Vector3d(imu_msg->angular_velocity.x, imu_msg->angular_velocity.y, imu_msg->angular_velocity.z));
+
+    if (!imu_ring.push(imu_msg))
+    {
+        // the ring counts every full push as dropped, here it is a wait
+        ROS_WARN_THROTTLE(1.0, "imu ring full, the imu callback waited %lu times", imu_ring.dropped());
+        notify_process();
+        std::unique_lock<std::mutex> lk(m_imu_ring);
+        con_imu_ring.wait(lk, [&]
+                          {
+            return imu_ring.size() < imu_ring.capacity();
+                          });
+        imu_ring.push(imu_msg);
+    }
+    notify_process();
 
+    if (odometry_ready.load(std::memory_order_acquire))
     {
-        std::lock_guard<std::mutex> lg(m_state);
-        predict(imu_msg);
+        Vector3d P, V;
+        Quaterniond Q;
+        imu_propagator.getState(P, Q, V);
         std_msgs::Header header = imu_msg->header;
         header.frame_id = "world";
-        if (estimator.solver_flag == Estimator::SolverFlag::NON_LINEAR)
-            pubLatestOdometry(tmp_P, tmp_Q, tmp_V, header);
+        pubLatestOdometry(P, Q, V, header);
     }
 }
 
@@ -181,13 +184,19 @@ void raw_image_callback(const sensor_msgs::ImageConstPtr &img_msg)
 
 void feature_callback(const sensor_msgs::PointCloudConstPtr &feature_msg)
 {
-    m_buf.lock();
-    feature_buf.push(feature_msg);
-    m_buf.unlock();
-    con.notify_one();
+    if (!feature_ring.push(feature_msg))
+        ROS_WARN_THROTTLE(1.0, "feature ring full, %lu images dropped", feature_ring.dropped());
+    notify_process();
+}
+
+void send_imu_presum(vector<ImuPreSumStep> &imu_steps)
+{
+    ImuPreSumStep step;
+    if (imu_presum.flush(step))
+        imu_steps.push_back(step);
 }
 
-void send_imu(const sensor_msgs::ImuConstPtr &imu_msg)
+void send_imu(const sensor_msgs::ImuConstPtr &imu_msg, vector<ImuPreSumStep> &imu_steps)
 {
     double t = imu_msg->header.stamp.toSec();
     if (current_time < 0)
@@ -207,7 +216,264 @@ void send_imu(const sensor_msgs::ImuConstPtr &imu_msg)
     double rz = imu_msg->angular_velocity.z - bg[2];
     //ROS_DEBUG("IMU %f, dt: %f, acc: %f %f %f, gyr: %f %f %f", t, dt, dx, dy, dz, rx, ry, rz);
 
-    estimator.processIMU(dt, Vector3d(dx, dy, dz), Vector3d(rx, ry, rz));
+    if (IMU_PRESUM_NUM > 1)
+    {
+        if (imu_presum.push_back(dt, Vector3d(dx, dy, dz), Vector3d(rx, ry, rz)))
+            send_imu_presum(imu_steps);
+    }
+    else
+        imu_steps.push_back(ImuPreSumStep{dt, Vector3d(dx, dy, dz), Vector3d(rx, ry, rz), 0});
+}
+
+// everything up to the estimator that does not touch the estimator state
+void prepare_frame(const Measurement &measurement, EstimatorFrame &frame)
+{
+    vector<ImuPreSumStep> imu_steps;
+    for (auto &imu_msg : measurement.first)
+        send_imu(imu_msg, imu_steps);
+    // close the partial pre-sum group so that the preintegration ends at this image
+    if (IMU_PRESUM_NUM > 1)
+        send_imu_presum(imu_steps);
+    frame.imu_time = current_time;
+
+    // preintegrated here so the estimator thread only takes it over, it continues from the
+    // last step of the previous frame like the estimator's own
+    if (!has_last_imu_step && !imu_steps.empty())
+    {
+        last_imu_step = imu_steps.front();
+        has_last_imu_step = true;
+    }
+    Vector3d ba, bg;
+    {
+        std::lock_guard<std::mutex> lk(m_latest_bias);
+        ba = latest_ba;
+        bg = latest_bg;
+    }
+    frame.imu_samples.reset(new ImuSampleRing(2 * imu_steps.size() + 1));
+    frame.pre_integration.reset(new IntegrationBase{frame.imu_samples.get(), last_imu_step.acc, last_imu_step.gyr, ba, bg});
+    for (auto &step : imu_steps)
+        frame.pre_integration->push_back(frame.imu_samples->push_back(step.dt, step.acc, step.gyr, step.sum_num));
+    if (!imu_steps.empty())
+        last_imu_step = imu_steps.back();
+
+    auto img_msg = measurement.second;
+    ROS_DEBUG("processing vision data with stamp %f \n", img_msg->header.stamp.toSec());
+
+    frame.t_s.tic();
+    for (unsigned int i = 0; i < img_msg->points.size(); i++)
+    {
+        int v = img_msg->channels[0].values[i] + 0.5;
+        int feature_id = v / NUM_OF_CAM;
+        int camera_id = v % NUM_OF_CAM;
+        double x = img_msg->points[i].x;
+        double y = img_msg->points[i].y;
+        double z = img_msg->points[i].z;
+        ROS_ASSERT(z == 1);
+        frame.image[feature_id].emplace_back(camera_id, Vector3d(x, y, z));
+    }
+    frame.header = img_msg->header;
+}
+
+void post_snapshot(EstimatorRecord &&record, EstimatorSnapshot &&snapshot)
+{
+    std::lock_guard<std::mutex> lk(m_snapshot_buf);
+    last_record = record;
+    has_last_record = true;
+    record_buf.push_back(std::move(record));
+    if (has_pending_snapshot)
+    {
+        skipped_snapshot_cnt++;
+        ROS_DEBUG("publisher behind, %lu visualizations skipped, %lu records waiting", skipped_snapshot_cnt, record_buf.size());
+    }
+    pending_snapshot = std::move(snapshot);
+    has_pending_snapshot = true;
+    con_snapshot.notify_one();
+}
+
+// republishes the newest odometry under a new loop correction
+void repost_snapshot(const Vector3d &loop_correct_t, const Matrix3d &loop_correct_r)
+{
+    std::lock_guard<std::mutex> lk(m_snapshot_buf);
+    if (!has_last_record)
+        return;
+    EstimatorRecord record = last_record;
+    record.loop_correct_t = loop_correct_t;
+    record.loop_correct_r = loop_correct_r;
+    record.odometry_only = true;
+    record_buf.push_back(std::move(record));
+    // the visualization still waiting is shown under the new correction as well
+    if (has_pending_snapshot)
+    {
+        pending_snapshot.loop_correct_t = loop_correct_t;
+        pending_snapshot.loop_correct_r = loop_correct_r;
+    }
+    con_snapshot.notify_one();
+}
+
+// loop detection of one keyframe, its features are already extracted
+void detect_loop(KeyFrame *cur_kf, const DBoW2::BowVector &bowvec, const DBoW2::FeatureVector &featvec)
+{
+    cur_kf->global_index = global_frame_cnt;
+    m_keyframedatabase_resample.lock();
+    keyframe_database.add(cur_kf);
+    m_keyframedatabase_resample.unlock();
+
+    cv::Mat current_image;
+    current_image = cur_kf->image;   
+
+    bool loop_succ = false;
+    int old_index = -1;
+    vector<int> old_indices;
+    vector<cv::Point2f> cur_pts;
+    vector<cv::Point2f> old_pts;
+    TicToc t_loopdetect;
+    loop_succ = loop_closure->startLoopClosure(cur_kf->features, bowvec, featvec, cur_pts, old_pts, old_indices);
+    double t_loop = t_loopdetect.toc();
+    ROS_DEBUG("t_loopdetect %f ms", t_loop);
+    // candidates too recent or too early are not checked
+    vector<LoopMatch> loop_matches;
+    vector<KeyFrame*> loop_kfs;
+    if(loop_succ)
+    {
+        for (int index : old_indices)
+        {
+            if (global_frame_cnt - index <= 35 || index <= 30)
+                continue;
+            KeyFrame* old_kf = keyframe_database.getKeyframe(index);
+            if (old_kf == NULL)
+            {
+                ROS_WARN("NO such frame in keyframe_database");
+                ROS_BREAK();
+            }
+            loop_matches.push_back(LoopMatch());
+            loop_matches.back().old_kf = old_kf;
+            loop_kfs.push_back(old_kf);
+        }
+    }
+    if(!loop_matches.empty())
+    {
+        TicToc t_match;
+        int best = cur_kf->findConnectionWithOldFrames(loop_matches, m_camera);
+        ROS_DEBUG("loop checked %d candidates in %f ms", (int)loop_matches.size(), t_match.toc());
+        // send loop info to VINS relocalization
+        int loop_fusion = 0;
+        KeyFrame* old_kf = NULL;
+        if (best >= 0)
+        {
+            const LoopMatch &match = loop_matches[best];
+            old_kf = loop_kfs[best];
+            old_index = old_kf->global_index;
+            ROS_DEBUG("loop succ %d with %drd image", global_frame_cnt, old_index);
+
+            Vector3d T_w_i_old;
+            Matrix3d R_w_i_old;
+            old_kf->getPose(T_w_i_old, R_w_i_old);
+            Quaterniond PnP_Q_old(match.PnP_R_old);
+            RetriveData retrive_data;
+            retrive_data.cur_index = cur_kf->global_index;
+            retrive_data.header = cur_kf->header;
+            retrive_data.P_old = T_w_i_old;
+            retrive_data.R_old = R_w_i_old;
+            retrive_data.relative_pose = false;
+            retrive_data.relocalized = false;
+            retrive_data.measurements = match.measurements_old_norm;
+            retrive_data.features_ids = match.features_id_matched;
+            retrive_data.loop_pose[0] = match.PnP_T_old.x();
+            retrive_data.loop_pose[1] = match.PnP_T_old.y();
+            retrive_data.loop_pose[2] = match.PnP_T_old.z();
+            retrive_data.loop_pose[3] = PnP_Q_old.x();
+            retrive_data.loop_pose[4] = PnP_Q_old.y();
+            retrive_data.loop_pose[5] = PnP_Q_old.z();
+            retrive_data.loop_pose[6] = PnP_Q_old.w();
+            m_retrive_data_buf.lock();
+            retrive_data_buf.push(retrive_data);
+            m_retrive_data_buf.unlock();
+            cur_kf->detectLoop(old_index);
+            old_kf->is_looped = 1;
+            loop_fusion = 1;
+
+            m_update_visualization.lock();
+            keyframe_database.addLoop(old_index);
+            CameraPoseVisualization* posegraph_visualization = keyframe_database.getPosegraphVisualization();
+            pubPoseGraph(posegraph_visualization, cur_header);  
+            m_update_visualization.unlock();
+        }
+
+
+        // visualization loop info
+        if(0 && loop_fusion)
+        {
+            const std::vector<cv::Point2f> &measurements_cur = loop_matches[best].measurements_matched;
+            const std::vector<cv::Point2f> &measurements_old = loop_matches[best].measurements_old;
+            int COL = current_image.cols;
+            //int ROW = current_image.rows;
+            cv::Mat gray_img, loop_match_img;
+            cv::Mat old_img = old_kf->image;
+            cv::hconcat(old_img, current_image, gray_img);
+            cvtColor(gray_img, loop_match_img, CV_GRAY2RGB);
+            cv::Mat loop_match_img2;
+            loop_match_img2 = loop_match_img.clone();
+            /*
+            for(int i = 0; i< (int)cur_pts.size(); i++)
+            {
+                cv::Point2f cur_pt = cur_pts[i];
+                cur_pt.x += COL;
+                cv::circle(loop_match_img, cur_pt, 5, cv::Scalar(0, 255, 0));
+            }
+            for(int i = 0; i< (int)old_pts.size(); i++)
+            {
+                cv::circle(loop_match_img, old_pts[i], 5, cv::Scalar(0, 255, 0));
+            }
+            for (int i = 0; i< (int)old_pts.size(); i++)
+            {
+                cv::Point2f cur_pt = cur_pts[i];
+                cur_pt.x += COL ;
+                cv::line(loop_match_img, old_pts[i], cur_pt, cv::Scalar(0, 255, 0), 1, 8, 0);
+            }
+            ostringstream convert;
+            convert << "/home/tony-ws/raw_data/loop_image/"
+                    << cur_kf->global_index << "-" 
+                    << old_index << "-" << loop_fusion <<".jpg";
+            cv::imwrite( convert.str().c_str(), loop_match_img);
+            */
+            for(int i = 0; i< (int)measurements_cur.size(); i++)
+            {
+                cv::Point2f cur_pt = measurements_cur[i];
+                cur_pt.x += COL;
+                cv::circle(loop_match_img2, cur_pt, 5, cv::Scalar(0, 255, 0));
+            }
+            for(int i = 0; i< (int)measurements_old.size(); i++)
+            {
+                cv::circle(loop_match_img2, measurements_old[i], 5, cv::Scalar(0, 255, 0));
+            }
+            for (int i = 0; i< (int)measurements_old.size(); i++)
+            {
+                cv::Point2f cur_pt = measurements_cur[i];
+                cur_pt.x += COL ;
+                cv::line(loop_match_img2, measurements_old[i], cur_pt, cv::Scalar(0, 255, 0), 1, 8, 0);
+            }
+
+            ostringstream convert2;
+            convert2 << "/home/tony-ws/raw_data/loop_image/"
+                    << cur_kf->global_index << "-" 
+                    << old_index << "-" << loop_fusion <<"-2.jpg";
+            cv::imwrite( convert2.str().c_str(), loop_match_img2);
+        }
+          
+    }
+    //release memory
+    cur_kf->image.release();
+    global_frame_cnt++;
+
+    if (t_loop > 1000 || keyframe_database.size() > MAX_KEYFRAME_NUM)
+    {
+        m_keyframedatabase_resample.lock();
+        erase_index.clear();
+        keyframe_database.downsample(erase_index);
+        m_keyframedatabase_resample.unlock();
+        if(!erase_index.empty())
+            loop_closure->eraseIndex(erase_index);
+    }
 }
 
 //thread:loop detection
@@ -222,175 +488,31 @@ void process_loop_detection()
         loop_closure = new LoopClosure(voc_file, IMAGE_COL, IMAGE_ROW);
         ROS_DEBUG("loop load vocbulary %lf", t_load_voc.toc());
         loop_closure->initCameraModel(CAM_NAMES);
+        loop_closure->setMaxCandidates(LOOP_CANDIDATES);
     }
 
+    vector<KeyFrame*> batch;
+    vector<DBoW2::BowVector> bowvecs;
+    vector<DBoW2::FeatureVector> featvecs;
     while(LOOP_CLOSURE)
     {
-        KeyFrame* cur_kf = NULL; 
-        m_keyframe_buf.lock();
-        while(!keyframe_buf.empty())
-        {
-            if(cur_kf!=NULL)
-                delete cur_kf;
-            cur_kf = keyframe_buf.front();
-            keyframe_buf.pop();
-        }
-        m_keyframe_buf.unlock();
-        if (cur_kf != NULL)
+        int num = keyframe_queue.popBatch(batch, LOOP_BATCH_SIZE);
+        ROS_DEBUG("loop batch %d, queue depth %d peak %d, pushed %lu dropped %lu", num,
+                  keyframe_queue.depth(), keyframe_queue.peak(), keyframe_queue.pushed(), keyframe_queue.dropped());
+        // when behind, the keyframes of a batch are extracted and transformed concurrently
+        TicToc t_brief;
+        bowvecs.assign(num, DBoW2::BowVector());
+        featvecs.assign(num, DBoW2::FeatureVector());
+        loopClosureWorkerPool().parallelFor(num, [&](int i)
         {
-            cur_kf->global_index = global_frame_cnt;
-            m_keyframedatabase_resample.lock();
-            keyframe_database.add(cur_kf);
-            m_keyframedatabase_resample.unlock();
-
-            cv::Mat current_image;
-            current_image = cur_kf->image;   
-
-            bool loop_succ = false;
-            int old_index = -1;
-            vector<cv::Point2f> cur_pts;
-            vector<cv::Point2f> old_pts;
-            TicToc t_brief;
-            cur_kf->extractBrief(current_image);
-            //printf("loop extract %d feature using %lf\n", cur_kf->keypoints.size(), t_brief.toc());
-            TicToc t_loopdetect;
-            loop_succ = loop_closure->startLoopClosure(cur_kf->keypoints, cur_kf->descriptors, cur_pts, old_pts, old_index);
-            double t_loop = t_loopdetect.toc();
-            ROS_DEBUG("t_loopdetect %f ms", t_loop);
-            if(loop_succ)
-            {
-                KeyFrame* old_kf = keyframe_database.getKeyframe(old_index);
-                if (old_kf == NULL)
-                {
-                    ROS_WARN("NO such frame in keyframe_database");
-                    ROS_BREAK();
-                }
-                ROS_DEBUG("loop succ %d with %drd image", global_frame_cnt, old_index);
-                assert(old_index!=-1);
-                
-                Vector3d T_w_i_old, PnP_T_old;
-                Matrix3d R_w_i_old, PnP_R_old;
-
-                old_kf->getPose(T_w_i_old, R_w_i_old);
-                std::vector<cv::Point2f> measurements_old;
-                std::vector<cv::Point2f> measurements_old_norm;
-                std::vector<cv::Point2f> measurements_cur;
-                std::vector<int> features_id_matched;  
-                cur_kf->findConnectionWithOldFrame(old_kf, measurements_old, measurements_old_norm, PnP_T_old, PnP_R_old, m_camera);
-                measurements_cur = cur_kf->measurements_matched;
-                features_id_matched = cur_kf->features_id_matched;
-                // send loop info to VINS relocalization
-                int loop_fusion = 0;
-                if( (int)measurements_old_norm.size() > MIN_LOOP_NUM && global_frame_cnt - old_index > 35 && old_index > 30)
-                {
-
-                    Quaterniond PnP_Q_old(PnP_R_old);
-                    RetriveData retrive_data;
-                    retrive_data.cur_index = cur_kf->global_index;
-                    retrive_data.header = cur_kf->header;
-                    retrive_data.P_old = T_w_i_old;
-                    retrive_data.R_old = R_w_i_old;
-                    retrive_data.relative_pose = false;
-                    retrive_data.relocalized = false;
-                    retrive_data.measurements = measurements_old_norm;
-                    retrive_data.features_ids = features_id_matched;
-                    retrive_data.loop_pose[0] = PnP_T_old.x();
-                    retrive_data.loop_pose[1] = PnP_T_old.y();
-                    retrive_data.loop_pose[2] = PnP_T_old.z();
-                    retrive_data.loop_pose[3] = PnP_Q_old.x();
-                    retrive_data.loop_pose[4] = PnP_Q_old.y();
-                    retrive_data.loop_pose[5] = PnP_Q_old.z();
-                    retrive_data.loop_pose[6] = PnP_Q_old.w();
-                    m_retrive_data_buf.lock();
-                    retrive_data_buf.push(retrive_data);
-                    m_retrive_data_buf.unlock();
-                    cur_kf->detectLoop(old_index);
-                    old_kf->is_looped = 1;
-                    loop_fusion = 1;
-
-                    m_update_visualization.lock();
-                    keyframe_database.addLoop(old_index);
-                    CameraPoseVisualization* posegraph_visualization = keyframe_database.getPosegraphVisualization();
-                    pubPoseGraph(posegraph_visualization, cur_header);  
-                    m_update_visualization.unlock();
-                }
-
-
-                // visualization loop info
-                if(0 && loop_fusion)
-                {
-                    int COL = current_image.cols;
-                    //int ROW = current_image.rows;
-                    cv::Mat gray_img, loop_match_img;
-                    cv::Mat old_img = old_kf->image;
-                    cv::hconcat(old_img, current_image, gray_img);
-                    cvtColor(gray_img, loop_match_img, CV_GRAY2RGB);
-                    cv::Mat loop_match_img2;
-                    loop_match_img2 = loop_match_img.clone();
-                    /*
-                    for(int i = 0; i< (int)cur_pts.size(); i++)
-                    {
-                        cv::Point2f cur_pt = cur_pts[i];
-                        cur_pt.x += COL;
-                        cv::circle(loop_match_img, cur_pt, 5, cv::Scalar(0, 255, 0));
-                    }
-                    for(int i = 0; i< (int)old_pts.size(); i++)
-                    {
-                        cv::circle(loop_match_img, old_pts[i], 5, cv::Scalar(0, 255, 0));
-                    }
-                    for (int i = 0; i< (int)old_pts.size(); i++)
-                    {
-                        cv::Point2f cur_pt = cur_pts[i];
-                        cur_pt.x += COL ;
-                        cv::line(loop_match_img, old_pts[i], cur_pt, cv::Scalar(0, 255, 0), 1, 8, 0);
-                    }
-                    ostringstream convert;
-                    convert << "/home/tony-ws/raw_data/loop_image/"
-                            << cur_kf->global_index << "-" 
-                            << old_index << "-" << loop_fusion <<".jpg";
-                    cv::imwrite( convert.str().c_str(), loop_match_img);
-                    */
-                    for(int i = 0; i< (int)measurements_cur.size(); i++)
-                    {
-                        cv::Point2f cur_pt = measurements_cur[i];
-                        cur_pt.x += COL;
-                        cv::circle(loop_match_img2, cur_pt, 5, cv::Scalar(0, 255, 0));
-                    }
-                    for(int i = 0; i< (int)measurements_old.size(); i++)
-                    {
-                        cv::circle(loop_match_img2, measurements_old[i], 5, cv::Scalar(0, 255, 0));
-                    }
-                    for (int i = 0; i< (int)measurements_old.size(); i++)
-                    {
-                        cv::Point2f cur_pt = measurements_cur[i];
-                        cur_pt.x += COL ;
-                        cv::line(loop_match_img2, measurements_old[i], cur_pt, cv::Scalar(0, 255, 0), 1, 8, 0);
-                    }
-
-                    ostringstream convert2;
-                    convert2 << "/home/tony-ws/raw_data/loop_image/"
-                            << cur_kf->global_index << "-" 
-                            << old_index << "-" << loop_fusion <<"-2.jpg";
-                    cv::imwrite( convert2.str().c_str(), loop_match_img2);
-                }
-                  
-            }
-            //release memory
-            cur_kf->image.release();
-            global_frame_cnt++;
-
-            if (t_loop > 1000 || keyframe_database.size() > MAX_KEYFRAME_NUM)
-            {
-                m_keyframedatabase_resample.lock();
-                erase_index.clear();
-                keyframe_database.downsample(erase_index);
-                m_keyframedatabase_resample.unlock();
-                if(!erase_index.empty())
-                    loop_closure->eraseIndex(erase_index);
-            }
-        }
-        std::chrono::milliseconds dura(10);
-        std::this_thread::sleep_for(dura);
+            batch[i]->extractBrief(batch[i]->image);
+            if (LOOP_MATCH_MODE == 1)
+                batch[i]->buildFeatureNodes(loop_closure->demo.voc, LOOP_MATCH_LEVEL);
+            loop_closure->transform(batch[i]->features->descriptors, bowvecs[i], featvecs[i]);
+        });
+        ROS_DEBUG("loop extract %d keyframes %f ms", num, t_brief.toc());
+        for (int i = 0; i < num; i++)
+            detect_loop(batch[i], bowvecs[i], featvecs[i]);
     }
 }
 
@@ -424,7 +546,7 @@ void process_pose_graph()
             keyframe_database.updateVisualization();
             CameraPoseVisualization* posegraph_visualization = keyframe_database.getPosegraphVisualization();
             m_update_visualization.unlock();
-            pubOdometry(estimator, cur_header, relocalize_t, relocalize_r);
+            repost_snapshot(correct_t, correct_r);
             pubPoseGraph(posegraph_visualization, cur_header); 
             nav_msgs::Path refine_path = keyframe_database.getPath();
             updateLoopPath(refine_path);
@@ -435,141 +557,225 @@ void process_pose_graph()
     }
 }
 
-// thread: visual-inertial odometry
-void process()
+// runs the estimator on one frame and publishes the result
+void process_frame(EstimatorFrame &frame)
 {
-    while (true)
+    estimator.processIMU(*frame.imu_samples, frame.pre_integration.release());
+    estimator.processImage(frame.image, frame.header);
     {
-        std::vector<std::pair<std::vector<sensor_msgs::ImuConstPtr>, sensor_msgs::PointCloudConstPtr>> measurements;
-        std::unique_lock<std::mutex> lk(m_buf);
-        con.wait(lk, [&]
-                 {
-            return (measurements = getMeasurements()).size() != 0;
-                 });
-        lk.unlock();
-
-        for (auto &measurement : measurements)
+        std::lock_guard<std::mutex> lk(m_latest_bias);
+        latest_ba = estimator.Bas[estimator.frame_count];
+        latest_bg = estimator.Bgs[estimator.frame_count];
+    }
+    /**
+    *** start build keyframe database for loop closure
+    **/
+    if(LOOP_CLOSURE)
+    {
+        // remove previous loop
+        vector<RetriveData>::iterator it = estimator.retrive_data_vector.begin();
+        for(; it != estimator.retrive_data_vector.end(); )
         {
-            for (auto &imu_msg : measurement.first)
-                send_imu(imu_msg);
-
-            auto img_msg = measurement.second;
-            ROS_DEBUG("processing vision data with stamp %f \n", img_msg->header.stamp.toSec());
-
-            TicToc t_s;
-            map<int, vector<pair<int, Vector3d>>> image;
-            for (unsigned int i = 0; i < img_msg->points.size(); i++)
+            if ((*it).header < estimator.Headers[0].stamp.toSec())
             {
-                int v = img_msg->channels[0].values[i] + 0.5;
-                int feature_id = v / NUM_OF_CAM;
-                int camera_id = v % NUM_OF_CAM;
-                double x = img_msg->points[i].x;
-                double y = img_msg->points[i].y;
-                double z = img_msg->points[i].z;
-                ROS_ASSERT(z == 1);
-                image[feature_id].emplace_back(camera_id, Vector3d(x, y, z));
+                it = estimator.retrive_data_vector.erase(it);
             }
-            estimator.processImage(image, img_msg->header);
-            /**
-            *** start build keyframe database for loop closure
-            **/
-            if(LOOP_CLOSURE)
+            else
+                it++;
+        }
+        m_retrive_data_buf.lock();
+        while(!retrive_data_buf.empty())
+        {
+            RetriveData tmp_retrive_data = retrive_data_buf.front();
+            retrive_data_buf.pop();
+            estimator.retrive_data_vector.push_back(tmp_retrive_data);
+        }
+        m_retrive_data_buf.unlock();
+        //WINDOW_SIZE - 2 is key frame
+        if(estimator.marginalization_flag == 0 && estimator.solver_flag == estimator.NON_LINEAR)
+        {   
+            Vector3d vio_T_w_i = estimator.Ps[WINDOW_SIZE - 2];
+            Matrix3d vio_R_w_i = estimator.Rs[WINDOW_SIZE - 2];
+            i_buf.lock();
+            while(!image_buf.empty() && image_buf.front().second < estimator.Headers[WINDOW_SIZE - 2].stamp.toSec())
             {
-                // remove previous loop
-                vector<RetriveData>::iterator it = estimator.retrive_data_vector.begin();
-                for(; it != estimator.retrive_data_vector.end(); )
-                {
-                    if ((*it).header < estimator.Headers[0].stamp.toSec())
-                    {
-                        it = estimator.retrive_data_vector.erase(it);
-                    }
-                    else
-                        it++;
-                }
-                m_retrive_data_buf.lock();
-                while(!retrive_data_buf.empty())
+                image_buf.pop();
+            }
+            i_buf.unlock();
+            //assert(estimator.Headers[WINDOW_SIZE - 1].stamp.toSec() == image_buf.front().second);
+            // relative_T   i-1_T_i relative_R  i-1_R_i
+            cv::Mat KeyFrame_image;
+            KeyFrame_image = image_buf.front().first;
+            
+            const char *pattern_file = PATTERN_FILE.c_str();
+            Vector3d cur_T;
+            Matrix3d cur_R;
+            cur_T = relocalize_r * vio_T_w_i + relocalize_t;
+            cur_R = relocalize_r * vio_R_w_i;
+            KeyFrame* keyframe = new KeyFrame(estimator.Headers[WINDOW_SIZE - 2].stamp.toSec(), vio_T_w_i, vio_R_w_i, cur_T, cur_R, image_buf.front().first, pattern_file);
+            keyframe->setExtrinsic(estimator.tic[0], estimator.ric[0]);
+            keyframe->buildKeyFrameFeatures(estimator, m_camera);
+            keyframe_queue.push(keyframe);
+            // update loop info
+            if (!estimator.retrive_data_vector.empty() && estimator.retrive_data_vector[0].relative_pose)
+            {
+                if(estimator.Headers[0].stamp.toSec() == estimator.retrive_data_vector[0].header)
                 {
-                    RetriveData tmp_retrive_data = retrive_data_buf.front();
-                    retrive_data_buf.pop();
-                    estimator.retrive_data_vector.push_back(tmp_retrive_data);
-                }
-                m_retrive_data_buf.unlock();
-                //WINDOW_SIZE - 2 is key frame
-                if(estimator.marginalization_flag == 0 && estimator.solver_flag == estimator.NON_LINEAR)
-                {   
-                    Vector3d vio_T_w_i = estimator.Ps[WINDOW_SIZE - 2];
-                    Matrix3d vio_R_w_i = estimator.Rs[WINDOW_SIZE - 2];
-                    i_buf.lock();
-                    while(!image_buf.empty() && image_buf.front().second < estimator.Headers[WINDOW_SIZE - 2].stamp.toSec())
+                    KeyFrame* cur_kf = keyframe_database.getKeyframe(estimator.retrive_data_vector[0].cur_index);                            
+                    if (abs(estimator.retrive_data_vector[0].relative_yaw) > 30.0 || estimator.retrive_data_vector[0].relative_t.norm() > 20.0)
                     {
-                        image_buf.pop();
+                        ROS_DEBUG("Wrong loop");
+                        cur_kf->removeLoop();
                     }
-                    i_buf.unlock();
-                    //assert(estimator.Headers[WINDOW_SIZE - 1].stamp.toSec() == image_buf.front().second);
-                    // relative_T   i-1_T_i relative_R  i-1_R_i
-                    cv::Mat KeyFrame_image;
-                    KeyFrame_image = image_buf.front().first;
-                    
-                    const char *pattern_file = PATTERN_FILE.c_str();
-                    Vector3d cur_T;
-                    Matrix3d cur_R;
-                    cur_T = relocalize_r * vio_T_w_i + relocalize_t;
-                    cur_R = relocalize_r * vio_R_w_i;
-                    KeyFrame* keyframe = new KeyFrame(estimator.Headers[WINDOW_SIZE - 2].stamp.toSec(), vio_T_w_i, vio_R_w_i, cur_T, cur_R, image_buf.front().first, pattern_file);
-                    keyframe->setExtrinsic(estimator.tic[0], estimator.ric[0]);
-                    keyframe->buildKeyFrameFeatures(estimator, m_camera);
-                    m_keyframe_buf.lock();
-                    keyframe_buf.push(keyframe);
-                    m_keyframe_buf.unlock();
-                    // update loop info
-                    if (!estimator.retrive_data_vector.empty() && estimator.retrive_data_vector[0].relative_pose)
+                    else 
                     {
-                        if(estimator.Headers[0].stamp.toSec() == estimator.retrive_data_vector[0].header)
-                        {
-                            KeyFrame* cur_kf = keyframe_database.getKeyframe(estimator.retrive_data_vector[0].cur_index);                            
-                            if (abs(estimator.retrive_data_vector[0].relative_yaw) > 30.0 || estimator.retrive_data_vector[0].relative_t.norm() > 20.0)
-                            {
-                                ROS_DEBUG("Wrong loop");
-                                cur_kf->removeLoop();
-                            }
-                            else 
-                            {
-                                cur_kf->updateLoopConnection( estimator.retrive_data_vector[0].relative_t, 
-                                                              estimator.retrive_data_vector[0].relative_q, 
-                                                              estimator.retrive_data_vector[0].relative_yaw);
-                                m_posegraph_buf.lock();
-                                optimize_posegraph_buf.push(estimator.retrive_data_vector[0].cur_index);
-                                m_posegraph_buf.unlock();
-                            }
-                        }
+                        cur_kf->updateLoopConnection( estimator.retrive_data_vector[0].relative_t, 
+                                                      estimator.retrive_data_vector[0].relative_q, 
+                                                      estimator.retrive_data_vector[0].relative_yaw);
+                        m_posegraph_buf.lock();
+                        optimize_posegraph_buf.push(estimator.retrive_data_vector[0].cur_index);
+                        m_posegraph_buf.unlock();
                     }
                 }
             }
-            double whole_t = t_s.toc();
-            printStatistics(estimator, whole_t);
-            std_msgs::Header header = img_msg->header;
-            header.frame_id = "world";
-            cur_header = header;
-            m_loop_drift.lock();
-            if (estimator.relocalize)
-            {
-                relocalize_t = estimator.relocalize_t;
-                relocalize_r = estimator.relocalize_r;
-            }
-            pubOdometry(estimator, header, relocalize_t, relocalize_r);
-            pubKeyPoses(estimator, header, relocalize_t, relocalize_r);
-            pubCameraPose(estimator, header, relocalize_t, relocalize_r);
-            pubPointCloud(estimator, header, relocalize_t, relocalize_r);
-            pubTF(estimator, header, relocalize_t, relocalize_r);
-            m_loop_drift.unlock();
-            //ROS_ERROR("end: %f, at %f", img_msg->header.stamp.toSec(), ros::Time::now().toSec());
         }
-        m_buf.lock();
-        m_state.lock();
-        if (estimator.solver_flag == Estimator::SolverFlag::NON_LINEAR)
-            update();
-        m_state.unlock();
-        m_buf.unlock();
+    }
+    double whole_t = frame.t_s.toc();
+    std_msgs::Header header = frame.header;
+    header.frame_id = "world";
+    cur_header = header;
+    EstimatorRecord record;
+    record.header = header;
+    record.whole_t = whole_t;
+    record.odometry_only = false;
+    record.capture(estimator);
+    EstimatorSnapshot snapshot;
+    snapshot.header = header;
+    snapshot.capture(estimator);
+    m_loop_drift.lock();
+    if (estimator.relocalize)
+    {
+        relocalize_t = estimator.relocalize_t;
+        relocalize_r = estimator.relocalize_r;
+    }
+    record.loop_correct_t = snapshot.loop_correct_t = relocalize_t;
+    record.loop_correct_r = snapshot.loop_correct_r = relocalize_r;
+    bool non_linear = estimator.solver_flag == Estimator::SolverFlag::NON_LINEAR;
+    if (non_linear)
+        update(frame.imu_time);
+    m_loop_drift.unlock();
+    odometry_ready.store(non_linear, std::memory_order_release);
+    post_snapshot(std::move(record), std::move(snapshot));
+}
+
+// thread: publishes estimator results, the estimator never waits for ros serialization
+void process_publish()
+{
+    deque<EstimatorRecord> records;
+    while (true)
+    {
+        std::unique_lock<std::mutex> lk(m_snapshot_buf);
+        con_snapshot.wait(lk, [&]
+                 {
+            return !record_buf.empty() || has_pending_snapshot;
+                 });
+        records.swap(record_buf);
+        bool has_snapshot = has_pending_snapshot;
+        EstimatorSnapshot snapshot;
+        if (has_snapshot)
+            snapshot = std::move(pending_snapshot);
+        has_pending_snapshot = false;
+        lk.unlock();
+
+        for (auto &record : records)
+        {
+            pubOdometry(record);
+            if (record.odometry_only)
+                continue;
+            printStatistics(record);
+            pubTF(record);
+        }
+        records.clear();
+        // visualization of the newest frame only
+        if (!has_snapshot)
+            continue;
+        pubKeyPoses(snapshot);
+        pubCameraPose(snapshot);
+        pubPointCloud(snapshot);
+    }
+}
+
+// thread: estimator stage of the pipeline, the process thread keeps preprocessing the next frame
+void process_estimator()
+{
+    while (true)
+    {
+        EstimatorFrame frame;
+        std::unique_lock<std::mutex> lk(m_estimator_frame_buf);
+        con_estimator_frame.wait(lk, [&]
+                 {
+            return !estimator_frame_buf.empty();
+                 });
+        frame = std::move(estimator_frame_buf.front());
+        estimator_frame_buf.pop();
+        lk.unlock();
+        con_estimator_frame.notify_all();
+
+        process_frame(frame);
+    }
+}
+
+// thread: visual-inertial odometry
+void process()
+{
+    while (true)
+    {
+        // take everything that arrived, so the sync policy sees the real backlog
+        sensor_msgs::ImuConstPtr imu_msg;
+        bool imu_taken = false;
+        while (imu_ring.pop(imu_msg))
+        {
+            measurement_sync.pushImu(imu_msg);
+            imu_taken = true;
+        }
+        if (imu_taken)
+            notify_imu_ring();
+        sensor_msgs::PointCloudConstPtr feature_msg;
+        while (feature_ring.pop(feature_msg))
+            measurement_sync.pushFeature(feature_msg);
+
+        Measurement measurement;
+        if (!measurement_sync.next(measurement))
+        {
+            std::unique_lock<std::mutex> lk(m_con);
+            con.wait(lk, [&]
+                     {
+                return !imu_ring.empty() || !feature_ring.empty();
+                     });
+            continue;
+        }
+        ROS_DEBUG("sync depth %d age %f, emitted %lu shed %lu unsynced %lu",
+                  measurement_sync.depth(), measurement_sync.age(), measurement_sync.emitted_cnt,
+                  measurement_sync.shed_cnt, measurement_sync.unsynced_cnt);
+        ROS_DEBUG("imu ring peak %lu/%lu waited %lu, feature ring peak %lu/%lu dropped %lu",
+                  imu_ring.peak(), imu_ring.capacity(), imu_ring.dropped(),
+                  feature_ring.peak(), feature_ring.capacity(), feature_ring.dropped());
+
+        EstimatorFrame frame;
+        prepare_frame(measurement, frame);
+        if (ESTIMATOR_PIPELINE)
+        {
+            std::unique_lock<std::mutex> lk_frame(m_estimator_frame_buf);
+            con_estimator_frame.wait(lk_frame, [&]
+                     {
+                return (int)estimator_frame_buf.size() < ESTIMATOR_FRAME_BUF_SIZE;
+                     });
+            estimator_frame_buf.push(std::move(frame));
+            lk_frame.unlock();
+            con_estimator_frame.notify_all();
+        }
+        else
+            process_frame(frame);
     }
 }
 
@@ -580,6 +786,8 @@ int main(int argc, char **argv)
     ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME, ros::console::levels::Info);
     readParameters(n);
     estimator.setParameter();
+    imu_presum.setSumNum(IMU_PRESUM_NUM);
+    measurement_sync.setPolicy(SYNC_POLICY, SYNC_MAX_DEPTH, SYNC_MAX_AGE, MIN_PARALLAX);
 #ifdef EIGEN_DONT_PARALLELIZE
     ROS_DEBUG("EIGEN_DONT_PARALLELIZE");
 #endif
@@ -587,15 +795,21 @@ int main(int argc, char **argv)
 
     registerPub(n);
 
-    ros::Subscriber sub_imu = n.subscribe(IMU_TOPIC, 2000, imu_callback, ros::TransportHints().tcpNoDelay());
-    ros::Subscriber sub_image = n.subscribe("/feature_tracker/feature", 2000, feature_callback);
+    ros::Subscriber sub_imu = n.subscribe(IMU_TOPIC, IMU_RING_SIZE, imu_callback, ros::TransportHints().tcpNoDelay());
+    ros::Subscriber sub_image = n.subscribe("/feature_tracker/feature", FEATURE_RING_SIZE, feature_callback);
     ros::Subscriber sub_raw_image = n.subscribe(IMAGE_TOPIC, 2000, raw_image_callback);
 
     std::thread measurement_process{process};
+    std::thread estimator_process;
+    if (ESTIMATOR_PIPELINE)
+        estimator_process = std::thread(process_estimator);
+    std::thread publish_process{process_publish};
     std::thread loop_detection, pose_graph;
     if (LOOP_CLOSURE)
     {
         ROS_WARN("LOOP_CLOSURE true");
+        keyframe_queue.setCapacity(LOOP_QUEUE_SIZE);
+        setLoopClosureThreads(LOOP_THREADS);
         loop_detection = std::thread(process_loop_detection);   
         pose_graph = std::thread(process_pose_graph);
         m_camera = CameraFactory::instance()->generateCameraFromYamlFile(CAM_NAMES);
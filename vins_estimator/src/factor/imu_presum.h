@@ -0,0 +1,95 @@
+#pragma once
+
+#include <eigen3/Eigen/Dense>
+
+struct ImuPreSumStep
+{
+    double dt;
+    Eigen::Vector3d acc, gyr;
+    int sum_num;
+};
+
+// Combines consecutive raw imu samples into one constant-rate integration step.
+// Raw samples are integrated with the same mid-point rule as IntegrationBase, and the
+// coning (rotation) and sculling (velocity) cross terms are accumulated in the frame at
+// the start of the step, so that the summed step reproduces the raw delta angle/velocity.
+class ImuPreSum
+{
+  public:
+    ImuPreSum() : sum_num{1}
+    {
+        clearState();
+    }
+
+    void setSumNum(int _sum_num)
+    {
+        sum_num = _sum_num < 1 ? 1 : _sum_num;
+    }
+
+    void clearState()
+    {
+        first_imu = true;
+        reset();
+    }
+
+    // returns true once sum_num samples have been accumulated and a step can be flushed
+    bool push_back(double dt, const Eigen::Vector3d &acc, const Eigen::Vector3d &gyr)
+    {
+        if (first_imu || dt <= 0)
+        {
+            first_imu = false;
+            acc_0 = acc;
+            gyr_0 = gyr;
+            return false;
+        }
+
+        Eigen::Vector3d d_alpha = 0.5 * (gyr_0 + gyr) * dt;
+        Eigen::Vector3d d_nu = 0.5 * (acc_0 + acc) * dt;
+
+        // sculling: rotate the velocity increment by the attitude at the middle of the sample
+        nu += d_nu + (alpha + 0.5 * d_alpha).cross(d_nu);
+        // coning: non-commutativity of consecutive rotation increments
+        alpha += d_alpha + 0.5 * alpha.cross(d_alpha);
+        sum_dt += dt;
+        cnt++;
+
+        acc_0 = acc;
+        gyr_0 = gyr;
+        return cnt >= sum_num;
+    }
+
+    // emits the accumulated samples (also a partial group) as one step with mean rates.
+    // IntegrationBase re-applies 0.5 * (I + dR) to a constant acceleration, so the first
+    // order rotation term is taken out of the velocity increment here.
+    bool flush(ImuPreSumStep &step)
+    {
+        if (cnt == 0)
+            return false;
+        step.dt = sum_dt;
+        step.gyr = alpha / sum_dt;
+        step.acc = (nu - 0.5 * alpha.cross(nu)) / sum_dt;
+        step.sum_num = cnt;
+        reset();
+        return true;
+    }
+
+    bool empty() const
+    {
+        return cnt == 0;
+    }
+
+  private:
+    void reset()
+    {
+        cnt = 0;
+        sum_dt = 0.0;
+        alpha.setZero();
+        nu.setZero();
+    }
+
+    int sum_num, cnt;
+    bool first_imu;
+    double sum_dt;
+    Eigen::Vector3d acc_0, gyr_0;
+    Eigen::Vector3d alpha, nu;
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <vector>
+#include <eigen3/Eigen/Dense>
+
+struct ImuSample
+{
+    double dt;
+    Eigen::Vector3d acc, gyr;
+    int sum_num;
+};
+
+// Shared storage for the imu samples of the sliding window. Samples keep a monotonically
+// increasing index, so window frames and preintegrations only hold [begin, end) ranges
+// into the ring instead of their own copies. The ring doubles in size if the window ever
+// holds more samples than the preallocated capacity.
+class ImuSampleRing
+{
+  public:
+    ImuSampleRing(int capacity = 4096)
+    {
+        int size = 1;
+        while (size < capacity)
+            size <<= 1;
+        buf.resize(size);
+        mask = size - 1;
+        clearState();
+    }
+
+    void clearState()
+    {
+        head = 0;
+        tail = 0;
+    }
+
+    long push_back(double dt, const Eigen::Vector3d &acc, const Eigen::Vector3d &gyr, int sum_num)
+    {
+        if (tail - head == static_cast<long>(buf.size()))
+            grow();
+        ImuSample &sample = buf[tail & mask];
+        sample.dt = dt;
+        sample.acc = acc;
+        sample.gyr = gyr;
+        sample.sum_num = sum_num;
+        return tail++;
+    }
+
+    const ImuSample &operator[](long idx) const
+    {
+        return buf[idx & mask];
+    }
+
+    // samples before idx are no longer referenced by any frame and may be overwritten
+    void discardBefore(long idx)
+    {
+        if (idx > tail)
+            idx = tail;
+        if (idx > head)
+            head = idx;
+    }
+
+    long begin() const
+    {
+        return head;
+    }
+
+    long end() const
+    {
+        return tail;
+    }
+
+  private:
+    void grow()
+    {
+        std::vector<ImuSample> tmp_buf(buf.size() * 2);
+        long tmp_mask = tmp_buf.size() - 1;
+        for (long i = head; i < tail; i++)
+            tmp_buf[i & tmp_mask] = buf[i & mask];
+        buf.swap(tmp_buf);
+        mask = tmp_mask;
+    }
+
+    std::vector<ImuSample> buf;
+    long mask;
+    long head, tail;
+};
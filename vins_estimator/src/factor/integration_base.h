@@ -2,6 +2,7 @@
 
 #include "../utility/utility.h"
 #include "../parameters.h"
+#include "imu_sample_ring.h"
 
 #include <ceres/ceres.h>
 using namespace Eigen;
@@ -10,12 +11,13 @@ class IntegrationBase
 {
   public:
     IntegrationBase() = delete;
-    IntegrationBase(const Eigen::Vector3d &_acc_0, const Eigen::Vector3d &_gyr_0,
+    IntegrationBase(const ImuSampleRing *_samples, const Eigen::Vector3d &_acc_0, const Eigen::Vector3d &_gyr_0,
                     const Eigen::Vector3d &_linearized_ba, const Eigen::Vector3d &_linearized_bg)
         : acc_0{_acc_0}, gyr_0{_gyr_0}, linearized_acc{_acc_0}, linearized_gyr{_gyr_0},
           linearized_ba{_linearized_ba}, linearized_bg{_linearized_bg},
             jacobian{Eigen::Matrix<double, 15, 15>::Identity()}, covariance{Eigen::Matrix<double, 15, 15>::Zero()},
-          sum_dt{0.0}, delta_p{Eigen::Vector3d::Zero()}, delta_q{Eigen::Quaterniond::Identity()}, delta_v{Eigen::Vector3d::Zero()}
+          sum_dt{0.0}, delta_p{Eigen::Vector3d::Zero()}, delta_q{Eigen::Quaterniond::Identity()}, delta_v{Eigen::Vector3d::Zero()},
+          samples{_samples}, sample_begin{_samples->end()}, sample_end{_samples->end()}
 
     {
         noise = Eigen::Matrix<double, 18, 18>::Zero();
@@ -27,12 +29,24 @@ class IntegrationBase
         noise.block<3, 3>(15, 15) =  (GYR_W * GYR_W) * Eigen::Matrix3d::Identity();
     }
 
-    void push_back(double dt, const Eigen::Vector3d &acc, const Eigen::Vector3d &gyr)
+    // idx refers to the shared sample ring, the samples of one preintegration are contiguous.
+    // sum_num > 0 marks a pre-summed step (see ImuPreSum) whose rates are interval means
+    void push_back(long idx)
     {
-        dt_buf.push_back(dt);
-        acc_buf.push_back(acc);
-        gyr_buf.push_back(gyr);
-        propagate(dt, acc, gyr);
+        ROS_ASSERT(idx == sample_end || sample_begin == sample_end);
+        if (sample_begin == sample_end)
+            sample_begin = idx;
+        sample_end = idx + 1;
+        const ImuSample &sample = (*samples)[idx];
+        propagate(sample.dt, sample.acc, sample.gyr, sample.sum_num);
+    }
+
+    // moves the preintegration onto storage that holds its samples from begin on
+    void rebase(const ImuSampleRing *_samples, long begin)
+    {
+        sample_end = begin + (sample_end - sample_begin);
+        sample_begin = begin;
+        samples = _samples;
     }
 
     void repropagate(const Eigen::Vector3d &_linearized_ba, const Eigen::Vector3d &_linearized_bg)
@@ -47,8 +61,11 @@ class IntegrationBase
         linearized_bg = _linearized_bg;
         jacobian.setIdentity();
         covariance.setZero();
-        for (int i = 0; i < static_cast<int>(dt_buf.size()); i++)
-            propagate(dt_buf[i], acc_buf[i], gyr_buf[i]);
+        for (long i = sample_begin; i < sample_end; i++)
+        {
+            const ImuSample &sample = (*samples)[i];
+            propagate(sample.dt, sample.acc, sample.gyr, sample.sum_num);
+        }
     }
 
     void midPointIntegration(double _dt, 
@@ -57,7 +74,8 @@ class IntegrationBase
                             const Eigen::Vector3d &delta_p, const Eigen::Quaterniond &delta_q, const Eigen::Vector3d &delta_v,
                             const Eigen::Vector3d &linearized_ba, const Eigen::Vector3d &linearized_bg,
                             Eigen::Vector3d &result_delta_p, Eigen::Quaterniond &result_delta_q, Eigen::Vector3d &result_delta_v,
-                            Eigen::Vector3d &result_linearized_ba, Eigen::Vector3d &result_linearized_bg, bool update_jacobian)
+                            Eigen::Vector3d &result_linearized_ba, Eigen::Vector3d &result_linearized_bg, bool update_jacobian,
+                            double noise_scale = 1.0)
     {
         //ROS_INFO("midpoint integration");
         Vector3d un_acc_0 = delta_q * (_acc_0 - linearized_ba);
@@ -122,13 +140,20 @@ class IntegrationBase
             //step_jacobian = F;
             //step_V = V;
             jacobian = F * jacobian;
-            covariance = F * covariance * F.transpose() + V * noise * V.transpose();
+            covariance = F * covariance * F.transpose() + noise_scale * V * noise * V.transpose();
         }
 
     }
 
-    void propagate(double _dt, const Eigen::Vector3d &_acc_1, const Eigen::Vector3d &_gyr_1)
+    void propagate(double _dt, const Eigen::Vector3d &_acc_1, const Eigen::Vector3d &_gyr_1, int sum_num = 0)
     {
+        // a pre-summed step is integrated at constant rate, and the noise of its mean rates
+        // is 1 / sum_num of a single sample so the covariance grows as with the raw samples
+        if (sum_num > 0)
+        {
+            acc_0 = _acc_1;
+            gyr_0 = _gyr_1;
+        }
         dt = _dt;
         acc_1 = _acc_1;
         gyr_1 = _gyr_1;
@@ -141,7 +166,8 @@ class IntegrationBase
         midPointIntegration(_dt, acc_0, gyr_0, _acc_1, _gyr_1, delta_p, delta_q, delta_v,
                             linearized_ba, linearized_bg,
                             result_delta_p, result_delta_q, result_delta_v,
-                            result_linearized_ba, result_linearized_bg, 1);
+                            result_linearized_ba, result_linearized_bg, 1,
+                            sum_num > 1 ? 1.0 / sum_num : 1.0);
 
         //checkJacobian(_dt, acc_0, gyr_0, acc_1, gyr_1, delta_p, delta_q, delta_v,
         //                    linearized_ba, linearized_bg);
@@ -202,9 +228,8 @@ class IntegrationBase
     Eigen::Quaterniond delta_q;
     Eigen::Vector3d delta_v;
 
-    std::vector<double> dt_buf;
-    std::vector<Eigen::Vector3d> acc_buf;
-    std::vector<Eigen::Vector3d> gyr_buf;
+    const ImuSampleRing *samples;
+    long sample_begin, sample_end;
 
 };
 /*
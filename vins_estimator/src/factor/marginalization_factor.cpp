@@ -71,9 +71,6 @@ void ResidualBlockInfo::Evaluate()
 MarginalizationInfo::~MarginalizationInfo()
 {
     //ROS_WARN("release marginlizationinfo");
-    
-    for (auto it = parameter_block_data.begin(); it != parameter_block_data.end(); ++it)
-        delete it->second;
 
     for (int i = 0; i < (int)factors.size(); i++)
     {
@@ -86,46 +83,53 @@ MarginalizationInfo::~MarginalizationInfo()
     }
 }
 
+int MarginalizationInfo::registerParameterBlock(double *addr, int size)
+{
+    auto it = parameter_block_id.find(addr);
+    if (it != parameter_block_id.end())
+        return it->second;
+
+    int id = static_cast<int>(parameter_block_addr.size());
+    parameter_block_id[addr] = id;
+    parameter_block_addr.push_back(addr);
+    parameter_block_size.push_back(size);
+    parameter_block_idx.push_back(0);
+    parameter_block_drop.push_back(false);
+    return id;
+}
+
 void MarginalizationInfo::addResidualBlockInfo(ResidualBlockInfo *residual_block_info)
 {
     factors.emplace_back(residual_block_info);
 
     std::vector<double *> &parameter_blocks = residual_block_info->parameter_blocks;
-    std::vector<int> parameter_block_sizes = residual_block_info->cost_function->parameter_block_sizes();
+    const std::vector<int> &parameter_block_sizes = residual_block_info->cost_function->parameter_block_sizes();
 
-    for (int i = 0; i < static_cast<int>(residual_block_info->parameter_blocks.size()); i++)
-    {
-        double *addr = parameter_blocks[i];
-        int size = parameter_block_sizes[i];
-        parameter_block_size[reinterpret_cast<long>(addr)] = size;
-    }
+    residual_block_info->parameter_block_ids.resize(parameter_blocks.size());
+    for (int i = 0; i < static_cast<int>(parameter_blocks.size()); i++)
+        residual_block_info->parameter_block_ids[i] = registerParameterBlock(parameter_blocks[i], parameter_block_sizes[i]);
 
     for (int i = 0; i < static_cast<int>(residual_block_info->drop_set.size()); i++)
-    {
-        double *addr = parameter_blocks[residual_block_info->drop_set[i]];
-        parameter_block_idx[reinterpret_cast<long>(addr)] = 0;
-    }
+        parameter_block_drop[residual_block_info->parameter_block_ids[residual_block_info->drop_set[i]]] = true;
 }
 
 void MarginalizationInfo::preMarginalize()
 {
     for (auto it : factors)
-    {
         it->Evaluate();
 
-        std::vector<int> block_sizes = it->cost_function->parameter_block_sizes();
-        for (int i = 0; i < static_cast<int>(block_sizes.size()); i++)
-        {
-            long addr = reinterpret_cast<long>(it->parameter_blocks[i]);
-            int size = block_sizes[i];
-            if (parameter_block_data.find(addr) == parameter_block_data.end())
-            {
-                double *data = new double[size];
-                memcpy(data, it->parameter_blocks[i], sizeof(double) * size);
-                parameter_block_data[addr] = data;
-            }
-        }
+    // one flat copy of the linearization point
+    int num_blocks = static_cast<int>(parameter_block_addr.size());
+    parameter_block_data_idx.resize(num_blocks);
+    int data_size = 0;
+    for (int id = 0; id < num_blocks; id++)
+    {
+        parameter_block_data_idx[id] = data_size;
+        data_size += parameter_block_size[id];
     }
+    parameter_block_data.resize(data_size);
+    for (int id = 0; id < num_blocks; id++)
+        memcpy(parameter_block_data.data() + parameter_block_data_idx[id], parameter_block_addr[id], sizeof(double) * parameter_block_size[id]);
 }
 
 int MarginalizationInfo::localSize(int size) const
@@ -138,62 +142,63 @@ int MarginalizationInfo::globalSize(int size) const
     return size == 6 ? 7 : size;
 }
 
-void* ThreadsConstructA(void* threadsstruct)
+WorkerPool &MarginalizationInfo::workerPool()
 {
-    ThreadsStruct* p = ((ThreadsStruct*)threadsstruct);
-    for (auto it : p->sub_factors)
-    {
-        for (int i = 0; i < static_cast<int>(it->parameter_blocks.size()); i++)
-        {
-            int idx_i = p->parameter_block_idx[reinterpret_cast<long>(it->parameter_blocks[i])];
-            int size_i = p->parameter_block_size[reinterpret_cast<long>(it->parameter_blocks[i])];
-            if (size_i == 7)
-                size_i = 6;
-            Eigen::MatrixXd jacobian_i = it->jacobians[i].leftCols(size_i);
-            for (int j = i; j < static_cast<int>(it->parameter_blocks.size()); j++)
-            {
-                int idx_j = p->parameter_block_idx[reinterpret_cast<long>(it->parameter_blocks[j])];
-                int size_j = p->parameter_block_size[reinterpret_cast<long>(it->parameter_blocks[j])];
-                if (size_j == 7)
-                    size_j = 6;
-                Eigen::MatrixXd jacobian_j = it->jacobians[j].leftCols(size_j);
-                if (i == j)
-                    p->A.block(idx_i, idx_j, size_i, size_j) += jacobian_i.transpose() * jacobian_j;
-                else
-                {
-                    p->A.block(idx_i, idx_j, size_i, size_j) += jacobian_i.transpose() * jacobian_j;
-                    p->A.block(idx_j, idx_i, size_j, size_i) = p->A.block(idx_i, idx_j, size_i, size_j).transpose();
-                }
-            }
-            p->b.segment(idx_i, size_i) += jacobian_i.transpose() * it->residuals;
-        }
-    }
-    return threadsstruct;
+    static WorkerPool pool;
+    return pool;
+}
+
+// pseudo-inverse of a small dense symmetric block, LDLT first and eigen-decomposition
+// only if the block turns out to be rank deficient
+static Eigen::MatrixXd pseudoInverse(const Eigen::MatrixXd &A, double eps)
+{
+    Eigen::LDLT<Eigen::MatrixXd> ldlt(A);
+    if (ldlt.info() == Eigen::Success && ldlt.isPositive() && ldlt.vectorD().minCoeff() > eps)
+        return ldlt.solve(Eigen::MatrixXd::Identity(A.rows(), A.cols()));
+
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> saes(A);
+    return saes.eigenvectors() * Eigen::VectorXd((saes.eigenvalues().array() > eps).select(saes.eigenvalues().array().inverse(), 0)).asDiagonal() * saes.eigenvectors().transpose();
 }
 
 void MarginalizationInfo::marginalize()
 {
+    // dropped inverse depths first, they only couple to poses so their block of A is diagonal
+    int num_blocks = static_cast<int>(parameter_block_addr.size());
     int pos = 0;
-    for (auto &it : parameter_block_idx)
+    for (int id = 0; id < num_blocks; id++)
+    {
+        if (parameter_block_drop[id] && parameter_block_size[id] == 1)
+        {
+            parameter_block_idx[id] = pos;
+            pos += 1;
+        }
+    }
+
+    int ml = pos;
+
+    for (int id = 0; id < num_blocks; id++)
     {
-        it.second = pos;
-        pos += localSize(parameter_block_size[it.first]);
+        if (parameter_block_drop[id] && parameter_block_size[id] != 1)
+        {
+            parameter_block_idx[id] = pos;
+            pos += localSize(parameter_block_size[id]);
+        }
     }
 
     m = pos;
 
-    for (const auto &it : parameter_block_size)
+    for (int id = 0; id < num_blocks; id++)
     {
-        if (parameter_block_idx.find(it.first) == parameter_block_idx.end())
+        if (!parameter_block_drop[id])
         {
-            parameter_block_idx[it.first] = pos;
-            pos += localSize(it.second);
+            parameter_block_idx[id] = pos;
+            pos += localSize(parameter_block_size[id]);
         }
     }
 
     n = pos - m;
 
-    //ROS_DEBUG("marginalization, pos: %d, m: %d, n: %d, size: %d", pos, m, n, (int)parameter_block_idx.size());
+    //ROS_DEBUG("marginalization, pos: %d, m: %d, n: %d, size: %d", pos, m, n, num_blocks);
 
     TicToc t_summing;
     Eigen::MatrixXd A(pos, pos);
@@ -227,71 +232,83 @@ void MarginalizationInfo::marginalize()
     ROS_INFO("summing up costs %f ms", t_summing.toc());
     */
     //multi thread
-
-
+    // each task owns the rows of one parameter block, so threads write disjoint parts of A and b
     TicToc t_thread_summing;
-    pthread_t tids[NUM_THREADS];
-    ThreadsStruct threadsstruct[NUM_THREADS];
-    int i = 0;
+    std::vector<std::vector<std::pair<ResidualBlockInfo *, int>>> block_factors(num_blocks);
     for (auto it : factors)
+        for (int i = 0; i < static_cast<int>(it->parameter_block_ids.size()); i++)
+            block_factors[it->parameter_block_ids[i]].emplace_back(it, i);
+
+    workerPool().parallelFor(num_blocks, [&](int id)
     {
-        threadsstruct[i].sub_factors.push_back(it);
-        i++;
-        i = i % NUM_THREADS;
-    }
-    for (int i = 0; i < NUM_THREADS; i++)
-    {
-        TicToc zero_matrix;
-        threadsstruct[i].A = Eigen::MatrixXd::Zero(pos,pos);
-        threadsstruct[i].b = Eigen::VectorXd::Zero(pos);
-        threadsstruct[i].parameter_block_size = parameter_block_size;
-        threadsstruct[i].parameter_block_idx = parameter_block_idx;
-        int ret = pthread_create( &tids[i], NULL, ThreadsConstructA ,(void*)&(threadsstruct[i]));
-        if (ret != 0)
+        int idx_i = parameter_block_idx[id];
+        int size_i = localSize(parameter_block_size[id]);
+        for (const auto &factor_i : block_factors[id])
         {
-            ROS_WARN("pthread_create error");
-            ROS_BREAK();
+            ResidualBlockInfo *it = factor_i.first;
+            auto jacobian_i = it->jacobians[factor_i.second].leftCols(size_i);
+            for (int j = 0; j < static_cast<int>(it->parameter_block_ids.size()); j++)
+            {
+                int id_j = it->parameter_block_ids[j];
+                int idx_j = parameter_block_idx[id_j];
+                int size_j = localSize(parameter_block_size[id_j]);
+                A.block(idx_i, idx_j, size_i, size_j).noalias() += jacobian_i.transpose() * it->jacobians[j].leftCols(size_j);
+            }
+            b.segment(idx_i, size_i).noalias() += jacobian_i.transpose() * it->residuals;
         }
-    }
-    for( int i = NUM_THREADS - 1; i >= 0; i--)  
-    {
-        pthread_join( tids[i], NULL ); 
-        A += threadsstruct[i].A;
-        b += threadsstruct[i].b;
-    }
+    });
     //ROS_DEBUG("thread summing up costs %f ms", t_thread_summing.toc());
-    //ROS_INFO("A diff %f , b diff %f ", (A - tmp_A).sum(), (b - tmp_b).sum());
-
 
-    //TODO
-    Eigen::MatrixXd Amm = 0.5 * (A.block(0, 0, m, m) + A.block(0, 0, m, m).transpose());
-    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> saes(Amm);
 
-    //ROS_ASSERT_MSG(saes.eigenvalues().minCoeff() >= -1e-4, "min eigenvalue %f", saes.eigenvalues().minCoeff());
-
-    Eigen::MatrixXd Amm_inv = saes.eigenvectors() * Eigen::VectorXd((saes.eigenvalues().array() > eps).select(saes.eigenvalues().array().inverse(), 0)).asDiagonal() * saes.eigenvectors().transpose();
-    //printf("error1: %f\n", (Amm * Amm_inv - Eigen::MatrixXd::Identity(m, m)).sum());
-
-    Eigen::VectorXd bmm = b.segment(0, m);
-    Eigen::MatrixXd Amr = A.block(0, m, m, n);
-    Eigen::MatrixXd Arm = A.block(m, 0, n, m);
-    Eigen::MatrixXd Arr = A.block(m, m, n, n);
-    Eigen::VectorXd brr = b.segment(m, n);
-    A = Arr - Arm * Amm_inv * Amr;
-    b = brr - Arm * Amm_inv * bmm;
-
-    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> saes2(A);
-    Eigen::VectorXd S = Eigen::VectorXd((saes2.eigenvalues().array() > eps).select(saes2.eigenvalues().array(), 0));
-    Eigen::VectorXd S_inv = Eigen::VectorXd((saes2.eigenvalues().array() > eps).select(saes2.eigenvalues().array().inverse(), 0));
+    // eliminate the inverse depths, their 1x1 blocks are inverted directly
+    int k = pos - ml, mx = m - ml;
+    Eigen::VectorXd Dll = A.diagonal().head(ml);
+    Eigen::VectorXd Dll_inv = Eigen::VectorXd((Dll.array() > eps).select(Dll.array().inverse(), 0));
+    Eigen::MatrixXd Akk = A.bottomRightCorner(k, k);
+    if (ml > 0)
+    {
+        Eigen::MatrixXd W = A.block(ml, 0, k, ml) * Dll_inv.cwiseSqrt().asDiagonal();
+        Akk.selfadjointView<Eigen::Lower>().rankUpdate(W, -1.0);
+        Akk.triangularView<Eigen::StrictlyUpper>() = Akk.transpose();
+    }
+    Eigen::VectorXd bk = b.tail(k) - A.block(ml, 0, k, ml) * Dll_inv.cwiseProduct(b.head(ml));
+
+    // then the dropped pose / speed bias blocks, a small dense block
+    Eigen::MatrixXd Axx = 0.5 * (Akk.topLeftCorner(mx, mx) + Akk.topLeftCorner(mx, mx).transpose());
+    Eigen::MatrixXd Axx_inv = pseudoInverse(Axx, eps);
+    Eigen::MatrixXd Arx = Akk.block(mx, 0, n, mx);
+    Eigen::MatrixXd Arx_Axx_inv = Arx * Axx_inv;
+    A = Akk.bottomRightCorner(n, n) - Arx_Axx_inv * Arx.transpose();
+    b = bk.tail(n) - Arx_Axx_inv * bk.head(mx);
+
+    // square root of the prior, A = P^T L D L^T P  ->  J = D^(1/2) L^T P
+    Eigen::LDLT<Eigen::MatrixXd> ldlt(A);
+    if (ldlt.info() == Eigen::Success && ldlt.vectorD().minCoeff() > -eps)
+    {
+        Eigen::VectorXd D = ldlt.vectorD();
+        Eigen::VectorXd D_sqrt = Eigen::VectorXd((D.array() > eps).select(D.array().sqrt(), 0));
+        Eigen::VectorXd D_inv_sqrt = Eigen::VectorXd((D.array() > eps).select(D.array().inverse().sqrt(), 0));
+
+        Eigen::MatrixXd L = ldlt.matrixL();
+        L = ldlt.transpositionsP().transpose() * L;
+        linearized_jacobians = D_sqrt.asDiagonal() * L.transpose();
+        Eigen::VectorXd Pb = ldlt.transpositionsP() * b;
+        ldlt.matrixL().solveInPlace(Pb);
+        linearized_residuals = D_inv_sqrt.asDiagonal() * Pb;
+    }
+    else
+    {
+        ROS_DEBUG("marginalization prior is indefinite, fall back to eigen-decomposition");
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> saes2(A);
+        Eigen::VectorXd S = Eigen::VectorXd((saes2.eigenvalues().array() > eps).select(saes2.eigenvalues().array(), 0));
+        Eigen::VectorXd S_inv = Eigen::VectorXd((saes2.eigenvalues().array() > eps).select(saes2.eigenvalues().array().inverse(), 0));
 
-    Eigen::VectorXd S_sqrt = S.cwiseSqrt();
-    Eigen::VectorXd S_inv_sqrt = S_inv.cwiseSqrt();
+        Eigen::VectorXd S_sqrt = S.cwiseSqrt();
+        Eigen::VectorXd S_inv_sqrt = S_inv.cwiseSqrt();
 
-    linearized_jacobians = S_sqrt.asDiagonal() * saes2.eigenvectors().transpose();
-    linearized_residuals = S_inv_sqrt.asDiagonal() * saes2.eigenvectors().transpose() * b;
-    //std::cout << A << std::endl
-    //          << std::endl;
-    //std::cout << linearized_jacobians << std::endl;
+        linearized_jacobians = S_sqrt.asDiagonal() * saes2.eigenvectors().transpose();
+        linearized_residuals = S_inv_sqrt.asDiagonal() * saes2.eigenvectors().transpose() * b;
+    }
     //printf("error2: %f %f\n", (linearized_jacobians.transpose() * linearized_jacobians - A).sum(),
     //      (linearized_jacobians.transpose() * linearized_residuals - b).sum());
 }
@@ -303,14 +320,14 @@ std::vector<double *> MarginalizationInfo::getParameterBlocks(std::unordered_map
     keep_block_idx.clear();
     keep_block_data.clear();
 
-    for (const auto &it : parameter_block_idx)
+    for (int id = 0; id < static_cast<int>(parameter_block_addr.size()); id++)
     {
-        if (it.second >= m)
+        if (!parameter_block_drop[id])
         {
-            keep_block_size.push_back(parameter_block_size[it.first]);
-            keep_block_idx.push_back(parameter_block_idx[it.first]);
-            keep_block_data.push_back(parameter_block_data[it.first]);
-            keep_block_addr.push_back(addr_shift[it.first]);
+            keep_block_size.push_back(parameter_block_size[id]);
+            keep_block_idx.push_back(parameter_block_idx[id]);
+            keep_block_data.push_back(parameter_block_data.data() + parameter_block_data_idx[id]);
+            keep_block_addr.push_back(addr_shift[reinterpret_cast<long>(parameter_block_addr[id])]);
         }
     }
     sum_block_size = std::accumulate(std::begin(keep_block_size), std::end(keep_block_size), 0);
@@ -328,53 +345,73 @@ MarginalizationFactor::MarginalizationFactor(MarginalizationInfo* _marginalizati
     }
     //printf("residual size: %d, %d\n", cnt, n);
     set_num_residuals(marginalization_info->n);
+
+    int n = marginalization_info->n;
+    int m = marginalization_info->m;
+    const Eigen::MatrixXd &J = marginalization_info->linearized_jacobians;
+    keep_blocks.resize(marginalization_info->keep_block_size.size());
+    for (int i = 0; i < static_cast<int>(keep_blocks.size()); i++)
+    {
+        KeepBlock &block = keep_blocks[i];
+        block.size = marginalization_info->keep_block_size[i];
+        block.local_size = marginalization_info->localSize(block.size);
+        block.idx = marginalization_info->keep_block_idx[i] - m;
+        block.x0 = marginalization_info->keep_block_data[i];
+        if (block.size == 7)
+            block.q0_inv = Eigen::Quaterniond(block.x0[6], block.x0[3], block.x0[4], block.x0[5]).inverse();
+
+        // the square root prior is close to triangular, so most blocks only reach part of the rows
+        block.row_begin = n;
+        block.row_end = 0;
+        for (int r = 0; r < n; r++)
+        {
+            if (!J.row(r).segment(block.idx, block.local_size).isZero(0))
+            {
+                block.row_begin = std::min(block.row_begin, r);
+                block.row_end = r + 1;
+            }
+        }
+        if (block.row_begin > block.row_end)
+            block.row_begin = block.row_end;
+
+        block.jacobian.setZero(n, block.size);
+        block.jacobian.leftCols(block.local_size) = J.middleCols(block.idx, block.local_size);
+    }
 };
 
 bool MarginalizationFactor::Evaluate(double const *const *parameters, double *residuals, double **jacobians) const
 {
-    //printf("internal addr,%d, %d\n", (int)parameter_block_sizes().size(), num_residuals());
-    //for (int i = 0; i < static_cast<int>(keep_block_size.size()); i++)
-    //{
-    //    //printf("unsigned %x\n", reinterpret_cast<unsigned long>(parameters[i]));
-    //    //printf("signed %x\n", reinterpret_cast<long>(parameters[i]));
-    //printf("jacobian %x\n", reinterpret_cast<long>(jacobians));
-    //printf("residual %x\n", reinterpret_cast<long>(residuals));
-    //}
     int n = marginalization_info->n;
-    int m = marginalization_info->m;
-    Eigen::VectorXd dx(n);
-    for (int i = 0; i < static_cast<int>(marginalization_info->keep_block_size.size()); i++)
+    const Eigen::MatrixXd &J = marginalization_info->linearized_jacobians;
+    Eigen::Map<Eigen::VectorXd> r(residuals, n);
+    r = marginalization_info->linearized_residuals;
+    for (int i = 0; i < static_cast<int>(keep_blocks.size()); i++)
     {
-        int size = marginalization_info->keep_block_size[i];
-        int idx = marginalization_info->keep_block_idx[i] - m;
-        Eigen::VectorXd x = Eigen::Map<const Eigen::VectorXd>(parameters[i], size);
-        Eigen::VectorXd x0 = Eigen::Map<const Eigen::VectorXd>(marginalization_info->keep_block_data[i], size);
-        if (size != 7)
-            dx.segment(idx, size) = x - x0;
+        const KeepBlock &block = keep_blocks[i];
+        const double *x = parameters[i];
+        int rows = block.row_end - block.row_begin;
+        if (rows == 0)
+            continue;
+        if (block.size != 7)
+        {
+            for (int j = 0; j < block.size; j++)
+                r.segment(block.row_begin, rows) += J.col(block.idx + j).segment(block.row_begin, rows) * (x[j] - block.x0[j]);
+        }
         else
         {
-            dx.segment<3>(idx + 0) = x.head<3>() - x0.head<3>();
-            dx.segment<3>(idx + 3) = 2.0 * Utility::positify(Eigen::Quaterniond(x0(6), x0(3), x0(4), x0(5)).inverse() * Eigen::Quaterniond(x(6), x(3), x(4), x(5))).vec();
-            if (!((Eigen::Quaterniond(x0(6), x0(3), x0(4), x0(5)).inverse() * Eigen::Quaterniond(x(6), x(3), x(4), x(5))).w() >= 0))
-            {
-                dx.segment<3>(idx + 3) = 2.0 * -Utility::positify(Eigen::Quaterniond(x0(6), x0(3), x0(4), x0(5)).inverse() * Eigen::Quaterniond(x(6), x(3), x(4), x(5))).vec();
-            }
+            Eigen::Quaterniond dq = block.q0_inv * Eigen::Quaterniond(x[6], x[3], x[4], x[5]);
+            Eigen::Matrix<double, 6, 1> dx;
+            dx.head<3>() = Eigen::Map<const Eigen::Vector3d>(x) - Eigen::Map<const Eigen::Vector3d>(block.x0);
+            dx.tail<3>() = dq.w() >= 0 ? 2.0 * dq.vec() : -2.0 * dq.vec();
+            r.segment(block.row_begin, rows).noalias() += J.block(block.row_begin, block.idx, rows, 6) * dx;
         }
     }
-    Eigen::Map<Eigen::VectorXd>(residuals, n) = marginalization_info->linearized_residuals + marginalization_info->linearized_jacobians * dx;
     if (jacobians)
     {
-
-        for (int i = 0; i < static_cast<int>(marginalization_info->keep_block_size.size()); i++)
+        for (int i = 0; i < static_cast<int>(keep_blocks.size()); i++)
         {
             if (jacobians[i])
-            {
-                int size = marginalization_info->keep_block_size[i], local_size = marginalization_info->localSize(size);
-                int idx = marginalization_info->keep_block_idx[i] - m;
-                Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>> jacobian(jacobians[i], n, size);
-                jacobian.setZero();
-                jacobian.leftCols(local_size) = marginalization_info->linearized_jacobians.middleCols(idx, local_size);
-            }
+                memcpy(jacobians[i], keep_blocks[i].jacobian.data(), sizeof(double) * n * keep_blocks[i].size);
         }
     }
     return true;
@@ -3,14 +3,12 @@
 #include <ros/ros.h>
 #include <ros/console.h>
 #include <cstdlib>
-#include <pthread.h>
 #include <ceres/ceres.h>
 #include <unordered_map>
 
 #include "../utility/utility.h"
 #include "../utility/tic_toc.h"
-
-const int NUM_THREADS = 4;
+#include "../utility/worker_pool.h"
 
 struct ResidualBlockInfo
 {
@@ -23,6 +21,7 @@ struct ResidualBlockInfo
     ceres::LossFunction *loss_function;
     std::vector<double *> parameter_blocks;
     std::vector<int> drop_set;
+    std::vector<int> parameter_block_ids; //ids in the MarginalizationInfo block registry
 
     double **raw_jacobians;
     std::vector<Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>> jacobians;
@@ -34,15 +33,6 @@ struct ResidualBlockInfo
     }
 };
 
-struct ThreadsStruct
-{
-    std::vector<ResidualBlockInfo *> sub_factors;
-    Eigen::MatrixXd A;
-    Eigen::VectorXd b;
-    std::unordered_map<long, int> parameter_block_size; //global size
-    std::unordered_map<long, int> parameter_block_idx; //local size
-};
-
 class MarginalizationInfo
 {
   public:
@@ -56,10 +46,14 @@ class MarginalizationInfo
 
     std::vector<ResidualBlockInfo *> factors;
     int m, n;
-    std::unordered_map<long, int> parameter_block_size; //global size
+    // parameter blocks get a dense id when first seen, everything after that is indexed by id
+    std::vector<double *> parameter_block_addr;
+    std::vector<int> parameter_block_size; //global size
     int sum_block_size;
-    std::unordered_map<long, int> parameter_block_idx; //local size
-    std::unordered_map<long, double *> parameter_block_data;
+    std::vector<int> parameter_block_idx; //local size
+    std::vector<bool> parameter_block_drop;
+    std::vector<int> parameter_block_data_idx; //offset into parameter_block_data
+    std::vector<double> parameter_block_data;
 
     std::vector<int> keep_block_size; //global size
     std::vector<int> keep_block_idx;  //local size
@@ -69,6 +63,11 @@ class MarginalizationInfo
     Eigen::VectorXd linearized_residuals;
     const double eps = 1e-8;
 
+  private:
+    int registerParameterBlock(double *addr, int size);
+    static WorkerPool &workerPool();
+
+    std::unordered_map<const double *, int> parameter_block_id; //only consulted while adding factors
 };
 
 class MarginalizationFactor : public ceres::CostFunction
@@ -78,4 +77,17 @@ class MarginalizationFactor : public ceres::CostFunction
     virtual bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const;
 
     MarginalizationInfo* marginalization_info;
+
+  private:
+    // everything Evaluate needs about a kept block, laid out once when the factor is built
+    struct KeepBlock
+    {
+        int size, local_size;
+        int idx;                  //column in linearized_jacobians
+        int row_begin, row_end;   //rows of linearized_jacobians touched by this block
+        const double *x0;
+        Eigen::Quaternion<double, Eigen::DontAlign> q0_inv; //unaligned, the blocks live in a plain std::vector
+        Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> jacobian; //padded to the global size
+    };
+    std::vector<KeepBlock> keep_blocks;
 };
@@ -0,0 +1,217 @@
+#include "projection_track_factor.h"
+
+ProjectionTrackFactor::ProjectionTrackFactor(const Eigen::Vector3d &_pts_i, const std::vector<Eigen::Vector3d> &_pts_j, const std::shared_ptr<ceres::LossFunction> &_loss_function)
+    : pts_i(_pts_i), pts_j(_pts_j), loss_function(_loss_function)
+{
+    mutable_parameter_block_sizes()->push_back(SIZE_POSE);
+    mutable_parameter_block_sizes()->push_back(SIZE_POSE);
+    mutable_parameter_block_sizes()->push_back(SIZE_FEATURE);
+    for (int k = 0; k < static_cast<int>(pts_j.size()); k++)
+        mutable_parameter_block_sizes()->push_back(SIZE_POSE);
+    set_num_residuals(observationSize() * pts_j.size());
+
+    info_tangent_base.resize(pts_j.size());
+    info_pts_j.resize(pts_j.size());
+#ifdef UNIT_SPHERE_ERROR
+    for (int k = 0; k < static_cast<int>(pts_j.size()); k++)
+    {
+        Eigen::Vector3d b1, b2;
+        Eigen::Vector3d a = pts_j[k].normalized();
+        Eigen::Vector3d tmp(0, 0, 1);
+        if(a == tmp)
+            tmp << 1, 0, 0;
+        b1 = (tmp - a * (a.transpose() * tmp)).normalized();
+        b2 = a.cross(b1);
+        Eigen::Matrix<double, 2, 3> tangent_base;
+        tangent_base.block<1, 3>(0, 0) = b1.transpose();
+        tangent_base.block<1, 3>(1, 0) = b2.transpose();
+        info_tangent_base[k] = ProjectionFactor::sqrt_info * tangent_base;
+        info_pts_j[k] = info_tangent_base[k] * a;
+    }
+#endif
+}
+
+bool ProjectionTrackFactor::Evaluate(double const *const *parameters, double *residuals, double **jacobians) const
+{
+#ifdef FLOAT_VISUAL_JACOBIAN
+    return Evaluate(parameters, residuals, jacobians, true);
+#else
+    return Evaluate(parameters, residuals, jacobians, false);
+#endif
+}
+
+bool ProjectionTrackFactor::Evaluate(double const *const *parameters, double *residuals, double **jacobians, bool float_jacobian) const
+{
+    int os = observationSize();
+    int num_obs = static_cast<int>(pts_j.size());
+
+    // everything that only depends on the anchor frame is done once per feature
+    Eigen::Vector3d Pi(parameters[0][0], parameters[0][1], parameters[0][2]);
+    Eigen::Quaterniond Qi(parameters[0][6], parameters[0][3], parameters[0][4], parameters[0][5]);
+
+    Eigen::Vector3d tic(parameters[1][0], parameters[1][1], parameters[1][2]);
+    Eigen::Quaterniond qic(parameters[1][6], parameters[1][3], parameters[1][4], parameters[1][5]);
+
+    double inv_dep_i = parameters[2][0];
+
+    Eigen::Vector3d pts_camera_i = pts_i / inv_dep_i;
+    Eigen::Vector3d pts_imu_i = qic * pts_camera_i + tic;
+    Eigen::Vector3d pts_w = Qi * pts_imu_i + Pi;
+
+    Eigen::Matrix3d Ri, ric, skew_pts_imu_i, skew_pts_camera_i;
+    Eigen::Vector3d Ri_tic_Pi;
+    if (jacobians)
+    {
+        Ri = Qi.toRotationMatrix();
+        ric = qic.toRotationMatrix();
+        skew_pts_imu_i = -Utility::skewSymmetric(pts_imu_i);
+        skew_pts_camera_i = Utility::skewSymmetric(pts_camera_i);
+        Ri_tic_Pi = Ri * tic + Pi;
+        for (int b = 0; b < 3 + num_obs; b++)
+        {
+            if (jacobians[b])
+                memset(jacobians[b], 0, sizeof(double) * num_residuals() * parameter_block_sizes()[b]);
+        }
+    }
+
+    // observations are processed in batches of the sphere projection kernel width
+    for (int k0 = 0; k0 < num_obs; k0 += SphereProjectionBatch::MAX_SIZE)
+    {
+        int cnt = std::min(num_obs - k0, static_cast<int>(SphereProjectionBatch::MAX_SIZE));
+        Eigen::Vector3d Pj[SphereProjectionBatch::MAX_SIZE];
+        Eigen::Matrix3d Rj[SphereProjectionBatch::MAX_SIZE];
+        Eigen::Vector3d pts_imu_j[SphereProjectionBatch::MAX_SIZE];
+        Eigen::Vector3d pts_camera_j[SphereProjectionBatch::MAX_SIZE];
+#ifdef UNIT_SPHERE_ERROR
+        SphereProjectionBatch batch;
+        batch.size = cnt;
+#endif
+        for (int l = 0; l < cnt; l++)
+        {
+            const double *pose_j = parameters[3 + k0 + l];
+            Pj[l] = Eigen::Vector3d(pose_j[0], pose_j[1], pose_j[2]);
+            Eigen::Quaterniond Qj(pose_j[6], pose_j[3], pose_j[4], pose_j[5]);
+            if (jacobians)
+                Rj[l] = Qj.toRotationMatrix();
+
+            pts_imu_j[l] = Qj.inverse() * (pts_w - Pj[l]);
+            pts_camera_j[l] = qic.inverse() * (pts_imu_j[l] - tic);
+#ifdef UNIT_SPHERE_ERROR
+            batch.x[l] = pts_camera_j[l](0);
+            batch.y[l] = pts_camera_j[l](1);
+            batch.z[l] = pts_camera_j[l](2);
+            for (int a = 0; a < 2; a++)
+            {
+                for (int c = 0; c < 3; c++)
+                    batch.t[3 * a + c][l] = info_tangent_base[k0 + l](a, c);
+                batch.c[a][l] = info_pts_j[k0 + l](a);
+            }
+#endif
+        }
+#ifdef UNIT_SPHERE_ERROR
+        evaluateSphereProjection(batch, jacobians != NULL, float_jacobian);
+#endif
+
+        for (int l = 0; l < cnt; l++)
+        {
+            int k = k0 + l;
+            Eigen::Map<Eigen::Vector2d> residual(residuals + k * os);
+#ifdef UNIT_SPHERE_ERROR
+            residual << batch.r[0][l], batch.r[1][l];
+#else
+            double dep_j = pts_camera_j[l].z();
+            residual = (pts_camera_j[l] / dep_j).head<2>() - pts_j[k].head<2>();
+            residual = ProjectionFactor::sqrt_info * residual;
+#endif
+
+            Eigen::Map<Eigen::Matrix<double, 2, 7, Eigen::RowMajor>> jacobian_pose_i(jacobians && jacobians[0] ? jacobians[0] + k * os * 7 : NULL);
+            Eigen::Map<Eigen::Matrix<double, 2, 7, Eigen::RowMajor>> jacobian_ex_pose(jacobians && jacobians[1] ? jacobians[1] + k * os * 7 : NULL);
+            Eigen::Map<Eigen::Vector2d> jacobian_feature(jacobians && jacobians[2] ? jacobians[2] + k * os : NULL);
+            Eigen::Map<Eigen::Matrix<double, 2, 7, Eigen::RowMajor>> jacobian_pose_j(jacobians && jacobians[3 + k] ? jacobians[3 + k] + k * os * 7 : NULL);
+
+            if (jacobians)
+            {
+                Eigen::Matrix<double, 2, 3> reduce(2, 3);
+#ifdef UNIT_SPHERE_ERROR
+                reduce << batch.reduce[0][l], batch.reduce[1][l], batch.reduce[2][l],
+                    batch.reduce[3][l], batch.reduce[4][l], batch.reduce[5][l];
+#else
+                reduce << 1. / dep_j, 0, -pts_camera_j[l](0) / (dep_j * dep_j),
+                    0, 1. / dep_j, -pts_camera_j[l](1) / (dep_j * dep_j);
+                reduce = ProjectionFactor::sqrt_info * reduce;
+#endif
+
+                if (jacobians[0])
+                {
+                    Eigen::Matrix<double, 3, 6> jaco_i;
+                    jaco_i.leftCols<3>() = ric.transpose() * Rj[l].transpose();
+                    jaco_i.rightCols<3>() = ric.transpose() * Rj[l].transpose() * Ri * skew_pts_imu_i;
+
+                    jacobian_pose_i.leftCols<6>() = reduce * jaco_i;
+                }
+                if (jacobians[1])
+                {
+                    Eigen::Matrix<double, 3, 6> jaco_ex;
+                    jaco_ex.leftCols<3>() = ric.transpose() * (Rj[l].transpose() * Ri - Eigen::Matrix3d::Identity());
+                    Eigen::Matrix3d tmp_r = ric.transpose() * Rj[l].transpose() * Ri * ric;
+                    jaco_ex.rightCols<3>() = -tmp_r * skew_pts_camera_i + Utility::skewSymmetric(tmp_r * pts_camera_i) +
+                                             Utility::skewSymmetric(ric.transpose() * (Rj[l].transpose() * (Ri_tic_Pi - Pj[l]) - tic));
+                    jacobian_ex_pose.leftCols<6>() = reduce * jaco_ex;
+                }
+                if (jacobians[2])
+                {
+                    jacobian_feature = reduce * ric.transpose() * Rj[l].transpose() * Ri * ric * pts_i * -1.0 / (inv_dep_i * inv_dep_i);
+                }
+                if (jacobians[3 + k])
+                {
+                    Eigen::Matrix<double, 3, 6> jaco_j;
+                    jaco_j.leftCols<3>() = ric.transpose() * -Rj[l].transpose();
+                    jaco_j.rightCols<3>() = ric.transpose() * Utility::skewSymmetric(pts_imu_j[l]);
+
+                    jacobian_pose_j.leftCols<6>() = reduce * jaco_j;
+                }
+            }
+
+            if (!loss_function)
+                continue;
+
+            // per observation version of ceres' residual block corrector
+            double sq_norm, rho[3];
+            sq_norm = residual.squaredNorm();
+            loss_function->Evaluate(sq_norm, rho);
+
+            double sqrt_rho1 = sqrt(rho[1]);
+            double residual_scaling, alpha_sq_norm;
+            if ((sq_norm == 0.0) || (rho[2] <= 0.0))
+            {
+                residual_scaling = sqrt_rho1;
+                alpha_sq_norm = 0.0;
+            }
+            else
+            {
+                const double D = 1.0 + 2.0 * sq_norm * rho[2] / rho[1];
+                const double alpha = 1.0 - sqrt(D);
+                residual_scaling = sqrt_rho1 / (1 - alpha);
+                alpha_sq_norm = alpha / sq_norm;
+            }
+
+            if (jacobians)
+            {
+                if (jacobians[0])
+                    jacobian_pose_i = sqrt_rho1 * (jacobian_pose_i - alpha_sq_norm * residual * (residual.transpose() * jacobian_pose_i));
+                if (jacobians[1])
+                    jacobian_ex_pose = sqrt_rho1 * (jacobian_ex_pose - alpha_sq_norm * residual * (residual.transpose() * jacobian_ex_pose));
+                if (jacobians[2])
+                    jacobian_feature = sqrt_rho1 * (jacobian_feature - alpha_sq_norm * residual * (residual.transpose() * jacobian_feature));
+                if (jacobians[3 + k])
+                    jacobian_pose_j = sqrt_rho1 * (jacobian_pose_j - alpha_sq_norm * residual * (residual.transpose() * jacobian_pose_j));
+            }
+
+            residual *= residual_scaling;
+            // what the scaled residual does not account for of rho, so that the cost stays exact
+            residuals[k * os + 2] = sqrt(std::max(rho[0] - residual.squaredNorm(), 0.0));
+        }
+    }
+
+    return true;
+}
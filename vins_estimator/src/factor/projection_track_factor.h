@@ -0,0 +1,38 @@
+#pragma once
+
+#include <ros/assert.h>
+#include <ceres/ceres.h>
+#include <Eigen/Dense>
+#include <vector>
+#include <memory>
+#include "../utility/utility.h"
+#include "../parameters.h"
+#include "projection_factor.h"
+#include "sphere_projection_kernel.h"
+
+// All observations of one feature in a single residual block.
+// Parameter blocks: pose of the anchor frame, camera extrinsic, inverse depth, then the
+// pose of every observing frame. Each observation gives the same residual and jacobians as
+// a ProjectionFactor. Because ceres can only apply a loss to a whole residual block, the
+// loss is applied per observation here, with the same correction ceres uses. One extra
+// residual (zero jacobian) per observation keeps the cost at 0.5 * rho(|r|^2).
+// With UNIT_SPHERE_ERROR the observations go through the batched sphere projection kernel,
+// the FLOAT_VISUAL_JACOBIAN cmake option lets it evaluate the projection jacobians in single precision.
+class ProjectionTrackFactor : public ceres::CostFunction
+{
+  public:
+    ProjectionTrackFactor(const Eigen::Vector3d &_pts_i, const std::vector<Eigen::Vector3d> &_pts_j, const std::shared_ptr<ceres::LossFunction> &_loss_function);
+    virtual bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const;
+    bool Evaluate(double const *const *parameters, double *residuals, double **jacobians, bool float_jacobian) const;
+
+    int observationSize() const
+    {
+        return loss_function ? 3 : 2;
+    }
+
+    Eigen::Vector3d pts_i;
+    std::vector<Eigen::Vector3d> pts_j;
+    std::vector<Eigen::Matrix<double, 2, 3>, Eigen::aligned_allocator<Eigen::Matrix<double, 2, 3>>> info_tangent_base; //sqrt_info * tangent_base
+    std::vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>> info_pts_j; //measurement in the tangent base
+    std::shared_ptr<ceres::LossFunction> loss_function; //shared, the factor may outlive the problem in a MarginalizationInfo
+};
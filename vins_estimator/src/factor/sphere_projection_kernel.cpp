@@ -0,0 +1,154 @@
+#include "sphere_projection_kernel.h"
+#include <cmath>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SPHERE_PROJECTION_AVX2
+#endif
+
+// unused lanes get a harmless point so the vector kernels can always run full registers
+static void padBatch(SphereProjectionBatch &batch)
+{
+    for (int i = batch.size; i < SphereProjectionBatch::MAX_SIZE; i++)
+    {
+        batch.x[i] = 0.0;
+        batch.y[i] = 0.0;
+        batch.z[i] = 1.0;
+        for (int k = 0; k < 6; k++)
+            batch.t[k][i] = 0.0;
+        batch.c[0][i] = 0.0;
+        batch.c[1][i] = 0.0;
+    }
+}
+
+template <typename T>
+static void normalizeScalar(SphereProjectionBatch &batch, int i, T &nx, T &ny, T &nz, T &inv_norm)
+{
+    T x = static_cast<T>(batch.x[i]), y = static_cast<T>(batch.y[i]), z = static_cast<T>(batch.z[i]);
+    inv_norm = T(1) / std::sqrt(x * x + y * y + z * z);
+    nx = x * inv_norm;
+    ny = y * inv_norm;
+    nz = z * inv_norm;
+}
+
+template <typename T>
+static void jacobianScalar(SphereProjectionBatch &batch)
+{
+    for (int i = 0; i < batch.size; i++)
+    {
+        T nx, ny, nz, inv_norm;
+        normalizeScalar<T>(batch, i, nx, ny, nz, inv_norm);
+        for (int a = 0; a < 2; a++)
+        {
+            T t0 = static_cast<T>(batch.t[3 * a][i]), t1 = static_cast<T>(batch.t[3 * a + 1][i]), t2 = static_cast<T>(batch.t[3 * a + 2][i]);
+            T u = t0 * nx + t1 * ny + t2 * nz;
+            batch.reduce[3 * a][i] = (t0 - u * nx) * inv_norm;
+            batch.reduce[3 * a + 1][i] = (t1 - u * ny) * inv_norm;
+            batch.reduce[3 * a + 2][i] = (t2 - u * nz) * inv_norm;
+        }
+    }
+}
+
+void evaluateSphereProjectionScalar(SphereProjectionBatch &batch, bool jacobian, bool float_jacobian)
+{
+    for (int i = 0; i < batch.size; i++)
+    {
+        double nx, ny, nz, inv_norm;
+        normalizeScalar<double>(batch, i, nx, ny, nz, inv_norm);
+        for (int a = 0; a < 2; a++)
+            batch.r[a][i] = batch.t[3 * a][i] * nx + batch.t[3 * a + 1][i] * ny + batch.t[3 * a + 2][i] * nz - batch.c[a][i];
+    }
+    if (jacobian)
+    {
+        if (float_jacobian)
+            jacobianScalar<float>(batch);
+        else
+            jacobianScalar<double>(batch);
+    }
+}
+
+#ifdef SPHERE_PROJECTION_AVX2
+__attribute__((target("avx2,fma")))
+static void residualAvx2(SphereProjectionBatch &batch, bool double_jacobian)
+{
+    const __m256d one = _mm256_set1_pd(1.0);
+    for (int i = 0; i < batch.size; i += 4)
+    {
+        __m256d x = _mm256_load_pd(batch.x + i);
+        __m256d y = _mm256_load_pd(batch.y + i);
+        __m256d z = _mm256_load_pd(batch.z + i);
+        __m256d inv_norm = _mm256_div_pd(one, _mm256_sqrt_pd(_mm256_fmadd_pd(x, x, _mm256_fmadd_pd(y, y, _mm256_mul_pd(z, z)))));
+        __m256d nx = _mm256_mul_pd(x, inv_norm);
+        __m256d ny = _mm256_mul_pd(y, inv_norm);
+        __m256d nz = _mm256_mul_pd(z, inv_norm);
+        for (int a = 0; a < 2; a++)
+        {
+            __m256d t0 = _mm256_load_pd(batch.t[3 * a] + i);
+            __m256d t1 = _mm256_load_pd(batch.t[3 * a + 1] + i);
+            __m256d t2 = _mm256_load_pd(batch.t[3 * a + 2] + i);
+            __m256d u = _mm256_fmadd_pd(t0, nx, _mm256_fmadd_pd(t1, ny, _mm256_mul_pd(t2, nz)));
+            _mm256_store_pd(batch.r[a] + i, _mm256_sub_pd(u, _mm256_load_pd(batch.c[a] + i)));
+            if (double_jacobian)
+            {
+                _mm256_store_pd(batch.reduce[3 * a] + i, _mm256_mul_pd(_mm256_fnmadd_pd(u, nx, t0), inv_norm));
+                _mm256_store_pd(batch.reduce[3 * a + 1] + i, _mm256_mul_pd(_mm256_fnmadd_pd(u, ny, t1), inv_norm));
+                _mm256_store_pd(batch.reduce[3 * a + 2] + i, _mm256_mul_pd(_mm256_fnmadd_pd(u, nz, t2), inv_norm));
+            }
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 loadFloatAvx2(const double *p)
+{
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(_mm256_load_pd(p))), _mm256_cvtpd_ps(_mm256_load_pd(p + 4)), 1);
+}
+
+__attribute__((target("avx2,fma")))
+static inline void storeFloatAvx2(double *p, __m256 v)
+{
+    _mm256_store_pd(p, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+    _mm256_store_pd(p + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+}
+
+// the whole batch fits into one single precision register
+__attribute__((target("avx2,fma")))
+static void floatJacobianAvx2(SphereProjectionBatch &batch)
+{
+    static_assert(SphereProjectionBatch::MAX_SIZE == 8, "float kernel handles exactly one register of lanes");
+    __m256 x = loadFloatAvx2(batch.x);
+    __m256 y = loadFloatAvx2(batch.y);
+    __m256 z = loadFloatAvx2(batch.z);
+    __m256 inv_norm = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(_mm256_fmadd_ps(x, x, _mm256_fmadd_ps(y, y, _mm256_mul_ps(z, z)))));
+    __m256 nx = _mm256_mul_ps(x, inv_norm);
+    __m256 ny = _mm256_mul_ps(y, inv_norm);
+    __m256 nz = _mm256_mul_ps(z, inv_norm);
+    for (int a = 0; a < 2; a++)
+    {
+        __m256 t0 = loadFloatAvx2(batch.t[3 * a]);
+        __m256 t1 = loadFloatAvx2(batch.t[3 * a + 1]);
+        __m256 t2 = loadFloatAvx2(batch.t[3 * a + 2]);
+        __m256 u = _mm256_fmadd_ps(t0, nx, _mm256_fmadd_ps(t1, ny, _mm256_mul_ps(t2, nz)));
+        storeFloatAvx2(batch.reduce[3 * a], _mm256_mul_ps(_mm256_fnmadd_ps(u, nx, t0), inv_norm));
+        storeFloatAvx2(batch.reduce[3 * a + 1], _mm256_mul_ps(_mm256_fnmadd_ps(u, ny, t1), inv_norm));
+        storeFloatAvx2(batch.reduce[3 * a + 2], _mm256_mul_ps(_mm256_fnmadd_ps(u, nz, t2), inv_norm));
+    }
+}
+#endif
+
+void evaluateSphereProjection(SphereProjectionBatch &batch, bool jacobian, bool float_jacobian)
+{
+    padBatch(batch);
+#ifdef SPHERE_PROJECTION_AVX2
+    static const bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (has_avx2)
+    {
+        residualAvx2(batch, jacobian && !float_jacobian);
+        if (jacobian && float_jacobian)
+            floatJacobianAvx2(batch);
+        return;
+    }
+#endif
+    evaluateSphereProjectionScalar(batch, jacobian, float_jacobian);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+// Unit sphere reprojection residuals for a batch of observations, stored as structure of
+// arrays. Per observation the inputs are the point in the observing camera frame (x, y, z),
+// the information weighted tangent base T = sqrt_info * tangent_base (t, row major 2x3) and
+// the measured bearing in that base c = T * pts_j.normalized(). The kernel writes
+//   r      = T * p / |p| - c
+//   reduce = T * (I - n n^T) / |p|,  n = p / |p|
+// which is the residual and its jacobian w.r.t. p used by the projection factors.
+struct SphereProjectionBatch
+{
+    static const int MAX_SIZE = 8;
+
+    int size;
+    alignas(32) double x[MAX_SIZE];
+    alignas(32) double y[MAX_SIZE];
+    alignas(32) double z[MAX_SIZE];
+    alignas(32) double t[6][MAX_SIZE];
+    alignas(32) double c[2][MAX_SIZE];
+
+    alignas(32) double r[2][MAX_SIZE];
+    alignas(32) double reduce[6][MAX_SIZE];
+};
+
+// picks the avx2 kernel when the cpu supports it. With float_jacobian the jacobians are
+// evaluated in single precision, residuals always stay in double.
+void evaluateSphereProjection(SphereProjectionBatch &batch, bool jacobian, bool float_jacobian = false);
+
+void evaluateSphereProjectionScalar(SphereProjectionBatch &batch, bool jacobian, bool float_jacobian = false);
@@ -199,6 +199,33 @@ VectorXd FeatureManager::getDepthVector()
     return dep_vec;
 }
 
+unordered_map<int, pair<int, FeaturePerId *>> FeatureManager::getOptimizedFeatureIndex()
+{
+    unordered_map<int, pair<int, FeaturePerId *>> optimized_index;
+    int feature_index = -1;
+    for (auto &it_per_id : feature)
+    {
+        it_per_id.used_num = it_per_id.feature_per_frame.size();
+        if (!(it_per_id.used_num >= 2 && it_per_id.start_frame < WINDOW_SIZE - 2))
+            continue;
+        optimized_index[it_per_id.feature_id] = make_pair(++feature_index, &it_per_id);
+    }
+    return optimized_index;
+}
+
+vector<pair<int, pair<int, FeaturePerId *>>> FeatureManager::matchLoopFeatures(const unordered_map<int, pair<int, FeaturePerId *>> &optimized_index,
+                                                                               const vector<int> &features_ids, int frame)
+{
+    vector<pair<int, pair<int, FeaturePerId *>>> matches;
+    for (int i = 0; i < (int)features_ids.size(); i++)
+    {
+        auto it = optimized_index.find(features_ids[i]);
+        if (it != optimized_index.end() && it->second.second->start_frame <= frame)
+            matches.emplace_back(i, it->second);
+    }
+    return matches;
+}
+
 void FeatureManager::triangulate(Vector3d Ps[], Vector3d tic[], Matrix3d ric[])
 {
     for (auto &it_per_id : feature)
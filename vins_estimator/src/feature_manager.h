@@ -2,6 +2,7 @@
 #define FEATURE_MANAGER_H
 
 #include <list>
+#include <unordered_map>
 #include <algorithm>
 #include <vector>
 #include <numeric>
@@ -76,6 +77,12 @@ class FeatureManager
     void removeFailures();
     void clearDepth(const VectorXd &x);
     VectorXd getDepthVector();
+    // optimized features, those in the depth vector, by id with their index into it
+    unordered_map<int, pair<int, FeaturePerId *>> getOptimizedFeatureIndex();
+    // loop matches of a relocalization frame at window slot frame: every position in
+    // features_ids whose feature is optimized and observed from that slot on, with its index entry
+    static vector<pair<int, pair<int, FeaturePerId *>>> matchLoopFeatures(const unordered_map<int, pair<int, FeaturePerId *>> &optimized_index,
+                                                                          const vector<int> &features_ids, int frame);
     void triangulate(Vector3d Ps[], Vector3d tic[], Matrix3d ric[]);
     void removeBackShiftDepth(Eigen::Matrix3d marg_R, Eigen::Vector3d marg_P, Eigen::Matrix3d new_R, Eigen::Vector3d new_P);
     void removeBack();
@@ -0,0 +1,151 @@
+#include "imu_propagator.h"
+#include "utility/utility.h"
+
+ImuPropagator::ImuPropagator()
+    : first_imu{true}, has_correction{false}
+{
+    cur.t = -1;
+    cur.P.setZero();
+    cur.Q.setIdentity();
+    cur.V.setZero();
+    cur.acc.setZero();
+    cur.gyr.setZero();
+    Ba.setZero();
+    Bg.setZero();
+    g.setZero();
+}
+
+// midpoint step from the sample stored in s to the one at t
+void ImuPropagator::integrate(State &s, double t, const Vector3d &linear_acceleration, const Vector3d &angular_velocity) const
+{
+    double dt = t - s.t;
+    Vector3d un_acc_0 = s.Q * (s.acc - Ba) - g;
+    Vector3d un_gyr = 0.5 * (s.gyr + angular_velocity) - Bg;
+    s.Q = (s.Q * Utility::deltaQ(un_gyr * dt)).normalized();
+    Vector3d un_acc_1 = s.Q * (linear_acceleration - Ba) - g;
+    Vector3d un_acc = 0.5 * (un_acc_0 + un_acc_1);
+    s.P = s.P + dt * s.V + 0.5 * dt * dt * un_acc;
+    s.V = s.V + dt * un_acc;
+    s.t = t;
+    s.acc = linear_acceleration;
+    s.gyr = angular_velocity;
+}
+
+void ImuPropagator::propagate(double t, const Vector3d &linear_acceleration, const Vector3d &angular_velocity)
+{
+    applyCorrection();
+
+    if (first_imu)
+    {
+        first_imu = false;
+        cur.t = t;
+        cur.acc = linear_acceleration;
+        cur.gyr = angular_velocity;
+    }
+    integrate(cur, t, linear_acceleration, angular_velocity);
+
+    history.push_back(cur);
+    while (t - history.front().t > HISTORY_PERIOD)
+        history.pop_front();
+}
+
+void ImuPropagator::getState(Vector3d &P, Quaterniond &Q, Vector3d &V) const
+{
+    P = cur.P;
+    Q = cur.Q;
+    V = cur.V;
+}
+
+int ImuPropagator::historySize() const
+{
+    return history.size();
+}
+
+void ImuPropagator::correct(double t, const Vector3d &P, const Quaterniond &Q, const Vector3d &V,
+                            const Vector3d &_Ba, const Vector3d &_Bg, const Vector3d &_g)
+{
+    std::lock_guard<std::mutex> lk(m_correction);
+    correction.t = t;
+    correction.P = P;
+    correction.Q = Q;
+    correction.V = V;
+    correction_Ba = _Ba;
+    correction_Bg = _Bg;
+    correction_g = _g;
+    has_correction = true;
+}
+
+// Maps the propagated state at the estimate's time onto the estimate and moves everything
+// integrated since along: the rotation offset is applied to it, the velocity offset also
+// accumulates into the position. Exact for yaw offsets, for roll/pitch offsets
+// the gravity term is off by second order over the few samples since the estimate.
+void ImuPropagator::applyCorrection()
+{
+    State est;
+    {
+        std::lock_guard<std::mutex> lk(m_correction);
+        if (!has_correction)
+            return;
+        has_correction = false;
+        est = correction;
+        Ba = correction_Ba;
+        Bg = correction_Bg;
+        g = correction_g;
+    }
+
+    if (history.empty() || est.t > history.back().t)
+    {
+        // nothing propagated after the estimate, it becomes the state. The last sample
+        // stays the start of the next step.
+        est.acc = cur.acc;
+        est.gyr = cur.gyr;
+        cur = est;
+        history.clear();
+        return;
+    }
+
+    // ref: the propagated state the estimate is matched against
+    State ref = history.front();
+    if (est.t < ref.t)
+    {
+        // older than the retained history, re-anchor the estimate at the oldest retained
+        // state rather than integrating the gap in one step
+        est.t = ref.t;
+    }
+    else
+    {
+        State before = ref;
+        while (history.front().t < est.t)
+        {
+            before = history.front();
+            history.pop_front();
+        }
+        ref = history.front();
+        if (ref.t != est.t)
+        {
+            // no propagated state at that time, replay the retained samples from the estimate
+            est.acc = before.acc;
+            est.gyr = before.gyr;
+            for (auto &s : history)
+            {
+                integrate(est, s.t, s.acc, s.gyr);
+                s = est;
+            }
+            cur = history.back();
+            return;
+        }
+    }
+
+    Quaterniond dQ = est.Q * ref.Q.inverse();
+    Vector3d dV = est.V - dQ * ref.V;
+    auto shift = [&](State &s)
+    {
+        s.P = est.P + dQ * (s.P - ref.P) + dV * (s.t - ref.t);
+        s.V = est.V + dQ * (s.V - ref.V);
+        s.Q = (dQ * s.Q).normalized();
+    };
+    // the remaining history stays consistent for an estimate that falls in between
+    for (auto &s : history)
+        shift(s);
+    shift(cur);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <eigen3/Eigen/Dense>
+#include <eigen3/Eigen/StdDeque>
+using namespace Eigen;
+
+// IMU-rate odometry between estimator updates. Every imu sample is integrated exactly once
+// on the imu thread. A new estimate of the window head is not replayed over the samples that
+// arrived since; it is turned into a correction of the propagated state at the estimate's
+// time and applied to the current state as a delta. correct() only posts the estimate, so
+// the back-end never waits for the imu thread and vice versa. An estimate without a
+// propagated state at its time is replayed over the retained samples instead.
+class ImuPropagator
+{
+  public:
+    ImuPropagator();
+
+    // imu thread
+    void propagate(double t, const Vector3d &linear_acceleration, const Vector3d &angular_velocity);
+    void getState(Vector3d &P, Quaterniond &Q, Vector3d &V) const;
+    int historySize() const;
+
+    // any thread, the estimate is the state after the imu sample at time t
+    void correct(double t, const Vector3d &P, const Quaterniond &Q, const Vector3d &V,
+                 const Vector3d &Ba, const Vector3d &Bg, const Vector3d &g);
+
+  private:
+    struct State
+    {
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+        double t;
+        Vector3d P;
+        Quaterniond Q;
+        Vector3d V;
+        // the sample at t
+        Vector3d acc;
+        Vector3d gyr;
+    };
+
+    void integrate(State &s, double t, const Vector3d &linear_acceleration, const Vector3d &angular_velocity) const;
+    void applyCorrection();
+
+    // propagated state after each sample of the last HISTORY_PERIOD seconds, bounded by time
+    // so the window the back-end may lag behind does not shrink with the imu rate
+    static constexpr double HISTORY_PERIOD = 10.0;
+    std::deque<State, aligned_allocator<State>> history;
+
+    State cur;
+    Vector3d Ba, Bg, g;
+    bool first_imu;
+
+    std::mutex m_correction;
+    bool has_correction;
+    State correction;
+    Vector3d correction_Ba, correction_Bg, correction_g;
+};
@@ -19,8 +19,7 @@
  * Check my website to obtain updates: http://webdiis.unizar.es/~dorian
  *
  * \section requirements Requirements
- * This library requires the DUtils, DUtilsCV, DVision, DBoW2 and OpenCV libraries,
- * as well as the boost::dynamic_bitset class.
+ * This library requires the DUtils, DUtilsCV, DVision, DBoW2 and OpenCV libraries.
  *
  * \section citation Citation
  * If you use this software in academic works, please cite:
@@ -69,5 +68,8 @@ namespace DLoopDetector
 typedef DLoopDetector::TemplatedLoopDetector
   <FBrief::TDescriptor, FBrief> BriefLoopDetector;
 
+/// Keypoints and BRIEF descriptors of an image
+typedef DLoopDetector::TemplatedFeatures<FBrief::TDescriptor> BriefFeatures;
+
 #endif
 
@@ -14,6 +14,7 @@
 #include <numeric>
 #include <fstream>
 #include <string>
+#include <memory>
 
 #include <opencv/cv.h>
 
@@ -78,6 +79,10 @@ struct DetectionResult
   EntryId query;
   /// Matched id if loop detected, otherwise, best candidate 
   EntryId match;
+  /// If loop detected, the best entries of the best islands that are
+  /// geometrically consistent, in descending island score. match is the
+  /// first one
+  std::vector<EntryId> candidates;
   
   /**
    * Checks if the loop was detected
@@ -89,6 +94,19 @@ struct DetectionResult
   }
 };
 
+/// Keypoints and descriptors of an image. The caller and the detector share
+/// one copy, it is not modified once handed to the detector
+template<class TDescriptor>
+struct TemplatedFeatures
+{
+  /// Position of each feature, the only part of a keypoint the matching uses
+  std::vector<cv::Point2f> points;
+  /// Descriptor of each feature
+  std::vector<TDescriptor> descriptors;
+  /// Indices of the features the caller tracks itself, in its own order
+  std::vector<int> window;
+};
+
 /// TDescriptor: class of descriptor
 /// F: class of descriptor functions
 template<class TDescriptor, class F>
@@ -96,6 +114,9 @@ template<class TDescriptor, class F>
 class TemplatedLoopDetector
 {
 public:
+
+  /// Features of an image, shared with the caller
+  typedef std::shared_ptr<const TemplatedFeatures<TDescriptor> > FeaturesPtr;
   
   /// Parameters to create a loop detector
   struct Parameters
@@ -150,6 +171,9 @@ public:
     
     /// Max value of the neighbour-ratio of accepted correspondences
     double max_neighbor_ratio;
+
+    /// Max number of islands whose best entries are returned as candidates
+    int max_candidates;
   
     /**
      * Creates parameters by default
@@ -263,18 +287,43 @@ public:
   void allocate(int nentries, int nkeys = 0);
 
   /**
-   * Adds the given tuple <keys, descriptors, current_t> to the database
-   * and returns the match if any
-   * @param keys keypoints of the image
-   * @param descriptors descriptors associated to the given keypoints
+   * Sets how many candidates a detection returns at most
+   * @param n max number of islands to return the best entries of
+   */
+  inline void setMaxCandidates(int n);
+
+  /**
+   * Adds the given features to the database and returns the match if any.
+   * The detector keeps a reference to them
+   * @param features keypoints and descriptors of the image
    * @param match (out) match or failing information
    * @return true iff there was match
    */
-  bool detectLoop(const std::vector<cv::KeyPoint> &keys, 
-    const std::vector<TDescriptor> &descriptors,
+  bool detectLoop(const FeaturesPtr &features,
     DetectionResult &match,std::vector<cv::Point2f> &cur_pts,
                           std::vector<cv::Point2f> &old_pts);
 
+  /**
+   * Same as above with the vectors of the image already computed by
+   * transform, so that several images can be prepared concurrently
+   * @param bowvec bow vector of the descriptors
+   * @param featvec direct index of the descriptors
+   */
+  bool detectLoop(const FeaturesPtr &features,
+    const BowVector &bowvec, const FeatureVector &featvec,
+    DetectionResult &match,std::vector<cv::Point2f> &cur_pts,
+                          std::vector<cv::Point2f> &old_pts);
+
+  /**
+   * Computes the vectors detectLoop needs for the given descriptors. Only
+   * reads the vocabulary, it can run in any thread
+   * @param descriptors descriptors of the image
+   * @param bowvec (out) bow vector
+   * @param featvec (out) direct index, left empty if not used
+   */
+  void transform(const std::vector<TDescriptor> &descriptors,
+    BowVector &bowvec, FeatureVector &featvec) const;
+
   /**
    * Resets the detector and clears the database, such that the next entry
    * will be 0 again
@@ -452,15 +501,13 @@ protected:
                    vector<cv::Point2f> &old_output_pts);
   /**
    * Check if an old entry is geometrically consistent (by calculating a 
-   * fundamental matrix) with the given set of keys and descriptors
+   * fundamental matrix) with the given features
    * @param old_entry entry id of the stored image to check
-   * @param keys current keypoints
-   * @param descriptors current descriptors associated to the given keypoints
+   * @param features current keypoints and descriptors
    * @param curvec feature vector of the current entry 
    */
   bool isGeometricallyConsistent_DI(EntryId old_entry, 
-    const std::vector<cv::KeyPoint> &keys, 
-    const std::vector<TDescriptor> &descriptors, 
+    const TemplatedFeatures<TDescriptor> &features, 
     const FeatureVector &curvec,
     std::vector<cv::Point2f> &cur_pts,
     std::vector<cv::Point2f> &old_pts);
@@ -494,11 +541,8 @@ protected:
   // The loop detector stores its own copy of the database
   TemplatedDatabase<TDescriptor,F> *m_database;
   
-  /// KeyPoints of images
-  vector<vector<cv::KeyPoint> > m_image_keys;
-  
-  /// Descriptors of images
-  vector<vector<TDescriptor> > m_image_descriptors;
+  /// Keypoints and descriptors of images, released when erased
+  vector<FeaturesPtr> m_image_features;
   
   /// Last bow vector added to database
   BowVector m_last_bowvec;
@@ -551,6 +595,8 @@ void TemplatedLoopDetector<TDescriptor,F>::Parameters::set(float f)
   max_reprojection_error = 2.0;
   
   max_neighbor_ratio = 0.6;
+
+  max_candidates = 1;
 }
 
 // --------------------------------------------------------------------------
@@ -644,28 +690,23 @@ template<class TDescriptor, class F>
 void TemplatedLoopDetector<TDescriptor,F>::allocate
   (int nentries, int nkeys)
 {
-  const int sz = (const int)m_image_keys.size();
-  
-  if(sz < nentries)
-  {
-    m_image_keys.resize(nentries);
-    m_image_descriptors.resize(nentries);
-  }
-  
-  if(nkeys > 0)
-  {
-    for(int i = sz; i < nentries; ++i)
-    {
-      m_image_keys[i].reserve(nkeys);
-      m_image_descriptors[i].reserve(nkeys);
-    }
-  }
+  // the features are allocated by the caller
+  if((int)m_image_features.size() < nentries)
+    m_image_features.resize(nentries);
   
   m_database->allocate(nentries, nkeys);
 }
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+inline void TemplatedLoopDetector<TDescriptor, F>::setMaxCandidates(int n)
+{
+  m_params.max_candidates = std::max(n, 1);
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 inline const TemplatedDatabase<TDescriptor, F>& 
 TemplatedLoopDetector<TDescriptor, F>::getDatabase() const
@@ -686,23 +727,47 @@ TemplatedLoopDetector<TDescriptor, F>::getVocabulary() const
 
 template<class TDescriptor, class F>
 bool TemplatedLoopDetector<TDescriptor, F>::detectLoop(
-  const std::vector<cv::KeyPoint> &keys, 
-  const std::vector<TDescriptor> &descriptors,
+  const FeaturesPtr &features,
   DetectionResult &match,
   std::vector<cv::Point2f> &cur_pts,
   std::vector<cv::Point2f> &old_pts)
 {
-  EntryId entry_id = m_database->size();
-  match.query = entry_id;
-  
   BowVector bowvec;
   FeatureVector featvec;
-  
+  transform(features->descriptors, bowvec, featvec);
+  return detectLoop(features, bowvec, featvec, match, cur_pts, old_pts);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedLoopDetector<TDescriptor, F>::transform(
+  const std::vector<TDescriptor> &descriptors,
+  BowVector &bowvec, FeatureVector &featvec) const
+{
   if(m_params.geom_check == GEOM_DI)
     m_database->getVocabulary()->transform(descriptors, bowvec, featvec,
       m_params.di_levels);
   else
+  {
     m_database->getVocabulary()->transform(descriptors, bowvec);
+    featvec.clear();
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedLoopDetector<TDescriptor, F>::detectLoop(
+  const FeaturesPtr &features,
+  const BowVector &bowvec, const FeatureVector &featvec,
+  DetectionResult &match,
+  std::vector<cv::Point2f> &cur_pts,
+  std::vector<cv::Point2f> &old_pts)
+{
+  EntryId entry_id = m_database->size();
+  match.query = entry_id;
+  match.candidates.clear();
 
   if((int)entry_id <= m_params.dislocal)
   {
@@ -774,24 +839,44 @@ bool TemplatedLoopDetector<TDescriptor, F>::detectLoop(
             {
               //printf("temporal consistent entries:%d > n_params.k:%d\n", getConsistentEntries(),m_params.k);
               // candidate loop detected
-              // check geometry
-              bool detection;
-
-              if(m_params.geom_check == GEOM_DI)
-              {
-                //printf("loop use direct index for geometrical checking\n");
-                // all the DI stuff is implicit in the database
-                detection = isGeometricallyConsistent_DI(island.best_entry, 
-                  keys, descriptors, featvec, cur_pts, old_pts);
-              }
-              else // GEOM_NONE, accept the match
+              // check geometry of the best entries of the best islands,
+              // this island first
+              std::stable_sort(islands.begin(), islands.end(), tIsland::gt);
+              
+              for(int i = 0; i < (int)islands.size() && 
+                i < m_params.max_candidates; ++i)
               {
-                detection = true;
-                //printf("don't check detec true\n");
+                bool detection;
+                std::vector<cv::Point2f> cur_island_pts, old_island_pts;
+
+                if(m_params.geom_check == GEOM_DI)
+                {
+                  //printf("loop use direct index for geometrical checking\n");
+                  // all the DI stuff is implicit in the database
+                  detection = isGeometricallyConsistent_DI(
+                    islands[i].best_entry, *features, featvec, 
+                    cur_island_pts, old_island_pts);
+                }
+                else // GEOM_NONE, accept the match
+                {
+                  detection = true;
+                  //printf("don't check detec true\n");
+                }
+                
+                if(detection)
+                {
+                  if(match.candidates.empty())
+                  {
+                    cur_pts = cur_island_pts;
+                    old_pts = old_island_pts;
+                  }
+                  match.candidates.push_back(islands[i].best_entry);
+                }
               }
               
-              if(detection)
+              if(!match.candidates.empty())
               {
+                match.match = match.candidates[0];
                 match.status = LOOP_DETECTED;
                 //printf("LOOP_DETECTED\n");
               }
@@ -835,19 +920,10 @@ bool TemplatedLoopDetector<TDescriptor, F>::detectLoop(
   }
 
   // update record
-  // m_image_keys and m_image_descriptors have the same length
-  if(m_image_keys.size() == entry_id)
-  {
-    //printf("image size = entry_id %d\n", entry_id);
-    m_image_keys.push_back(keys);
-    m_image_descriptors.push_back(descriptors);
-  }
+  if(m_image_features.size() == entry_id)
+    m_image_features.push_back(features);
   else
-  {
-    //printf("image size != entry_id %d\n", entry_id);
-    m_image_keys[entry_id] = keys;
-    m_image_descriptors[entry_id] = descriptors;
-  }
+    m_image_features[entry_id] = features;
   
   // store this bowvec if we are going to use it in next iteratons
   if(m_params.use_nss && (int)entry_id + 1 > m_params.dislocal)
@@ -864,6 +940,7 @@ template<class TDescriptor, class F>
 inline void TemplatedLoopDetector<TDescriptor, F>::clear()
 {
   m_database->clear();
+  m_image_features.clear();
   m_window.nentries = 0;
 }
 
@@ -1055,13 +1132,16 @@ bool TemplatedLoopDetector<TDescriptor, F>::checkFoundamental(vector<cv::Point2f
 
 template<class TDescriptor, class F>
 bool TemplatedLoopDetector<TDescriptor, F>::isGeometricallyConsistent_DI(
-  EntryId old_entry, const std::vector<cv::KeyPoint> &keys, 
-  const std::vector<TDescriptor> &descriptors, 
+  EntryId old_entry, const TemplatedFeatures<TDescriptor> &features, 
   const FeatureVector &bowvec,
   std::vector<cv::Point2f> &cur_pts,
   std::vector<cv::Point2f> &old_pts)
 {
   const FeatureVector &oldvec = m_database->retrieveFeatures(old_entry);
+  if(old_entry >= m_image_features.size() || !m_image_features[old_entry])
+    return false;
+  const TemplatedFeatures<TDescriptor> &old_features =
+    *m_image_features[old_entry];
   
   // for each word in common, get the closest descriptors
   
@@ -1079,13 +1159,13 @@ bool TemplatedLoopDetector<TDescriptor, F>::isGeometricallyConsistent_DI(
     if(old_it->first == cur_it->first)
     {
       // compute matches between 
-      // features old_it->second of m_image_keys[old_entry] and
-      // features cur_it->second of keys
+      // features old_it->second of old_features and
+      // features cur_it->second of features
       vector<unsigned int> i_old_now, i_cur_now;
       
       getMatches_neighratio(
-        m_image_descriptors[old_entry], old_it->second, 
-        descriptors, cur_it->second,  
+        old_features.descriptors, old_it->second, 
+        features.descriptors, cur_it->second,  
         i_old_now, i_cur_now);
       
       i_old.insert(i_old.end(), i_old_now.begin(), i_old_now.end());
@@ -1121,11 +1201,8 @@ bool TemplatedLoopDetector<TDescriptor, F>::isGeometricallyConsistent_DI(
     
     for(; oit != i_old.end(); ++oit, ++cit)
     {
-      const cv::KeyPoint &old_k = m_image_keys[old_entry][*oit];
-      const cv::KeyPoint &cur_k = keys[*cit];
-      
-      old_points.push_back(old_k.pt);
-      cur_points.push_back(cur_k.pt);
+      old_points.push_back(old_features.points[*oit]);
+      cur_points.push_back(features.points[*cit]);
     }
   
     cv::Mat oldMat(old_points.size(), 2, CV_32F, &old_points[0]);
@@ -1256,6 +1333,8 @@ void TemplatedLoopDetector<TDescriptor, F>::eraseIndex
     DBoW2::EntryId entry;
     entry = (unsigned int)erase_index[i];
     m_database->delete_entry(entry);
+    if(entry < m_image_features.size())
+      m_image_features[entry].reset();
   }
 }
 } // namespace DLoopDetector
@@ -9,7 +9,6 @@
  
 #include <vector>
 #include <string>
-#include <sstream>
 
 #include "FBrief.h"
 
@@ -27,17 +26,19 @@ void FBrief::meanValue(const std::vector<FBrief::pDescriptor> &descriptors,
   if(descriptors.empty()) return;
   
   const int N2 = descriptors.size() / 2;
-  const int L = descriptors[0]->size();
+  const int L = TDescriptor::BITS;
   
-  vector<int> counters(L, 0);
+  int counters[L] = {0};
 
   vector<FBrief::pDescriptor>::const_iterator it;
   for(it = descriptors.begin(); it != descriptors.end(); ++it)
   {
     const FBrief::TDescriptor &desc = **it;
-    for(int i = 0; i < L; ++i)
+    for(int w = 0; w < TDescriptor::WORDS; ++w)
     {
-      if(desc[i]) counters[i]++;
+      // only visit the bits that are set
+      for(uint64_t bits = desc.words[w]; bits; bits &= bits - 1)
+        counters[w * 64 + __builtin_ctzll(bits)]++;
     }
   }
   
@@ -56,23 +57,26 @@ double FBrief::distance(const FBrief::TDescriptor &a,
   return (double)DVision::BRIEF::distance(a, b);
 }
 
+// --------------------------------------------------------------------------
+
+void FBrief::distances(const FBrief::TDescriptor &a,
+  const FBrief::TDescriptor *b, int n, int *dist)
+{
+  DVision::BRIEF::distances(a, b, n, dist);
+}
+
 // --------------------------------------------------------------------------
   
 std::string FBrief::toString(const FBrief::TDescriptor &a)
 {
-  // from boost::bitset
-  string s;
-  to_string(a, s); // reversed
-  return s;
+  return a.toString(); // reversed, as boost::to_string
 }
 
 // --------------------------------------------------------------------------
   
 void FBrief::fromString(FBrief::TDescriptor &a, const std::string &s)
 {
-  // from boost::bitset
-  stringstream ss(s);
-  ss >> a;
+  a.fromString(s);
 }
 
 // --------------------------------------------------------------------------
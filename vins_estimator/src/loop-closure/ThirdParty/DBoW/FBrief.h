@@ -42,6 +42,16 @@ public:
    * @return distance
    */
   static double distance(const TDescriptor &a, const TDescriptor &b);
+
+  /**
+   * Calculates the distances from a descriptor to n consecutive ones
+   * @param a
+   * @param b first of the n descriptors
+   * @param n
+   * @param dist (out) n distances
+   */
+  static void distances(const TDescriptor &a, const TDescriptor *b, int n,
+    int *dist);
   
   /**
    * Returns a string version of the descriptor
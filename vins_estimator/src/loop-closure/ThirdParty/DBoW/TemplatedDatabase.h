@@ -15,6 +15,7 @@
 #include <fstream>
 #include <string>
 #include <list>
+#include <algorithm>
 #include <set>
 
 #include "TemplatedVocabulary.h"
@@ -142,8 +143,20 @@ public:
   EntryId add(const BowVector &vec, 
     const FeatureVector &fec = FeatureVector() );
 
+  // Added by VINS [[[
+  /**
+   * Deletes an entry. Its pairs stay in the inverted file, skipped by the
+   * queries, until they are a fifth of it and the file is compacted
+   * @param entry_id
+   */
   void delete_entry(const EntryId entry_id);
 
+  /**
+   * Removes the pairs of the deleted entries from the inverted file
+   */
+  void compact();
+  // Added by VINS ]]]
+
   /**
    * Empties the database
    */
@@ -251,6 +264,21 @@ protected:
   void queryDotProduct(const BowVector &vec, QueryResults &ret, 
     int max_results, int max_id) const;
 
+  // Added by VINS [[[
+  /// Entries a query with the given max_id looks at are those < queryLimit,
+  /// -1 means all
+  inline EntryId queryLimit(int max_id) const
+  {
+    if(max_id == -1 || max_id > m_nentries) return m_nentries;
+    return max_id < 0 ? 0 : max_id;
+  }
+
+  /// Calls op(entry_id, query value, entry value) for each pair of the
+  /// rows of the words in vec whose entry id is < limit
+  template<class Op>
+  void forEachPair(const BowVector &vec, EntryId limit, Op op) const;
+  // Added by VINS ]]]
+
 protected:
 
   /* Inverted file declaration */
@@ -282,10 +310,21 @@ protected:
      * @return true iff this entry id is the same as eid
      */
     inline bool operator==(EntryId eid) const { return entry_id == eid; }
+
+    /**
+     * Compares an entry id with the one of a pair
+     * @param p
+     * @param eid
+     * @return true iff the entry id of p is lower than eid
+     */
+    static inline bool ltId(const IFPair &p, EntryId eid)
+    {
+      return p.entry_id < eid;
+    }
   };
   
   /// Row of InvertedFile
-  typedef std::list<IFPair> IFRow;
+  typedef std::vector<IFPair> IFRow;
   // IFRows are sorted in ascending entry_id order
   
   /// Inverted index
@@ -321,6 +360,17 @@ protected:
 
   /// Number of valid entries in m_dfile
   int m_nentries;
+
+  // Added by VINS [[[
+  /// Entries removed by delete_entry, m_erased[entry_id]
+  std::vector<bool> m_erased;
+
+  /// Words whose rows have pairs of deleted entries (may repeat)
+  std::vector<WordId> m_dirty_words;
+
+  /// Pairs of deleted and of the other entries in m_ifile
+  unsigned long m_dead_pairs, m_live_pairs;
+  // Added by VINS ]]]
   
 };
 
@@ -329,7 +379,8 @@ protected:
 template<class TDescriptor, class F>
 TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
   (bool use_di, int di_levels)
-  : m_voc(NULL), m_use_di(use_di), m_dilevels(di_levels), m_nentries(0)
+  : m_voc(NULL), m_use_di(use_di), m_dilevels(di_levels), m_nentries(0),
+    m_dead_pairs(0), m_live_pairs(0)
 {
 }
 
@@ -396,6 +447,10 @@ TemplatedDatabase<TDescriptor,F>& TemplatedDatabase<TDescriptor,F>::operator=
     m_dilevels = db.m_dilevels;
     m_ifile = db.m_ifile;
     m_nentries = db.m_nentries;
+    m_erased = db.m_erased;
+    m_dirty_words = db.m_dirty_words;
+    m_dead_pairs = db.m_dead_pairs;
+    m_live_pairs = db.m_live_pairs;
     m_use_di = db.m_use_di;
     setVocabulary(*db.m_voc);
   }
@@ -470,6 +525,8 @@ EntryId TemplatedDatabase<TDescriptor, F>::add(const BowVector &v,
     IFRow& ifrow = m_ifile[word_id];
     ifrow.push_back(IFPair(entry_id, word_weight));
   }
+  m_erased.push_back(false);
+  m_live_pairs += v.size();
   
   return entry_id;
 }
@@ -479,28 +536,46 @@ EntryId TemplatedDatabase<TDescriptor, F>::add(const BowVector &v,
 template<class TDescriptor, class F>
 void TemplatedDatabase<TDescriptor, F>::delete_entry(const EntryId entry_id)
 {
-  BowVector v = m_dBowfile[entry_id];
+  if(entry_id >= m_erased.size() || m_erased[entry_id]) return;
+  m_erased[entry_id] = true;
+
+  const BowVector &v = m_dBowfile[entry_id];
 
   BowVector::const_iterator vit;
 
   for (vit = v.begin(); vit != v.end(); ++vit)
   {
-    const WordId& word_id = vit->first;
-    IFRow& ifrow = m_ifile[word_id];
-    typename IFRow::iterator rit;
-    for (rit = ifrow.begin(); rit != ifrow.end(); ++rit)
-    {
-      if (rit->entry_id == entry_id)
-      {
-        ifrow.erase(rit);
-        break;
-      }
-    }
+    m_dirty_words.push_back(vit->first);
   }
+  m_dead_pairs += v.size();
+  m_live_pairs -= v.size();
+
   m_dBowfile[entry_id].clear();
   m_dfile[entry_id].clear();
+
+  if(m_dead_pairs * 4 > m_live_pairs) compact();
 }
 
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::compact()
+{
+  std::sort(m_dirty_words.begin(), m_dirty_words.end());
+  m_dirty_words.erase(std::unique(m_dirty_words.begin(), m_dirty_words.end()),
+    m_dirty_words.end());
+
+  std::vector<WordId>::const_iterator wit;
+  for(wit = m_dirty_words.begin(); wit != m_dirty_words.end(); ++wit)
+  {
+    IFRow& ifrow = m_ifile[*wit];
+    ifrow.erase(std::remove_if(ifrow.begin(), ifrow.end(), 
+      [this](const IFPair &p) { return m_erased[p.entry_id]; }), ifrow.end());
+  }
+
+  m_dirty_words.clear();
+  m_dead_pairs = 0;
+}
 
 // --------------------------------------------------------------------------
 
@@ -548,6 +623,9 @@ inline void TemplatedDatabase<TDescriptor, F>::clear()
   m_dfile.resize(0);
   m_dBowfile.resize(0);
   m_nentries = 0;
+  m_erased.clear();
+  m_dirty_words.clear();
+  m_dead_pairs = m_live_pairs = 0;
 }
 
 // --------------------------------------------------------------------------
@@ -561,12 +639,7 @@ void TemplatedDatabase<TDescriptor, F>::allocate(int nd, int ni)
     typename std::vector<IFRow>::iterator rit;
     for(rit = m_ifile.begin(); rit != m_ifile.end(); ++rit)
     {
-      int n = (int)rit->size();
-      if(ni > n)
-      {
-        rit->resize(ni);
-        rit->resize(n);
-      }
+      rit->reserve(ni);
     }
   }
   
@@ -656,51 +729,25 @@ template<class TDescriptor, class F>
 void TemplatedDatabase<TDescriptor, F>::queryL1(const BowVector &vec, 
   QueryResults &ret, int max_results, int max_id) const
 {
-  BowVector::const_iterator vit;
-  typename IFRow::const_iterator rit;
-    
-  std::map<EntryId, double> pairs;
-  std::map<EntryId, double>::iterator pit;
+  // Changed by VINS [[[
+  const EntryId limit = queryLimit(max_id);
+  std::vector<double> scores(limit, 0.);
+  std::vector<int> counters(limit, 0);
   
-  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  forEachPair(vec, limit, [&](EntryId entry_id, WordValue qvalue, 
+    WordValue dvalue)
   {
-    const WordId word_id = vit->first;
-    const WordValue& qvalue = vit->second;
-        
-    const IFRow& row = m_ifile[word_id];
-    
-    // IFRows are sorted in ascending entry_id order
-    
-    for(rit = row.begin(); rit != row.end(); ++rit)
-    {
-      const EntryId entry_id = rit->entry_id;
-      const WordValue& dvalue = rit->word_weight;
-      
-      if((int)entry_id < max_id || max_id == -1)
-      {
-        double value = fabs(qvalue - dvalue) - fabs(qvalue) - fabs(dvalue);
-        
-        pit = pairs.lower_bound(entry_id);
-        if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
-        {
-          pit->second += value;
-        }
-        else
-        {
-          pairs.insert(pit, 
-            std::map<EntryId, double>::value_type(entry_id, value));
-        }
-      }
-      
-    } // for each inverted row
-  } // for each query word
+    scores[entry_id] += fabs(qvalue - dvalue) - fabs(qvalue) - fabs(dvalue);
+    counters[entry_id]++;
+  });
 	
   // move to vector
-  ret.reserve(pairs.size());
-  for(pit = pairs.begin(); pit != pairs.end(); ++pit)
+  for(EntryId eid = 0; eid < limit; ++eid)
   {
-    ret.push_back(Result(pit->first, pit->second));
+    if(counters[eid] > 0 && !m_erased[eid])
+      ret.push_back(Result(eid, scores[eid]));
   }
+  // Changed by VINS ]]]
 	
   // resulting "scores" are now in [-2 best .. 0 worst]	
   
@@ -728,60 +775,25 @@ template<class TDescriptor, class F>
 void TemplatedDatabase<TDescriptor, F>::queryL2(const BowVector &vec, 
   QueryResults &ret, int max_results, int max_id) const
 {
-  BowVector::const_iterator vit;
-  typename IFRow::const_iterator rit;
-  
-  std::map<EntryId, double> pairs;
-  std::map<EntryId, double>::iterator pit;
+  // Changed by VINS [[[
+  const EntryId limit = queryLimit(max_id);
+  std::vector<double> scores(limit, 0.);
+  std::vector<int> counters(limit, 0);
   
-  //map<EntryId, int> counters;
-  //map<EntryId, int>::iterator cit;
-  
-  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  forEachPair(vec, limit, [&](EntryId entry_id, WordValue qvalue, 
+    WordValue dvalue)
   {
-    const WordId word_id = vit->first;
-    const WordValue& qvalue = vit->second;
-    
-    const IFRow& row = m_ifile[word_id];
-    
-    // IFRows are sorted in ascending entry_id order
-    
-    for(rit = row.begin(); rit != row.end(); ++rit)
-    {
-      const EntryId entry_id = rit->entry_id;
-      const WordValue& dvalue = rit->word_weight;
-      
-      if((int)entry_id < max_id || max_id == -1)
-      {
-        double value = - qvalue * dvalue; // minus sign for sorting trick
-        
-        pit = pairs.lower_bound(entry_id);
-        //cit = counters.lower_bound(entry_id);
-        if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
-        {
-          pit->second += value; 
-          //cit->second += 1;
-        }
-        else
-        {
-          pairs.insert(pit, 
-            std::map<EntryId, double>::value_type(entry_id, value));
-          
-          //counters.insert(cit, 
-          //  map<EntryId, int>::value_type(entry_id, 1));
-        }
-      }
-      
-    } // for each inverted row
-  } // for each query word
+    scores[entry_id] -= qvalue * dvalue; // minus sign for sorting trick
+    counters[entry_id]++;
+  });
 	
   // move to vector
-  ret.reserve(pairs.size());
-  //cit = counters.begin();
-  for(pit = pairs.begin(); pit != pairs.end(); ++pit)//, ++cit)
+  for(EntryId eid = 0; eid < limit; ++eid)
   {
-    ret.push_back(Result(pit->first, pit->second));// / cit->second));
+    if(counters[eid] > 0 && !m_erased[eid])
+      ret.push_back(Result(eid, scores[eid]));
   }
+  // Changed by VINS ]]]
 	
   // resulting "scores" are now in [-1 best .. 0 worst]	
   
@@ -816,87 +828,40 @@ template<class TDescriptor, class F>
 void TemplatedDatabase<TDescriptor, F>::queryChiSquare(const BowVector &vec, 
   QueryResults &ret, int max_results, int max_id) const
 {
-  BowVector::const_iterator vit;
-  typename IFRow::const_iterator rit;
-  
-  std::map<EntryId, std::pair<double, int> > pairs;
-  std::map<EntryId, std::pair<double, int> >::iterator pit;
-  
-  std::map<EntryId, std::pair<double, double> > sums; // < sum vi, sum wi >
-  std::map<EntryId, std::pair<double, double> >::iterator sit;
+  // Changed by VINS [[[
+  const EntryId limit = queryLimit(max_id);
+  std::vector<double> scores(limit, 0.);
+  std::vector<int> counters(limit, 0);
+  std::vector<double> sum_vi(limit, 0.), sum_wi(limit, 0.);
   
   // In the current implementation, we suppose vec is not normalized
   
-  //map<EntryId, double> expected;
-  //map<EntryId, double>::iterator eit;
-  
-  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  forEachPair(vec, limit, [&](EntryId entry_id, WordValue qvalue, 
+    WordValue dvalue)
   {
-    const WordId word_id = vit->first;
-    const WordValue& qvalue = vit->second;
-    
-    const IFRow& row = m_ifile[word_id];
-    
-    // IFRows are sorted in ascending entry_id order
-    
-    for(rit = row.begin(); rit != row.end(); ++rit)
-    {
-      const EntryId entry_id = rit->entry_id;
-      const WordValue& dvalue = rit->word_weight;
-      
-      if((int)entry_id < max_id || max_id == -1)
-      {
-        // (v-w)^2/(v+w) - v - w = -4 vw/(v+w)
-        // we move the 4 out
-        double value = 0;
-        if(qvalue + dvalue != 0.0) // words may have weight zero
-          value = - qvalue * dvalue / (qvalue + dvalue);
-        
-        pit = pairs.lower_bound(entry_id);
-        sit = sums.lower_bound(entry_id);
-        //eit = expected.lower_bound(entry_id);
-        if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
-        {
-          pit->second.first += value;
-          pit->second.second += 1;
-          //eit->second += dvalue;
-          sit->second.first += qvalue;
-          sit->second.second += dvalue;
-        }
-        else
-        {
-          pairs.insert(pit, 
-            std::map<EntryId, std::pair<double, int> >::value_type(entry_id,
-              std::make_pair(value, 1) ));
-          //expected.insert(eit, 
-          //  map<EntryId, double>::value_type(entry_id, dvalue));
-          
-          sums.insert(sit, 
-            std::map<EntryId, std::pair<double, double> >::value_type(entry_id,
-              std::make_pair(qvalue, dvalue) ));
-        }
-      }
-      
-    } // for each inverted row
-  } // for each query word
+    // (v-w)^2/(v+w) - v - w = -4 vw/(v+w)
+    // we move the 4 out
+    if(qvalue + dvalue != 0.0) // words may have weight zero
+      scores[entry_id] -= qvalue * dvalue / (qvalue + dvalue);
+    counters[entry_id]++;
+    sum_vi[entry_id] += qvalue;
+    sum_wi[entry_id] += dvalue;
+  });
 	
   // move to vector
-  ret.reserve(pairs.size());
-  sit = sums.begin();
-  for(pit = pairs.begin(); pit != pairs.end(); ++pit, ++sit)
+  for(EntryId eid = 0; eid < limit; ++eid)
   {
-    if(pit->second.second >= MIN_COMMON_WORDS)
+    if(counters[eid] >= MIN_COMMON_WORDS && !m_erased[eid])
     {
-      ret.push_back(Result(pit->first, pit->second.first));
-      ret.back().nWords = pit->second.second;
-      ret.back().sumCommonVi = sit->second.first;
-      ret.back().sumCommonWi = sit->second.second;
+      ret.push_back(Result(eid, scores[eid]));
+      ret.back().nWords = counters[eid];
+      ret.back().sumCommonVi = sum_vi[eid];
+      ret.back().sumCommonWi = sum_wi[eid];
       ret.back().expectedChiScore = 
-        2 * sit->second.second / (1 + sit->second.second);
+        2 * sum_wi[eid] / (1 + sum_wi[eid]);
     }
-  
-    //ret.push_back(Result(pit->first, pit->second));
   }
+  // Changed by VINS ]]]
 	
   // resulting "scores" are now in [-2 best .. 0 worst]	
   // we have to add +2 to the scores to obtain the chi square score
@@ -927,76 +892,40 @@ template<class TDescriptor, class F>
 void TemplatedDatabase<TDescriptor, F>::queryKL(const BowVector &vec, 
   QueryResults &ret, int max_results, int max_id) const
 {
-  BowVector::const_iterator vit;
-  typename IFRow::const_iterator rit;
-  
-  std::map<EntryId, double> pairs;
-  std::map<EntryId, double>::iterator pit;
-  
-  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  // Changed by VINS [[[
+  const EntryId limit = queryLimit(max_id);
+  std::vector<double> scores(limit, 0.);
+  std::vector<int> counters(limit, 0);
+  // part of the completion below for the words an entry has
+  std::vector<double> common(limit, 0.);
+  
+  forEachPair(vec, limit, [&](EntryId entry_id, WordValue vi, WordValue wi)
   {
-    const WordId word_id = vit->first;
-    const WordValue& vi = vit->second;
-    
-    const IFRow& row = m_ifile[word_id];
-    
-    // IFRows are sorted in ascending entry_id order
-    
-    for(rit = row.begin(); rit != row.end(); ++rit)
-    {    
-      const EntryId entry_id = rit->entry_id;
-      const WordValue& wi = rit->word_weight;
-      
-      if((int)entry_id < max_id || max_id == -1)
-      {
-        double value = 0;
-        if(vi != 0 && wi != 0) value = vi * log(vi/wi);
-        
-        pit = pairs.lower_bound(entry_id);
-        if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
-        {
-          pit->second += value;
-        }
-        else
-        {
-          pairs.insert(pit, 
-            std::map<EntryId, double>::value_type(entry_id, value));
-        }
-      }
-      
-    } // for each inverted row
-  } // for each query word
+    if(vi != 0 && wi != 0) scores[entry_id] += vi * log(vi/wi);
+    if(vi != 0) common[entry_id] += vi * (log(vi) - GeneralScoring::LOG_EPS);
+    counters[entry_id]++;
+  });
 	
   // resulting "scores" are now in [-X worst .. 0 best .. X worst]
   // but we cannot make sure which ones are better without calculating
   // the complete score
 
-  // complete scores and move to vector
-  ret.reserve(pairs.size());
-  for(pit = pairs.begin(); pit != pairs.end(); ++pit)
+  // complete scores with the words that are not in the entries, that is
+  // all the words minus the common ones, and move to vector
+  double value = 0.0;
+  BowVector::const_iterator vit;
+  for(vit = vec.begin(); vit != vec.end(); ++vit)
   {
-    EntryId eid = pit->first;
-    double value = 0.0;
-
-    for(vit = vec.begin(); vit != vec.end(); ++vit)
-    {
-      const WordValue &vi = vit->second;
-      const IFRow& row = m_ifile[vit->first];
+    const WordValue &vi = vit->second;
+    if(vi != 0) value += vi * (log(vi) - GeneralScoring::LOG_EPS);
+  }
 
-      if(vi != 0)
-      {
-        if(row.end() == find(row.begin(), row.end(), eid ))
-        {
-          value += vi * (log(vi) - GeneralScoring::LOG_EPS);
-        }
-      }
-    }
-    
-    pit->second += value;
-    
-    // to vector
-    ret.push_back(Result(pit->first, pit->second));
+  for(EntryId eid = 0; eid < limit; ++eid)
+  {
+    if(counters[eid] > 0 && !m_erased[eid])
+      ret.push_back(Result(eid, scores[eid] + value - common[eid]));
   }
+  // Changed by VINS ]]]
   
   // real scores are now in [0 best .. X worst]
 
@@ -1018,61 +947,29 @@ template<class TDescriptor, class F>
 void TemplatedDatabase<TDescriptor, F>::queryBhattacharyya(
   const BowVector &vec, QueryResults &ret, int max_results, int max_id) const
 {
-  BowVector::const_iterator vit;
-  typename IFRow::const_iterator rit;
-  
-  //map<EntryId, double> pairs;
-  //map<EntryId, double>::iterator pit;
+  // Changed by VINS [[[
+  const EntryId limit = queryLimit(max_id);
+  std::vector<double> scores(limit, 0.);
+  std::vector<int> counters(limit, 0);
   
-  std::map<EntryId, std::pair<double, int> > pairs; // <eid, <score, counter> >
-  std::map<EntryId, std::pair<double, int> >::iterator pit;
-  
-  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  forEachPair(vec, limit, [&](EntryId entry_id, WordValue qvalue, 
+    WordValue dvalue)
   {
-    const WordId word_id = vit->first;
-    const WordValue& qvalue = vit->second;
-    
-    const IFRow& row = m_ifile[word_id];
-    
-    // IFRows are sorted in ascending entry_id order
-    
-    for(rit = row.begin(); rit != row.end(); ++rit)
-    {
-      const EntryId entry_id = rit->entry_id;
-      const WordValue& dvalue = rit->word_weight;
-      
-      if((int)entry_id < max_id || max_id == -1)
-      {
-        double value = sqrt(qvalue * dvalue);
-        
-        pit = pairs.lower_bound(entry_id);
-        if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
-        {
-          pit->second.first += value;
-          pit->second.second += 1;
-        }
-        else
-        {
-          pairs.insert(pit, 
-            std::map<EntryId, std::pair<double, int> >::value_type(entry_id,
-              std::make_pair(value, 1)));
-        }
-      }
-      
-    } // for each inverted row
-  } // for each query word
+    scores[entry_id] += sqrt(qvalue * dvalue);
+    counters[entry_id]++;
+  });
 	
   // move to vector
-  ret.reserve(pairs.size());
-  for(pit = pairs.begin(); pit != pairs.end(); ++pit)
+  for(EntryId eid = 0; eid < limit; ++eid)
   {
-    if(pit->second.second >= MIN_COMMON_WORDS)
+    if(counters[eid] >= MIN_COMMON_WORDS && !m_erased[eid])
     {
-      ret.push_back(Result(pit->first, pit->second.first));
-      ret.back().nWords = pit->second.second;
-      ret.back().bhatScore = pit->second.first;
+      ret.push_back(Result(eid, scores[eid]));
+      ret.back().nWords = counters[eid];
+      ret.back().bhatScore = scores[eid];
     }
   }
+  // Changed by VINS ]]]
 	
   // scores are already in [0..1]
 
@@ -1091,55 +988,29 @@ template<class TDescriptor, class F>
 void TemplatedDatabase<TDescriptor, F>::queryDotProduct(
   const BowVector &vec, QueryResults &ret, int max_results, int max_id) const
 {
-  BowVector::const_iterator vit;
-  typename IFRow::const_iterator rit;
-  
-  std::map<EntryId, double> pairs;
-  std::map<EntryId, double>::iterator pit;
-  
-  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  // Changed by VINS [[[
+  const EntryId limit = queryLimit(max_id);
+  std::vector<double> scores(limit, 0.);
+  std::vector<int> counters(limit, 0);
+  const bool binary = this->m_voc->getWeightingType() == BINARY;
+  
+  forEachPair(vec, limit, [&](EntryId entry_id, WordValue qvalue, 
+    WordValue dvalue)
   {
-    const WordId word_id = vit->first;
-    const WordValue& qvalue = vit->second;
-    
-    const IFRow& row = m_ifile[word_id];
-    
-    // IFRows are sorted in ascending entry_id order
-    
-    for(rit = row.begin(); rit != row.end(); ++rit)
-    {
-      const EntryId entry_id = rit->entry_id;
-      const WordValue& dvalue = rit->word_weight;
-      
-      if((int)entry_id < max_id || max_id == -1)
-      {
-        double value; 
-        if(this->m_voc->getWeightingType() == BINARY)
-          value = 1;
-        else
-          value = qvalue * dvalue;
-        
-        pit = pairs.lower_bound(entry_id);
-        if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
-        {
-          pit->second += value;
-        }
-        else
-        {
-          pairs.insert(pit, 
-            std::map<EntryId, double>::value_type(entry_id, value));
-        }
-      }
-      
-    } // for each inverted row
-  } // for each query word
+    if(binary)
+      scores[entry_id] += 1;
+    else
+      scores[entry_id] += qvalue * dvalue;
+    counters[entry_id]++;
+  });
 	
   // move to vector
-  ret.reserve(pairs.size());
-  for(pit = pairs.begin(); pit != pairs.end(); ++pit)
+  for(EntryId eid = 0; eid < limit; ++eid)
   {
-    ret.push_back(Result(pit->first, pit->second));
+    if(counters[eid] > 0 && !m_erased[eid])
+      ret.push_back(Result(eid, scores[eid]));
   }
+  // Changed by VINS ]]]
 	
   // scores are the greater the better
 
@@ -1155,6 +1026,33 @@ void TemplatedDatabase<TDescriptor, F>::queryDotProduct(
 
 // ---------------------------------------------------------------------------
 
+// Added by VINS [[[
+template<class TDescriptor, class F>
+template<class Op>
+inline void TemplatedDatabase<TDescriptor, F>::forEachPair(
+  const BowVector &vec, EntryId limit, Op op) const
+{
+  BowVector::const_iterator vit;
+  typename IFRow::const_iterator rit;
+
+  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  {
+    const IFRow& row = m_ifile[vit->first];
+    
+    // IFRows are sorted in ascending entry_id order, the pairs of the
+    // entries >= limit are at the end
+    typename IFRow::const_iterator rend = row.end();
+    if(!row.empty() && row.back().entry_id >= limit)
+      rend = std::lower_bound(row.begin(), row.end(), limit, IFPair::ltId);
+    
+    for(rit = row.begin(); rit != rend; ++rit)
+      op(rit->entry_id, vit->second, rit->word_weight);
+  }
+}
+// Added by VINS ]]]
+
+// ---------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 const FeatureVector& TemplatedDatabase<TDescriptor, F>::retrieveFeatures
   (EntryId id) const
@@ -1230,6 +1128,7 @@ void TemplatedDatabase<TDescriptor, F>::save(cv::FileStorage &fs,
     fs << "["; // word of IF
     for(irit = iit->begin(); irit != iit->end(); ++irit)
     {
+      if(m_erased[irit->entry_id]) continue;
       fs << "{:" 
         << "imageId" << (int)irit->entry_id
         << "weight" << irit->word_weight
@@ -1300,6 +1199,7 @@ void TemplatedDatabase<TDescriptor, F>::load(const cv::FileStorage &fs,
   cv::FileNode fdb = fs[name];
   
   m_nentries = (int)fdb["nEntries"]; 
+  m_erased.assign(m_nentries, false);
   m_use_di = (int)fdb["usingDI"] != 0;
   m_dilevels = (int)fdb["diLevels"];
   
@@ -1314,6 +1214,7 @@ void TemplatedDatabase<TDescriptor, F>::load(const cv::FileStorage &fs,
       WordValue v = fw[i]["weight"];
       
       m_ifile[wid].push_back(IFPair(eid, v));
+      m_live_pairs++;
     }
   }
   
@@ -27,7 +27,11 @@
 
 // Added by VINS [[[
 #include "../VocabularyBinary.hpp"
-#include <boost/dynamic_bitset.hpp>
+#include "../VocabularyFlat.hpp"
+#include "../../../utility/worker_pool.h"
+#include <cstring>
+#include <memory>
+#include <limits>
 // Added by VINS ]]]
 
 namespace DBoW2 {
@@ -140,6 +144,22 @@ public:
   virtual void transform(const std::vector<TDescriptor>& features,
     BowVector &v, FeatureVector &fv, int levelsup) const;
 
+  // Added by VINS [[[
+  /**
+   * Transforms a set of descriptors into words, in parallel if there are
+   * many of them
+   * @param features
+   * @param ids (out) word id of each feature
+   * @param weights (out) word weight of each feature, 0 if stopped
+   * @param nids (out) if given, id of the node "levelsup" levels up of each
+   *   feature
+   * @param levelsup
+   */
+  void transform(const std::vector<TDescriptor>& features,
+    std::vector<WordId> &ids, std::vector<WordValue> &weights,
+    std::vector<NodeId> *nids = NULL, int levelsup = 0) const;
+  // Added by VINS ]]]
+
   /**
    * Transforms a single feature into a word (without weight)
    * @param feature
@@ -258,7 +278,21 @@ public:
     const std::string &name = "vocabulary");
     
   // Added by VINS [[[
+  /**
+   * Loads a binary vocabulary (see VocabularyBinary.hpp) into the layout of
+   * a flat vocabulary. Only for 256 bit binary descriptors
+   * @param filename
+   */
   virtual void loadBin(const std::string &filename);
+
+  /**
+   * Uses a flat vocabulary file (see VocabularyFlat.hpp) in place, mapped
+   * instead of read, so no node is allocated. Copies of this vocabulary
+   * share the mapping. Only for 256 bit binary descriptors
+   * @param filename
+   * @return false if the file is not a flat vocabulary
+   */
+  bool loadFlat(const std::string &filename);
   // Added by VINS ]]]
     
   /** 
@@ -412,6 +446,25 @@ protected:
   /// Words of the vocabulary (tree leaves)
   /// this condition holds: m_words[wid]->word_id == wid
   std::vector<Node*> m_words;
+
+  // Added by VINS [[[
+  /// Flat vocabulary, mapped or built by loadBin, replaces m_nodes and
+  /// m_words if set
+  std::shared_ptr<VINSLoop::FlatVocabulary> m_flat;
+
+  /// Descriptor of a node of the flat vocabulary, the descriptors of
+  /// consecutive nodes are consecutive
+  inline const TDescriptor& flatDescriptor(NodeId nid) const
+  {
+    return *reinterpret_cast<const TDescriptor*>(m_flat->descriptor(nid));
+  }
+
+  /// Uses the given flat vocabulary instead of m_nodes and m_words
+  void setFlat(const std::shared_ptr<VINSLoop::FlatVocabulary> &flat);
+
+  /// Threads that transform large sets of features, the loop closure pool
+  static WorkerPool &workerPool();
+  // Added by VINS ]]]
   
 };
 
@@ -436,7 +489,7 @@ TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
     //m_scoring = KL;
     // Changed by VINS [[[
     //printf("loop start load bin\n");
-    loadBin(filename);
+    if(!loadFlat(filename)) loadBin(filename);
     // Changed by VINS ]]]
 }
 
@@ -449,7 +502,7 @@ TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
     //m_scoring = KL;
     // Changed by VINS [[[
     //printf("loop start load bin\n");
-    loadBin(filename);
+    if(!loadFlat(filename)) loadBin(filename);
     // Changed by VINS ]]]
 }
 
@@ -545,6 +598,7 @@ TemplatedVocabulary<TDescriptor,F>::operator=
   
   this->m_nodes = voc.m_nodes;
   this->createWords();
+  this->m_flat = voc.m_flat;
   
   return *this;
 }
@@ -557,6 +611,7 @@ void TemplatedVocabulary<TDescriptor,F>::create(
 {
   m_nodes.clear();
   m_words.clear();
+  m_flat.reset();
   
   // expected_nodes = Sum_{i=0..L} ( k^i )
 	int expected_nodes = 
@@ -999,6 +1054,7 @@ void TemplatedVocabulary<TDescriptor,F>::setNodeWeights
 template<class TDescriptor, class F>
 inline unsigned int TemplatedVocabulary<TDescriptor,F>::size() const
 {
+  if(m_flat) return m_flat->header().nWords;
   return m_words.size();
 }
 
@@ -1007,7 +1063,7 @@ inline unsigned int TemplatedVocabulary<TDescriptor,F>::size() const
 template<class TDescriptor, class F>
 inline bool TemplatedVocabulary<TDescriptor,F>::empty() const
 {
-  return m_words.empty();
+  return size() == 0;
 }
 
 // --------------------------------------------------------------------------
@@ -1016,6 +1072,16 @@ template<class TDescriptor, class F>
 float TemplatedVocabulary<TDescriptor,F>::getEffectiveLevels() const
 {
   long sum = 0;
+  if(m_flat)
+  {
+    const VINSLoop::FlatNode *nodes = m_flat->nodes();
+    for(WordId wid = 0; wid < size(); ++wid)
+    {
+      for(int p = m_flat->wordNode(wid); p != 0; sum++) p = nodes[p].parent;
+    }
+    return (float)((double)sum / (double)size());
+  }
+
   typename std::vector<Node*>::const_iterator wit;
   for(wit = m_words.begin(); wit != m_words.end(); ++wit)
   {
@@ -1032,6 +1098,7 @@ float TemplatedVocabulary<TDescriptor,F>::getEffectiveLevels() const
 template<class TDescriptor, class F>
 TDescriptor TemplatedVocabulary<TDescriptor,F>::getWord(WordId wid) const
 {
+  if(m_flat) return flatDescriptor(m_flat->wordNode(wid));
   return m_words[wid]->descriptor;
 }
 
@@ -1040,6 +1107,7 @@ TDescriptor TemplatedVocabulary<TDescriptor,F>::getWord(WordId wid) const
 template<class TDescriptor, class F>
 WordValue TemplatedVocabulary<TDescriptor, F>::getWordWeight(WordId wid) const
 {
+  if(m_flat) return m_flat->nodes()[m_flat->wordNode(wid)].weight;
   return m_words[wid]->weight;
 }
 
@@ -1076,20 +1144,19 @@ void TemplatedVocabulary<TDescriptor,F>::transform(
   LNorm norm;
   bool must = m_scoring_object->mustNormalize(norm);
 
-  typename std::vector<TDescriptor>::const_iterator fit;
+  // Changed by VINS [[[
+  std::vector<WordId> ids;
+  std::vector<WordValue> weights;
+  transform(features, ids, weights);
 
   if(m_weighting == TF || m_weighting == TF_IDF)
   {
-    for(fit = features.begin(); fit < features.end(); ++fit)
+    for(size_t i = 0; i < ids.size(); ++i)
     {
-      WordId id;
-      WordValue w; 
       // w is the idf value if TF_IDF, 1 if TF
       
-      transform(*fit, id, w);
-      
       // not stopped
-      if(w > 0) v.addWeight(id, w);
+      if(weights[i] > 0) v.addWeight(ids[i], weights[i]);
     }
     
     if(!v.empty() && !must)
@@ -1103,19 +1170,16 @@ void TemplatedVocabulary<TDescriptor,F>::transform(
   }
   else // IDF || BINARY
   {
-    for(fit = features.begin(); fit < features.end(); ++fit)
+    for(size_t i = 0; i < ids.size(); ++i)
     {
-      WordId id;
-      WordValue w;
       // w is idf if IDF, or 1 if BINARY
       
-      transform(*fit, id, w);
-      
       // not stopped
-      if(w > 0) v.addIfNotExist(id, w);
+      if(weights[i] > 0) v.addIfNotExist(ids[i], weights[i]);
       
     } // if add_features
   } // if m_weighting == ...
+  // Changed by VINS ]]]
   
   if(must) v.normalize(norm);
 }
@@ -1139,24 +1203,22 @@ void TemplatedVocabulary<TDescriptor,F>::transform(
   LNorm norm;
   bool must = m_scoring_object->mustNormalize(norm);
   
-  typename std::vector<TDescriptor>::const_iterator fit;
-  
+  // Changed by VINS [[[
+  std::vector<WordId> ids;
+  std::vector<WordValue> weights;
+  std::vector<NodeId> nids;
+  transform(features, ids, weights, &nids, levelsup);
+
   if(m_weighting == TF || m_weighting == TF_IDF)
   {
-    unsigned int i_feature = 0;
-    for(fit = features.begin(); fit < features.end(); ++fit, ++i_feature)
+    for(unsigned int i_feature = 0; i_feature < ids.size(); ++i_feature)
     {
-      WordId id;
-      NodeId nid;
-      WordValue w; 
       // w is the idf value if TF_IDF, 1 if TF
       
-      transform(*fit, id, w, &nid, levelsup);
-      
-      if(w > 0) // not stopped
+      if(weights[i_feature] > 0) // not stopped
       { 
-        v.addWeight(id, w);
-        fv.addFeature(nid, i_feature);
+        v.addWeight(ids[i_feature], weights[i_feature]);
+        fv.addFeature(nids[i_feature], i_feature);
       }
     }
     
@@ -1171,29 +1233,65 @@ void TemplatedVocabulary<TDescriptor,F>::transform(
   }
   else // IDF || BINARY
   {
-    unsigned int i_feature = 0;
-    for(fit = features.begin(); fit < features.end(); ++fit, ++i_feature)
+    for(unsigned int i_feature = 0; i_feature < ids.size(); ++i_feature)
     {
-      WordId id;
-      NodeId nid;
-      WordValue w;
       // w is idf if IDF, or 1 if BINARY
       
-      transform(*fit, id, w, &nid, levelsup);
-      
-      if(w > 0) // not stopped
+      if(weights[i_feature] > 0) // not stopped
       {
-        v.addIfNotExist(id, w);
-        fv.addFeature(nid, i_feature);
+        v.addIfNotExist(ids[i_feature], weights[i_feature]);
+        fv.addFeature(nids[i_feature], i_feature);
       }
     }
   } // if m_weighting == ...
+  // Changed by VINS ]]]
   
   if(must) v.normalize(norm);
 }
 
 // --------------------------------------------------------------------------
 
+// Added by VINS [[[
+template<class TDescriptor, class F> 
+void TemplatedVocabulary<TDescriptor,F>::transform(
+  const std::vector<TDescriptor>& features,
+  std::vector<WordId> &ids, std::vector<WordValue> &weights,
+  std::vector<NodeId> *nids, int levelsup) const
+{
+  const int n = features.size();
+  ids.resize(n);
+  weights.resize(n);
+  if(nids) nids->resize(n);
+
+  // every feature goes down the tree on its own, chunks of them are 
+  // transformed by the worker threads 
+  const int CHUNK = 64;
+  const int num_chunks = (n + CHUNK - 1) / CHUNK;
+  std::function<void(int)> task = [&](int id)
+  {
+    const int end = std::min((id + 1) * CHUNK, n);
+    for(int i = id * CHUNK; i < end; ++i)
+      transform(features[i], ids[i], weights[i], 
+        nids ? &(*nids)[i] : NULL, levelsup);
+  };
+
+  if(num_chunks > 1)
+    workerPool().parallelFor(num_chunks, task);
+  else if(num_chunks == 1)
+    task(0);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+WorkerPool &TemplatedVocabulary<TDescriptor,F>::workerPool()
+{
+  return loopClosureWorkerPool();
+}
+// Added by VINS ]]]
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F> 
 inline double TemplatedVocabulary<TDescriptor,F>::score
   (const BowVector &v1, const BowVector &v2) const
@@ -1218,7 +1316,6 @@ void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature,
   WordId &word_id, WordValue &weight, NodeId *nid, int levelsup) const
 { 
   // propagate the feature down the tree
-  std::vector<NodeId> nodes;
   typename std::vector<NodeId>::const_iterator nit;
 
   // level at which the node must be stored in nid, if given
@@ -1228,10 +1325,49 @@ void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature,
   NodeId final_id = 0; // root
   int current_level = 0;
 
+  if(m_flat)
+  {
+    // children are consecutive nodes with consecutive descriptors, their
+    // distances are computed at once
+    const VINSLoop::FlatNode *flat_nodes = m_flat->nodes();
+    const int MAX_CHILDREN = 64;
+    int d[MAX_CHILDREN];
+    do
+    {
+      ++current_level;
+      const VINSLoop::FlatNode &parent = flat_nodes[final_id];
+      final_id = parent.firstChild;
+      int best_d = std::numeric_limits<int>::max();
+
+      for(int first = 0; first < parent.nChildren; first += MAX_CHILDREN)
+      {
+        const int n = std::min(parent.nChildren - first, MAX_CHILDREN);
+        F::distances(feature, &flatDescriptor(parent.firstChild + first), n, d);
+        for(int i = 0; i < n; ++i)
+        {
+          if(d[i] < best_d)
+          {
+            best_d = d[i];
+            final_id = parent.firstChild + first + i;
+          }
+        }
+      }
+
+      if(nid != NULL && current_level == nid_level)
+        *nid = final_id;
+
+    } while(flat_nodes[final_id].nChildren > 0);
+
+    word_id = flat_nodes[final_id].wordId;
+    weight = flat_nodes[final_id].weight;
+    return;
+  }
+
   do
   {
     ++current_level;
-    nodes = m_nodes[final_id].children;
+    // Changed by VINS: no copy of the children
+    const std::vector<NodeId> &nodes = m_nodes[final_id].children;
     final_id = nodes[0];
  
     double best_d = F::distance(feature, m_nodes[final_id].descriptor);
@@ -1263,6 +1399,14 @@ template<class TDescriptor, class F>
 NodeId TemplatedVocabulary<TDescriptor,F>::getParentNode
   (WordId wid, int levelsup) const
 {
+  if(m_flat)
+  {
+    NodeId ret = m_flat->wordNode(wid);
+    for(; levelsup > 0 && ret != 0; --levelsup)
+      ret = m_flat->nodes()[ret].parent;
+    return ret;
+  }
+
   NodeId ret = m_words[wid]->id; // node id
   while(levelsup > 0 && ret != 0) // ret == 0 --> root
   {
@@ -1279,6 +1423,32 @@ void TemplatedVocabulary<TDescriptor,F>::getWordsFromNode
   (NodeId nid, std::vector<WordId> &words) const
 {
   words.clear();
+
+  if(m_flat)
+  {
+    // breadth first, the nodes of each level below nid are one range
+    const VINSLoop::FlatNode *nodes = m_flat->nodes();
+    NodeId first = nid, last = nid + 1;
+    while(first < last)
+    {
+      NodeId next_first = 0, next_last = 0;
+      for(NodeId id = first; id < last; ++id)
+      {
+        if(nodes[id].nChildren == 0)
+        {
+          words.push_back(nodes[id].wordId);
+        }
+        else
+        {
+          if(next_last == 0) next_first = nodes[id].firstChild;
+          next_last = nodes[id].firstChild + nodes[id].nChildren;
+        }
+      }
+      first = next_first;
+      last = next_last;
+    }
+    return;
+  }
   
   if(m_nodes[nid].isLeaf())
   {
@@ -1319,6 +1489,22 @@ template<class TDescriptor, class F>
 int TemplatedVocabulary<TDescriptor,F>::stopWords(double minWeight)
 {
   int c = 0;
+  if(m_flat)
+  {
+    // the mapping is private, the file is not modified
+    VINSLoop::FlatNode *nodes = m_flat->nodes();
+    for(WordId wid = 0; wid < size(); ++wid)
+    {
+      VINSLoop::FlatNode &node = nodes[m_flat->wordNode(wid)];
+      if(node.weight < minWeight)
+      {
+        ++c;
+        node.weight = 0;
+      }
+    }
+    return c;
+  }
+
   typename std::vector<Node*>::iterator wit;
   for(wit = m_words.begin(); wit != m_words.end(); ++wit)
   {
@@ -1359,6 +1545,11 @@ template<class TDescriptor, class F>
 void TemplatedVocabulary<TDescriptor,F>::save(cv::FileStorage &f,
   const std::string &name) const
 {
+  // Added by VINS [[[
+  if(m_flat)
+    throw std::string("A flat vocabulary cannot be saved in this format");
+  // Added by VINS ]]]
+
   // Format YAML:
   // vocabulary 
   // {
@@ -1458,6 +1649,7 @@ void TemplatedVocabulary<TDescriptor,F>::load(const cv::FileStorage &fs,
 {
   m_words.clear();
   m_nodes.clear();
+  m_flat.reset();
   
   cv::FileNode fvoc = fs[name];
   
@@ -1508,56 +1700,46 @@ void TemplatedVocabulary<TDescriptor,F>::load(const cv::FileStorage &fs,
 template<class TDescriptor, class F>
 void TemplatedVocabulary<TDescriptor,F>::loadBin(const std::string &filename) {
     
-  m_words.clear();
-  m_nodes.clear();
   //printf("loop load bin\n");
   std::ifstream ifStream(filename);
   VINSLoop::Vocabulary voc;
   voc.deserialize(ifStream);
   ifStream.close();
-  
-  m_k = voc.k;
-  m_L = voc.L;
-  m_scoring = (ScoringType)voc.scoringType;
-  m_weighting = (WeightingType)voc.weightingType;
-  
-  createScoringObject();
-
-  m_nodes.resize(voc.nNodes + 1); // +1 to include root
-  m_nodes[0].id = 0;
 
-  for(unsigned int i = 0; i < voc.nNodes; ++i)
-  {
-    NodeId nid = voc.nodes[i].nodeId;
-    NodeId pid = voc.nodes[i].parentId;
-    WordValue weight = voc.nodes[i].weight;
-      
-    m_nodes[nid].id = nid;
-    m_nodes[nid].parent = pid;
-    m_nodes[nid].weight = weight;
-    m_nodes[pid].children.push_back(nid);
-      
-    // Sorry to break template here
-    m_nodes[nid].descriptor = boost::dynamic_bitset<>(voc.nodes[i].descriptor, voc.nodes[i].descriptor + 4);
+  // the tree is laid out breadth first as in a flat vocabulary file, so the
+  // descent in transform reads consecutive memory
+  std::shared_ptr<VINSLoop::FlatVocabulary> flat(new VINSLoop::FlatVocabulary);
+  flat->build(voc);
+  setFlat(flat);
+}
     
-    if (i < 5) {
-      std::string test;
-      boost::to_string(m_nodes[nid].descriptor, test);
-      //cout << "descriptor[" << i << "] = " << test << endl;
-    }
-  }
-  
-  // words
-  m_words.resize(voc.nWords);
+template<class TDescriptor, class F>
+bool TemplatedVocabulary<TDescriptor,F>::loadFlat(const std::string &filename) {
 
-  for(unsigned int i = 0; i < voc.nWords; ++i)
-  {
-    NodeId wid = (int)voc.words[i].wordId;
-    NodeId nid = (int)voc.words[i].nodeId;
-    
-    m_nodes[nid].word_id = wid;
-    m_words[wid] = &m_nodes[nid];
-  }
+  std::shared_ptr<VINSLoop::FlatVocabulary> flat(new VINSLoop::FlatVocabulary);
+  if(!flat->open(filename)) return false;
+  setFlat(flat);
+  return true;
+}
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::setFlat
+  (const std::shared_ptr<VINSLoop::FlatVocabulary> &flat) {
+
+  if(sizeof(TDescriptor) != 4 * sizeof(uint64_t))
+    throw std::string("Flat vocabularies hold 256 bit descriptors only");
+
+  m_words.clear();
+  m_nodes.clear();
+  m_flat = flat;
+
+  const VINSLoop::FlatHeader &header = m_flat->header();
+  m_k = header.k;
+  m_L = header.L;
+  m_scoring = (ScoringType)header.scoringType;
+  m_weighting = (WeightingType)header.weightingType;
+
+  createScoringObject();
 }
     
 // Added by VINS ]]]
@@ -12,19 +12,55 @@
 
 #include "BRIEF.h"
 #include "../DUtils/DUtils.h"
-#include <boost/dynamic_bitset.hpp>
 #include <vector>
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define BRIEF_DISTANCE_SIMD
+#endif
+
 using namespace std;
 using namespace DVision;
 
 // ----------------------------------------------------------------------------
 
+std::string BRIEFDescriptor::toString() const
+{
+  std::string s(BITS, '0');
+  for(int i = 0; i < BITS; ++i)
+  {
+    if(test(i)) s[BITS - 1 - i] = '1';
+  }
+  return s;
+}
+
+// ----------------------------------------------------------------------------
+
+bool BRIEFDescriptor::fromString(const std::string &s)
+{
+  reset();
+
+  std::string::size_type b = s.find_first_not_of(" \t\n\r");
+  if(b == std::string::npos) return false;
+  std::string::size_type e = s.find_first_not_of("01", b);
+  if(e == std::string::npos) e = s.size();
+
+  const int L = e - b;
+  if(L == 0 || L > BITS) return false;
+  for(int k = 0; k < L; ++k)
+  {
+    if(s[b + k] == '1') set(L - 1 - k);
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
 BRIEF::BRIEF(int nbits, int patch_size, Type type):
   m_bit_length(nbits), m_patch_size(patch_size), m_type(type)
 {
   assert(patch_size > 1);
-  assert(nbits > 0);
+  assert(nbits > 0 && nbits <= bitset::BITS);
   generateTestPoints();
 }
 
@@ -41,63 +77,143 @@ void BRIEF::compute(const cv::Mat &image,
     vector<bitset> &descriptors,
     bool treat_image) const
 {
-  const float sigma = 2.f;
-  const cv::Size ksize(9, 9);
-  
   cv::Mat im;
   if(treat_image)
   {
-    cv::Mat aux;
-    if(image.depth() == 3)
-    {
-      cv::cvtColor(image, aux, CV_RGB2GRAY);
-    }
-    else
-    {
-      aux = image;
-    }
-
-    cv::GaussianBlur(aux, im, ksize, sigma, sigma);
-    
+    smooth(image, points, im);
   }
   else
   {
     im = image;
   }
-  
+
+  descriptors.resize(points.size());
+  compute(im, points, 0, points.size(), descriptors);
+}
+
+// ---------------------------------------------------------------------------
+
+void BRIEF::smooth(const cv::Mat &image, 
+    const std::vector<cv::KeyPoint> &points, cv::Mat &im) const
+{
+  const float sigma = 2.f;
+  const cv::Size ksize(9, 9);
+  const int TILE = 32;
+
+  cv::Mat aux;
+  if(image.depth() == 3)
+  {
+    cv::cvtColor(image, aux, CV_RGB2GRAY);
+  }
+  else
+  {
+    aux = image;
+  }
+
+  const int W = aux.cols;
+  const int H = aux.rows;
+  const int TW = (W + TILE - 1) / TILE;
+  const int TH = (H + TILE - 1) / TILE;
+  im.create(H, W, CV_8UC1);
+
+  // tiles reached by any patch, one pixel more for the rounding of the 
+  // keypoint coordinates
+  vector<unsigned char> used(TW * TH, 0);
+  const int r = m_max_offset + 1;
+  std::vector<cv::KeyPoint>::const_iterator kit;
+  for(kit = points.begin(); kit != points.end(); ++kit)
+  {
+    const int x0 = max(0, (int)kit->pt.x - r) / TILE;
+    const int x1 = min(W - 1, (int)kit->pt.x + r) / TILE;
+    const int y0 = max(0, (int)kit->pt.y - r) / TILE;
+    const int y1 = min(H - 1, (int)kit->pt.y + r) / TILE;
+    for(int ty = y0; ty <= y1; ++ty)
+      for(int tx = x0; tx <= x1; ++tx)
+        used[ty * TW + tx] = 1;
+  }
+
+  // blur each run of used tiles in a tile row. A roi keeps reading the 
+  // pixels around it, so the result matches blurring the whole image
+  for(int ty = 0; ty < TH; ++ty)
+  {
+    for(int tx = 0; tx < TW; )
+    {
+      if(!used[ty * TW + tx])
+      {
+        ++tx;
+        continue;
+      }
+      int te = tx;
+      while(te < TW && used[ty * TW + te]) ++te;
+
+      const cv::Rect roi(tx * TILE, ty * TILE, min(W, te * TILE) - tx * TILE,
+        min(H, (ty + 1) * TILE) - ty * TILE);
+      cv::Mat dst = im(roi);
+      cv::GaussianBlur(aux(roi), dst, ksize, sigma, sigma);
+      tx = te;
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+
+void BRIEF::compute(const cv::Mat &im, const std::vector<cv::KeyPoint> &points,
+    int begin, int end, std::vector<bitset> &descriptors) const
+{
   assert(im.type() == CV_8UC1);
-  assert(im.isContinuous());
+  assert((int)descriptors.size() >= end);
   
   // use im now
   const int W = im.cols;
   const int H = im.rows;
-  
-  descriptors.resize(points.size());
-  std::vector<bitset>::iterator dit;
+  const int step = im.step;
+  const int L = m_x1.size();
+
+  // test pairs as offsets from the keypoint pixel
+  vector<int> off1(L), off2(L);
+  for(int i = 0; i < L; ++i)
+  {
+    off1[i] = m_y1[i] * step + m_x1[i];
+    off2[i] = m_y2[i] * step + m_x2[i];
+  }
 
-  std::vector<cv::KeyPoint>::const_iterator kit;
-  
   int x1, y1, x2, y2;
-  
-  dit = descriptors.begin();
-  for(kit = points.begin(); kit != points.end(); ++kit, ++dit)
+
+  for(int k = begin; k < end; ++k)
   {
-    dit->resize(m_bit_length);
-    dit->reset();
+    const cv::KeyPoint &kp = points[k];
+    bitset &desc = descriptors[k];
+    desc.reset();
 
-    for(unsigned int i = 0; i < m_x1.size(); ++i)
+    if(kp.pt.x >= m_max_offset && kp.pt.x + m_max_offset < W &&
+       kp.pt.y >= m_max_offset && kp.pt.y + m_max_offset < H)
     {
-      x1 = (int)(kit->pt.x + m_x1[i]);
-      y1 = (int)(kit->pt.y + m_y1[i]);
-      x2 = (int)(kit->pt.x + m_x2[i]);
-      y2 = (int)(kit->pt.y + m_y2[i]);
+      // the whole patch is inside the image
+      const unsigned char *center = im.ptr<unsigned char>((int)kp.pt.y) + 
+        (int)kp.pt.x;
+      for(int i = 0; i < L; ++i)
+      {
+        if(center[off1[i]] < center[off2[i]])
+        {
+          desc.set(i);
+        }
+      }
+      continue;
+    }
+
+    for(int i = 0; i < L; ++i)
+    {
+      x1 = (int)(kp.pt.x + m_x1[i]);
+      y1 = (int)(kp.pt.y + m_y1[i]);
+      x2 = (int)(kp.pt.x + m_x2[i]);
+      y2 = (int)(kp.pt.y + m_y2[i]);
       
       if(x1 >= 0 && x1 < W && y1 >= 0 && y1 < H 
         && x2 >= 0 && x2 < W && y2 >= 0 && y2 < H)
       {
         if( im.ptr<unsigned char>(y1)[x1] < im.ptr<unsigned char>(y2)[x2] )
         {
-          dit->set(i);
+          desc.set(i);
         }        
       } // if (x,y)_1 and (x,y)_2 are in the image
             
@@ -107,6 +223,87 @@ void BRIEF::compute(const cv::Mat &image,
 
 // ---------------------------------------------------------------------------
 
+static void distancesScalar(const BRIEF::bitset &a, const BRIEF::bitset *b,
+  int n, int *dist)
+{
+  for(int i = 0; i < n; ++i) dist[i] = BRIEF::distance(a, b[i]);
+}
+
+#ifdef BRIEF_DISTANCE_SIMD
+__attribute__((target("popcnt")))
+static void distancesPopcnt(const BRIEF::bitset &a, const BRIEF::bitset *b,
+  int n, int *dist)
+{
+  const uint64_t a0 = a.words[0], a1 = a.words[1];
+  const uint64_t a2 = a.words[2], a3 = a.words[3];
+  for(int i = 0; i < n; ++i)
+  {
+    const uint64_t *w = b[i].words;
+    dist[i] = _mm_popcnt_u64(a0 ^ w[0]) + _mm_popcnt_u64(a1 ^ w[1]) +
+      _mm_popcnt_u64(a2 ^ w[2]) + _mm_popcnt_u64(a3 ^ w[3]);
+  }
+}
+
+// bits set in each byte by nibble lookup, summed per 64 bit lane
+__attribute__((target("avx2")))
+static inline __m256i popcountLanes(__m256i v)
+{
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low = _mm256_set1_epi8(0x0f);
+  __m256i cnt = _mm256_add_epi8(
+    _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low)),
+    _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+  return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+// four descriptors per step: their lane sums (at most 64 each) are packed
+// into 16 bit fields so a single horizontal reduction yields all four
+__attribute__((target("avx2,popcnt")))
+static void distancesAvx2(const BRIEF::bitset &a, const BRIEF::bitset *b,
+  int n, int *dist)
+{
+  const __m256i va = _mm256_loadu_si256((const __m256i *)a.words);
+  int i = 0;
+  for(; i + 4 <= n; i += 4)
+  {
+    __m256i c0 = popcountLanes(_mm256_xor_si256(va, _mm256_loadu_si256((const __m256i *)b[i].words)));
+    __m256i c1 = popcountLanes(_mm256_xor_si256(va, _mm256_loadu_si256((const __m256i *)b[i + 1].words)));
+    __m256i c2 = popcountLanes(_mm256_xor_si256(va, _mm256_loadu_si256((const __m256i *)b[i + 2].words)));
+    __m256i c3 = popcountLanes(_mm256_xor_si256(va, _mm256_loadu_si256((const __m256i *)b[i + 3].words)));
+    __m256i c = _mm256_or_si256(
+      _mm256_or_si256(c0, _mm256_slli_epi64(c1, 16)),
+      _mm256_or_si256(_mm256_slli_epi64(c2, 32), _mm256_slli_epi64(c3, 48)));
+    __m128i s = _mm_add_epi16(_mm256_castsi256_si128(c), _mm256_extracti128_si256(c, 1));
+    s = _mm_add_epi16(s, _mm_unpackhi_epi64(s, s));
+    uint64_t packed = _mm_cvtsi128_si64(s);
+    dist[i] = packed & 0xffff;
+    dist[i + 1] = (packed >> 16) & 0xffff;
+    dist[i + 2] = (packed >> 32) & 0xffff;
+    dist[i + 3] = packed >> 48;
+  }
+  distancesPopcnt(a, b + i, n - i, dist + i);
+}
+#endif
+
+void BRIEF::distances(const bitset &a, const bitset *b, int n, int *dist)
+{
+#ifdef BRIEF_DISTANCE_SIMD
+  static const bool has_popcnt = __builtin_cpu_supports("popcnt");
+  static const bool has_avx2 = has_popcnt && __builtin_cpu_supports("avx2");
+  if(has_avx2)
+    distancesAvx2(a, b, n, dist);
+  else if(has_popcnt)
+    distancesPopcnt(a, b, n, dist);
+  else
+    distancesScalar(a, b, n, dist);
+#else
+  distancesScalar(a, b, n, dist);
+#endif
+}
+
+// ---------------------------------------------------------------------------
+
 void BRIEF::generateTestPoints()
 {  
   m_x1.resize(m_bit_length);
@@ -167,6 +364,19 @@ void BRIEF::generateTestPoints()
     m_y2[i] = y2;
   }
 
+  updateMaxOffset();
+}
+
+// ----------------------------------------------------------------------------
+
+void BRIEF::updateMaxOffset()
+{
+  m_max_offset = 0;
+  for(unsigned int i = 0; i < m_x1.size(); ++i)
+  {
+    m_max_offset = max(m_max_offset, max(abs(m_x1[i]), abs(m_y1[i])));
+    m_max_offset = max(m_max_offset, max(abs(m_x2[i]), abs(m_y2[i])));
+  }
 }
 
 // ----------------------------------------------------------------------------
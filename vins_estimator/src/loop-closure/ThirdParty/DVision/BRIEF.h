@@ -31,17 +31,97 @@
 
 #include <opencv2/opencv.hpp>
 #include <vector>
-#include <boost/dynamic_bitset.hpp>
+#include <string>
+#include <cassert>
+#include <stdint.h>
 
 namespace DVision {
 
+/// Fixed length BRIEF descriptor: 256 bits in four contiguous 64 bit words,
+/// bit i is bit (i % 64) of word i / 64 (the block layout of 
+/// boost::dynamic_bitset<>, which the vocabulary files were written from).
+/// Unlike a dynamic bitset it lives inline, without a heap allocation
+class BRIEFDescriptor
+{
+public:
+
+  static const int BITS = 256;
+  static const int WORDS = BITS / 64;
+
+  BRIEFDescriptor()
+  {
+    reset();
+  }
+
+  inline void reset()
+  {
+    words[0] = words[1] = words[2] = words[3] = 0;
+  }
+
+  inline void set(int i)
+  {
+    words[i >> 6] |= (uint64_t)1 << (i & 63);
+  }
+
+  inline bool test(int i) const
+  {
+    return (words[i >> 6] >> (i & 63)) & 1;
+  }
+
+  inline bool operator[](int i) const
+  {
+    return test(i);
+  }
+
+  /// Number of bits, always BITS
+  inline int size() const
+  {
+    return BITS;
+  }
+
+  /// Number of bits set
+  inline int count() const
+  {
+    return __builtin_popcountll(words[0]) + __builtin_popcountll(words[1]) +
+      __builtin_popcountll(words[2]) + __builtin_popcountll(words[3]);
+  }
+
+  inline BRIEFDescriptor operator^(const BRIEFDescriptor &b) const
+  {
+    BRIEFDescriptor r;
+    for(int k = 0; k < WORDS; ++k) r.words[k] = words[k] ^ b.words[k];
+    return r;
+  }
+
+  inline bool operator==(const BRIEFDescriptor &b) const
+  {
+    return words[0] == b.words[0] && words[1] == b.words[1] &&
+      words[2] == b.words[2] && words[3] == b.words[3];
+  }
+
+  inline bool operator!=(const BRIEFDescriptor &b) const
+  {
+    return !(*this == b);
+  }
+
+  /// Bits as a '0'/'1' string, most significant bit first, as
+  /// boost::to_string writes them
+  std::string toString() const;
+
+  /// Reads a string written by toString. A shorter string fills the low bits
+  /// @return false if the string holds no bits or more than BITS
+  bool fromString(const std::string &s);
+
+  uint64_t words[WORDS];
+};
+
 /// BRIEF descriptor
 class BRIEF
 {
 public:
 
   /// Bitset type
-  typedef boost::dynamic_bitset<> bitset;
+  typedef BRIEFDescriptor bitset;
 
   /// Type of pairs
   enum Type
@@ -54,7 +134,7 @@ public:
 
   /**
    * Creates the BRIEF a priori data for descriptors of nbits length
-   * @param nbits descriptor length in bits
+   * @param nbits descriptor length in bits, at most bitset::BITS
    * @param patch_size 
    * @param type type of pairs to generate
    */
@@ -118,6 +198,29 @@ public:
     const std::vector<cv::KeyPoint> &points,
     std::vector<bitset> &descriptors,
     bool treat_image = true) const;
+
+  /**
+   * Converts the image to grayscale if needed and smooths it, but only in
+   * the tiles that the patches of the given keypoints reach. Those pixels
+   * are the same as with the whole image smoothed, the rest is undefined
+   * @param image
+   * @param points
+   * @param im (out) smoothed image
+   */
+  void smooth(const cv::Mat &image, const std::vector<cv::KeyPoint> &points,
+    cv::Mat &im) const;
+
+  /**
+   * Computes the descriptors of points [begin, end) on a treated image.
+   * Disjoint ranges can be computed concurrently
+   * @param im grayscale smoothed image
+   * @param points
+   * @param begin
+   * @param end
+   * @param descriptors (in/out) already sized to points.size()
+   */
+  void compute(const cv::Mat &im, const std::vector<cv::KeyPoint> &points,
+    int begin, int end, std::vector<bitset> &descriptors) const;
   
   /**
    * Exports the test pattern
@@ -146,11 +249,13 @@ public:
     const std::vector<int> &y1, const std::vector<int> &x2, 
     const std::vector<int> &y2)
   {
+    assert((int)x1.size() <= bitset::BITS);
     m_x1 = x1;
     m_y1 = y1;
     m_x2 = x2;
     m_y2 = y2;
     m_bit_length = x1.size();
+    updateMaxOffset();
   }
   
   /**
@@ -161,9 +266,23 @@ public:
    */
   inline static int distance(const bitset &a, const bitset &b)
   {
-    return (a^b).count();
+    return __builtin_popcountll(a.words[0] ^ b.words[0]) +
+      __builtin_popcountll(a.words[1] ^ b.words[1]) +
+      __builtin_popcountll(a.words[2] ^ b.words[2]) +
+      __builtin_popcountll(a.words[3] ^ b.words[3]);
   }
 
+  /**
+   * Hamming distances from one descriptor to a contiguous array of them.
+   * Uses the avx2 or the popcnt instruction when the cpu has them, the
+   * inline distance above only gets them if the whole build targets them
+   * @param a descriptor
+   * @param b array of n descriptors
+   * @param n
+   * @param dist (out) n distances
+   */
+  static void distances(const bitset &a, const bitset *b, int n, int *dist);
+
 protected:
 
   /**
@@ -171,6 +290,11 @@ protected:
    * m_patch_size and m_bit_length
    */
   void generateTestPoints();
+
+  /**
+   * Updates m_max_offset from the test points
+   */
+  void updateMaxOffset();
   
 protected:
 
@@ -187,6 +311,10 @@ protected:
   std::vector<int> m_x1, m_x2;
   std::vector<int> m_y1, m_y2;
 
+  /// Largest absolute test point coordinate, keypoints at least this far
+  /// from the image border need no bounds checks
+  int m_max_offset;
+
 };
 
 } // namespace DVision
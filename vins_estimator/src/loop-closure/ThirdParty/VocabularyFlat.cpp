@@ -0,0 +1,171 @@
+//
+//  VocabularyFlat.cpp
+//
+//  Flat on-disk vocabulary that is mapped and used in place.
+//
+
+#include "VocabularyFlat.hpp"
+#include "VocabularyBinary.hpp"
+#include <cstring>
+#include <fstream>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace std;
+
+const char VINSLoop::FlatVocabulary::MAGIC[8] = {'V', 'I', 'N', 'S', 'V', 'O', 'C', 'F'};
+
+static uint64_t alignSection(uint64_t offset) {
+    return (offset + 63) & ~(uint64_t)63;
+}
+
+VINSLoop::FlatVocabulary::FlatVocabulary()
+: data_(nullptr), size_(0), header_(nullptr), nodes_(nullptr), descriptors_(nullptr), words_(nullptr) {
+}
+
+VINSLoop::FlatVocabulary::~FlatVocabulary() {
+    if (data_ != nullptr) {
+        munmap(data_, size_);
+        data_ = nullptr;
+    }
+}
+
+bool VINSLoop::FlatVocabulary::open(const string &filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    FlatHeader head;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FlatHeader) ||
+        pread(fd, &head, sizeof(head), 0) != (ssize_t)sizeof(head) ||
+        memcmp(head.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        ::close(fd);
+        return false;
+    }
+
+    if (head.version != VERSION) {
+        ::close(fd);
+        throw string("Unsupported flat vocabulary version in ") + filename;
+    }
+    if (head.fileSize != (uint64_t)st.st_size || head.nNodes == 0 ||
+        head.nodesOffset + sizeof(FlatNode) * (uint64_t)head.nNodes > head.fileSize ||
+        head.descriptorsOffset + 32 * (uint64_t)head.nNodes > head.fileSize ||
+        head.wordsOffset + sizeof(uint32_t) * (uint64_t)head.nWords > head.fileSize ||
+        head.nodesOffset % 64 || head.descriptorsOffset % 64 || head.wordsOffset % 64) {
+        ::close(fd);
+        throw string("Truncated or damaged flat vocabulary ") + filename;
+    }
+
+    void *data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        throw string("Could not map ") + filename;
+    attach(data, st.st_size);
+    return true;
+}
+
+void VINSLoop::FlatVocabulary::build(const Vocabulary &voc) {
+    vector<char> file;
+    pack(voc, file);
+    void *data = mmap(nullptr, file.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+        throw string("Could not allocate the flat vocabulary");
+    memcpy(data, file.data(), file.size());
+    attach(data, file.size());
+}
+
+void VINSLoop::FlatVocabulary::attach(void *data, size_t size) {
+    if (data_ != nullptr)
+        munmap(data_, size_);
+    data_ = data;
+    size_ = size;
+    char *base = (char *)data_;
+    header_ = (const FlatHeader *)base;
+    nodes_ = (FlatNode *)(base + header_->nodesOffset);
+    descriptors_ = (const uint64_t *)(base + header_->descriptorsOffset);
+    words_ = (const uint32_t *)(base + header_->wordsOffset);
+}
+
+void VINSLoop::FlatVocabulary::write(const Vocabulary &voc, const string &filename) {
+    vector<char> file;
+    pack(voc, file);
+    ofstream stream(filename, ios::binary);
+    stream.write(file.data(), file.size());
+    stream.close();
+    if (!stream)
+        throw string("Could not write ") + filename;
+}
+
+void VINSLoop::FlatVocabulary::pack(const Vocabulary &voc, vector<char> &file) {
+    // binary node ids are 1..nNodes, 0 is the root which has no entry
+    const uint32_t nNodes = voc.nNodes + 1;
+    vector<vector<int32_t> > children(nNodes);
+    vector<int32_t> entry(nNodes, -1);
+    for (int32_t i = 0; i < voc.nNodes; i++) {
+        const Node &node = voc.nodes[i];
+        if (node.nodeId <= 0 || (uint32_t)node.nodeId >= nNodes ||
+            node.parentId < 0 || (uint32_t)node.parentId >= nNodes)
+            throw string("Node id out of range in the binary vocabulary");
+        children[node.parentId].push_back(node.nodeId);
+        entry[node.nodeId] = i;
+    }
+
+    // breadth first numbering
+    vector<int32_t> order;
+    vector<int32_t> index(nNodes, -1);
+    order.reserve(nNodes);
+    order.push_back(0);
+    index[0] = 0;
+    for (size_t i = 0; i < order.size(); i++) {
+        for (int32_t c : children[order[i]]) {
+            index[c] = order.size();
+            order.push_back(c);
+        }
+    }
+    if (order.size() != nNodes)
+        throw string("The binary vocabulary is not a tree");
+
+    FlatHeader head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, MAGIC, sizeof(MAGIC));
+    head.version = VERSION;
+    head.k = voc.k;
+    head.L = voc.L;
+    head.scoringType = voc.scoringType;
+    head.weightingType = voc.weightingType;
+    head.nNodes = nNodes;
+    head.nWords = voc.nWords;
+    head.nodesOffset = alignSection(sizeof(FlatHeader));
+    head.descriptorsOffset = alignSection(head.nodesOffset + sizeof(FlatNode) * (uint64_t)nNodes);
+    head.wordsOffset = alignSection(head.descriptorsOffset + 32 * (uint64_t)nNodes);
+    head.fileSize = head.wordsOffset + sizeof(uint32_t) * (uint64_t)voc.nWords;
+
+    file.assign(head.fileSize, 0);
+    memcpy(file.data(), &head, sizeof(head));
+    FlatNode *nodes = (FlatNode *)(file.data() + head.nodesOffset);
+    uint64_t *descriptors = (uint64_t *)(file.data() + head.descriptorsOffset);
+    uint32_t *words = (uint32_t *)(file.data() + head.wordsOffset);
+
+    for (uint32_t n = 0; n < nNodes; n++) {
+        int32_t id = order[n];
+        FlatNode &node = nodes[n];
+        node.parent = n == 0 ? -1 : index[voc.nodes[entry[id]].parentId];
+        node.nChildren = children[id].size();
+        node.firstChild = node.nChildren ? index[children[id][0]] : 0;
+        node.wordId = -1;
+        node.weight = n == 0 ? 0 : voc.nodes[entry[id]].weight;
+        if (n != 0)
+            memcpy(descriptors + 4 * n, voc.nodes[entry[id]].descriptor, 32);
+    }
+    for (int32_t i = 0; i < voc.nWords; i++) {
+        const Word &word = voc.words[i];
+        if (word.wordId < 0 || word.wordId >= voc.nWords ||
+            word.nodeId <= 0 || (uint32_t)word.nodeId >= nNodes)
+            throw string("Word id out of range in the binary vocabulary");
+        words[word.wordId] = index[word.nodeId];
+        nodes[index[word.nodeId]].wordId = word.wordId;
+    }
+}
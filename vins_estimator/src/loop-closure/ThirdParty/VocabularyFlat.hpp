@@ -0,0 +1,96 @@
+//
+//  VocabularyFlat.hpp
+//
+//  Flat on-disk vocabulary that is mapped and used in place.
+//
+
+#ifndef VocabularyFlat_hpp
+#define VocabularyFlat_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace VINSLoop {
+
+struct Vocabulary;
+
+// File layout, native byte order (little endian on every supported target):
+//   FlatHeader
+//   FlatNode nodes[nNodes]             node 0 is the root, breadth first, so the
+//                                      children of a node are consecutive
+//   uint64_t descriptors[nNodes][4]    256 bit descriptor of each node
+//   uint32_t words[nWords]             node of each word
+// every section starts on a 64 byte boundary.
+struct FlatHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t k;
+    int32_t L;
+    int32_t scoringType;
+    int32_t weightingType;
+    uint32_t nNodes;
+    uint32_t nWords;
+    uint32_t reserved;
+    uint64_t nodesOffset;
+    uint64_t descriptorsOffset;
+    uint64_t wordsOffset;
+    uint64_t fileSize;
+};
+
+struct FlatNode {
+    int32_t parent;      // -1 for the root
+    int32_t firstChild;  // children are [firstChild, firstChild + nChildren)
+    int32_t nChildren;   // 0 for words
+    int32_t wordId;      // -1 for inner nodes
+    double weight;
+};
+
+static_assert(sizeof(FlatHeader) == 72, "FlatHeader layout");
+static_assert(sizeof(FlatNode) == 24, "FlatNode layout");
+
+class FlatVocabulary {
+public:
+    static const char MAGIC[8];
+    static const uint32_t VERSION = 1;
+
+    FlatVocabulary();
+    ~FlatVocabulary();
+
+    // Maps the file privately: pages are loaded on first use and writes (stopped
+    // words) stay in this process. Returns false if the file is not a flat
+    // vocabulary, throws std::string if it is one but damaged.
+    bool open(const std::string &filename);
+
+    // Lays a binary vocabulary out the same way in anonymous memory.
+    void build(const Vocabulary &voc);
+
+    inline const FlatHeader &header() const { return *header_; }
+    inline const FlatNode *nodes() const { return nodes_; }
+    inline FlatNode *nodes() { return nodes_; }
+    inline const uint64_t *descriptor(uint32_t node) const { return descriptors_ + 4 * (size_t)node; }
+    inline uint32_t wordNode(uint32_t word) const { return words_[word]; }
+
+    // Writes a binary vocabulary in the flat format, renumbering the nodes breadth
+    // first. Word ids and the order of the children are kept.
+    static void write(const Vocabulary &voc, const std::string &filename);
+
+private:
+    FlatVocabulary(const FlatVocabulary &);
+    FlatVocabulary &operator=(const FlatVocabulary &);
+
+    static void pack(const Vocabulary &voc, std::vector<char> &file);
+    void attach(void *data, size_t size);
+
+    void *data_;
+    size_t size_;
+    const FlatHeader *header_;
+    FlatNode *nodes_;
+    const uint64_t *descriptors_;
+    const uint32_t *words_;
+};
+
+}
+
+#endif /* VocabularyFlat_hpp */
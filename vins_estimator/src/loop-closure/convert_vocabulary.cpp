@@ -0,0 +1,49 @@
+// Converts a binary vocabulary (e.g. support_files/brief_k10L6.bin) into the flat
+// format that the loop closure maps in place instead of reading it node by node.
+//   rosrun vins_estimator convert_vocabulary brief_k10L6.bin brief_k10L6.flat
+// The build runs it for support_files/brief_k10L6.bin, which the configs then load.
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include "ThirdParty/VocabularyBinary.hpp"
+#include "ThirdParty/VocabularyFlat.hpp"
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <binary vocabulary> <flat vocabulary>\n", argv[0]);
+        return 1;
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in)
+    {
+        fprintf(stderr, "could not open %s\n", argv[1]);
+        return 1;
+    }
+    VINSLoop::Vocabulary voc;
+    voc.deserialize(in);
+    if (!in || voc.nNodes <= 0 || voc.nWords <= 0)
+    {
+        fprintf(stderr, "%s is not a binary vocabulary\n", argv[1]);
+        return 1;
+    }
+
+    try
+    {
+        VINSLoop::FlatVocabulary::write(voc, argv[2]);
+        VINSLoop::FlatVocabulary flat;
+        if (!flat.open(argv[2]))
+            throw std::string("the written file is not a flat vocabulary");
+        printf("k %d L %d, %u nodes, %u words written to %s\n", flat.header().k, flat.header().L,
+               flat.header().nNodes, flat.header().nWords, argv[2]);
+    }
+    catch (const std::string &ex)
+    {
+        fprintf(stderr, "%s\n", ex.c_str());
+        return 1;
+    }
+    return 0;
+}
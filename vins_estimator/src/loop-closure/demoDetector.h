@@ -82,14 +82,27 @@ public:
   /**
    * Runs the demo
    * @param name demo name
-   * @param extractor functor to extract features
+   * @param features keypoints and descriptors, kept by the detector
+   * @param old_indices (out) loop candidates, the best first
    */
   bool run(const std::string &name,
-           const std::vector<cv::KeyPoint> &keys, 
-           const std::vector<TDescriptor> &descriptors,
+           const typename TDetector::FeaturesPtr &features,
            std::vector<cv::Point2f> &cur_pts,
            std::vector<cv::Point2f> &old_pts,
-           int &old_index);
+           std::vector<int> &old_indices);
+
+  /**
+   * Runs the demo with the vectors of the image already computed
+   * @param bowvec bow vector from detector.transform
+   * @param featvec direct index from detector.transform
+   */
+  bool run(const std::string &name,
+           const typename TDetector::FeaturesPtr &features,
+           const DBoW2::BowVector &bowvec,
+           const DBoW2::FeatureVector &featvec,
+           std::vector<cv::Point2f> &cur_pts,
+           std::vector<cv::Point2f> &old_pts,
+           std::vector<int> &old_indices);
 
   void eraseIndex(std::vector<int> &erase_index);
   /*Data*/
@@ -156,24 +169,43 @@ void demoDetector<TVocabulary, TDetector, TDescriptor>::eraseIndex
 
 template<class TVocabulary, class TDetector, class TDescriptor>
 bool demoDetector<TVocabulary, TDetector, TDescriptor>::run
-  (const std::string &name, const std::vector<cv::KeyPoint> &keys, 
-   const std::vector<TDescriptor> &descriptors,
+  (const std::string &name,
+   const typename TDetector::FeaturesPtr &features,
+   std::vector<cv::Point2f> &cur_pts,
+   std::vector<cv::Point2f> &old_pts,
+   std::vector<int> &old_indices)
+{  
+  DBoW2::BowVector bowvec;
+  DBoW2::FeatureVector featvec;
+  detector.transform(features->descriptors, bowvec, featvec);
+  return run(name, features, bowvec, featvec, cur_pts, old_pts,
+    old_indices);
+}
+
+// ---------------------------------------------------------------------------
+
+template<class TVocabulary, class TDetector, class TDescriptor>
+bool demoDetector<TVocabulary, TDetector, TDescriptor>::run
+  (const std::string &name,
+   const typename TDetector::FeaturesPtr &features,
+   const DBoW2::BowVector &bowvec,
+   const DBoW2::FeatureVector &featvec,
    std::vector<cv::Point2f> &cur_pts,
    std::vector<cv::Point2f> &old_pts,
-   int &old_index)
+   std::vector<int> &old_indices)
 {  
   int count = 0;
 
   DetectionResult result;
 
-  detector.detectLoop(keys, descriptors, result, cur_pts, old_pts); 
+  detector.detectLoop(features, bowvec, featvec, result, cur_pts, old_pts); 
     
   if(result.detection())
   {
       //cout << "- loop found with image " << result.match << "!"
       //  << endl;
       ++count;
-      old_index = result.match;
+      old_indices.assign(result.candidates.begin(), result.candidates.end());
       return true;
   }
   else
@@ -13,6 +13,7 @@ KeyFrame::KeyFrame(double _header, Eigen::Vector3d _vio_T_w_i, Eigen::Matrix3d _
     is_looped = 0;
     has_loop = 0;
     update_loop_info = 0;
+    grid_cols = grid_rows = 0;
     vio_T_w_i = _vio_T_w_i;
     vio_R_w_i = _vio_R_w_i;
 }
@@ -38,13 +39,47 @@ static void reduceVector(vector<Derived> &v, vector<uchar> status)
 
 void KeyFrame::extractBrief(cv::Mat &image)
 {
-    BriefExtractor extractor(BRIEF_PATTERN_FILE);
+    const BriefExtractor &extractor = BriefExtractor::instance(BRIEF_PATTERN_FILE);
+    vector<cv::KeyPoint> keypoints;
+    vector<BRIEF::bitset> descriptors;
     extractor(image, measurements, keypoints, descriptors);
+    std::shared_ptr<BriefFeatures> new_features = std::make_shared<BriefFeatures>();
+    buildGrid(keypoints, descriptors, *new_features);
+    features = new_features;
+}
+
+// the window features are the last ones of the extractor
+void KeyFrame::buildGrid(const vector<cv::KeyPoint> &keypoints, const vector<BRIEF::bitset> &descriptors,
+                         BriefFeatures &sorted)
+{
+    grid_cols = (COL + GRID_CELL - 1) / GRID_CELL;
+    grid_rows = (ROW + GRID_CELL - 1) / GRID_CELL;
+    grid_start.assign(grid_cols * grid_rows + 1, 0);
+
+    vector<int> cell(keypoints.size());
+    for (int i = 0; i < (int)keypoints.size(); i++)
+    {
+        int c = std::min(std::max((int)(keypoints[i].pt.x / GRID_CELL), 0), grid_cols - 1);
+        int r = std::min(std::max((int)(keypoints[i].pt.y / GRID_CELL), 0), grid_rows - 1);
+        cell[i] = r * grid_cols + c;
+        grid_start[cell[i] + 1]++;
+    }
+    for (int c = 0; c < grid_cols * grid_rows; c++)
+        grid_start[c + 1] += grid_start[c];
+
+    // counting sort, stable within a cell
+    vector<int> pos(grid_start.begin(), grid_start.end() - 1);
     int start = keypoints.size() - measurements.size();
-    for(int i = 0; i< (int)measurements.size(); i++)
+    sorted.points.resize(keypoints.size());
+    sorted.descriptors.resize(descriptors.size());
+    sorted.window.resize(measurements.size());
+    for (int i = 0; i < (int)keypoints.size(); i++)
     {
-        window_keypoints.push_back(keypoints[start + i]);
-        window_descriptors.push_back(descriptors[start + i]);
+        int j = pos[cell[i]]++;
+        sorted.points[j] = keypoints[i].pt;
+        sorted.descriptors[j] = descriptors[i];
+        if (i >= start)
+            sorted.window[i - start] = j;
     }
 }
 void KeyFrame::setExtrinsic(Eigen::Vector3d T, Eigen::Matrix3d R)
@@ -90,49 +125,103 @@ bool KeyFrame::inAera(cv::Point2f pt, cv::Point2f center, float area_size)
 }
 
 bool KeyFrame::searchInAera(cv::Point2f center_cur, float area_size,
-                            const BRIEF::bitset window_descriptor,
-                            const std::vector<BRIEF::bitset> &descriptors_old,
-                            const std::vector<cv::KeyPoint> &keypoints_old,
+                            const BRIEF::bitset &window_descriptor,
+                            const KeyFrame *old_kf,
                             cv::Point2f &best_match)
 {
-    cv::Point2f best_pt;
+    const std::vector<BRIEF::bitset> &descriptors_old = old_kf->features->descriptors;
+    const std::vector<cv::Point2f> &points_old = old_kf->features->points;
     int bestDist = 128;
     int bestIndex = -1;
-    for(int i = 0; i < (int)descriptors_old.size(); i++)
+
+    // only the cells overlapping the area, a row of them is one contiguous range
+    int c0 = std::max((int)floor((center_cur.x - area_size) / GRID_CELL), 0);
+    int c1 = std::min((int)floor((center_cur.x + area_size) / GRID_CELL), old_kf->grid_cols - 1);
+    int r0 = std::max((int)floor((center_cur.y - area_size) / GRID_CELL), 0);
+    int r1 = std::min((int)floor((center_cur.y + area_size) / GRID_CELL), old_kf->grid_rows - 1);
+    std::vector<int> dist;
+    for (int r = r0; r <= r1 && c0 <= c1; r++)
     {
-        if(!inAera(keypoints_old[i].pt, center_cur, area_size))
+        int begin = old_kf->grid_start[r * old_kf->grid_cols + c0];
+        int end = old_kf->grid_start[r * old_kf->grid_cols + c1 + 1];
+        if (begin == end)
             continue;
-
-        int dis = HammingDis(window_descriptor, descriptors_old[i]);
-        if(dis < bestDist)
+        dist.resize(end - begin);
+        BRIEF::distances(window_descriptor, &descriptors_old[begin], end - begin, dist.data());
+        for (int i = begin; i < end; i++)
         {
-            bestDist = dis;
-            bestIndex = i;
+            if (dist[i - begin] < bestDist && inAera(points_old[i], center_cur, area_size))
+            {
+                bestDist = dist[i - begin];
+                bestIndex = i;
+            }
         }
     }
     if (bestIndex != -1)
     {
-      best_match = keypoints_old[bestIndex].pt;
+      best_match = points_old[bestIndex];
       return true;
     }
     else
       return false;
 }
 
-void KeyFrame::FundmantalMatrixRANSAC(vector<cv::Point2f> &measurements_old,
-                                      vector<cv::Point2f> &measurements_old_norm,
-                                      const camodocal::CameraPtr &m_camera)
+// only the old keypoints under the same vocabulary node, wherever they are in the image
+bool KeyFrame::searchInNode(DBoW2::NodeId node, const BRIEF::bitset &window_descriptor,
+                            const KeyFrame *old_kf,
+                            cv::Point2f &best_match)
 {
+    DBoW2::FeatureVector::const_iterator it = old_kf->featvec.find(node);
+    if (it == old_kf->featvec.end())
+        return false;
+    int bestDist = 128;
+    int bestIndex = -1;
+    for (unsigned int i : it->second)
+    {
+        int dis = BRIEF::distance(window_descriptor, old_kf->features->descriptors[i]);
+        if (dis < bestDist)
+        {
+            bestDist = dis;
+            bestIndex = i;
+        }
+    }
+    if (bestIndex == -1)
+        return false;
+    best_match = old_kf->features->points[bestIndex];
+    return true;
+}
+
+void KeyFrame::buildFeatureNodes(const BriefVocabulary &voc, int levelsup)
+{
+    DBoW2::BowVector bowvec;
+    featvec.clear();
+    voc.transform(features->descriptors, bowvec, featvec, levelsup);
+
+    // the window features are among them. Features on words without weight
+    // are left out, they match nothing
+    vector<DBoW2::NodeId> nodes(features->descriptors.size(), (DBoW2::NodeId)-1);
+    for (const auto &it : featvec)
+        for (unsigned int i : it.second)
+            nodes[i] = it.first;
+    window_nodes.resize(features->window.size());
+    for (int i = 0; i < (int)features->window.size(); i++)
+        window_nodes[i] = nodes[features->window[i]];
+}
+
+void KeyFrame::FundmantalMatrixRANSAC(LoopMatch &match, const camodocal::CameraPtr &m_camera)
+{
+    vector<cv::Point2f> &measurements_old = match.measurements_old;
+    vector<cv::Point2f> &measurements_old_norm = match.measurements_old_norm;
     if (measurements_old.size() >= 8)
     {
         measurements_old_norm.clear();
 
-        vector<cv::Point2f> un_measurements(measurements_matched.size()), un_measurements_old(measurements_old.size());
-        for (int i = 0; i < (int)measurements_matched.size(); i++)
+        vector<cv::Point2f> un_measurements(match.measurements_matched.size()), un_measurements_old(measurements_old.size());
+        for (int i = 0; i < (int)match.measurements_matched.size(); i++)
         {
             double FOCAL_LENGTH = 460.0;
             Eigen::Vector3d tmp_p;
-            m_camera->liftProjective(Eigen::Vector2d(measurements_matched[i].x, measurements_matched[i].y), tmp_p);
+            m_camera->liftProjective(Eigen::Vector2d(match.measurements_matched[i].x, match.measurements_matched[i].y), tmp_p);
             tmp_p.x() = FOCAL_LENGTH * tmp_p.x() / tmp_p.z() + COL / 2.0;
             tmp_p.y() = FOCAL_LENGTH * tmp_p.y() / tmp_p.z() + ROW / 2.0;
             un_measurements[i] = cv::Point2f(tmp_p.x(), tmp_p.y());
@@ -148,42 +237,42 @@ void KeyFrame::FundmantalMatrixRANSAC(vector<cv::Point2f> &measurements_old,
         cv::findFundamentalMat(un_measurements, un_measurements_old, cv::FM_RANSAC, 5.0, 0.99, status);
         reduceVector(measurements_old, status);
         reduceVector(measurements_old_norm, status);
-        reduceVector(measurements_matched, status);
-        reduceVector(features_id_matched, status);
-        reduceVector(point_clouds_matched, status);
+        reduceVector(match.measurements_matched, status);
+        reduceVector(match.features_id_matched, status);
+        reduceVector(match.point_clouds_matched, status);
         
     }
 }
 
-void KeyFrame::searchByDes(std::vector<cv::Point2f> &measurements_old, 
-                           std::vector<cv::Point2f> &measurements_old_norm,
-                           const std::vector<BRIEF::bitset> &descriptors_old,
-                           const std::vector<cv::KeyPoint> &keypoints_old,
-                           const camodocal::CameraPtr &m_camera)
+void KeyFrame::searchByDes(LoopMatch &match, const camodocal::CameraPtr &m_camera)
 {
-    //ROS_INFO("loop_match before cur %d %d, old %d", (int)window_descriptors.size(), (int)measurements.size(), (int)descriptors_old.size());
+    //ROS_INFO("loop_match before cur %d %d, old %d", (int)features->window.size(), (int)measurements.size(), (int)match.old_kf->features->descriptors.size());
     std::vector<uchar> status;
-    for(int i = 0; i < (int)window_descriptors.size(); i++)
+    for(int i = 0; i < (int)features->window.size(); i++)
     {
+        const BRIEF::bitset &window_descriptor = features->descriptors[features->window[i]];
         cv::Point2f pt(0.f, 0.f);
-        if (searchInAera(measurements[i], 200, window_descriptors[i], descriptors_old, keypoints_old, pt))
+        bool found;
+        if (LOOP_MATCH_MODE == 1 && !window_nodes.empty())
+            found = searchInNode(window_nodes[i], window_descriptor, match.old_kf, pt);
+        else
+            found = searchInAera(measurements[i], 200, window_descriptor, match.old_kf, pt);
+        if (found)
           status.push_back(1);
         else
           status.push_back(0);
-        measurements_old.push_back(pt);
+        match.measurements_old.push_back(pt);
     }
-    measurements_matched = measurements;
-    features_id_matched = features_id;
-    point_clouds_matched = point_clouds;
-    reduceVector(measurements_old, status);
-    reduceVector(measurements_matched, status);
-    reduceVector(features_id_matched, status);
-    reduceVector(point_clouds_matched, status);
+    match.measurements_matched = measurements;
+    match.features_id_matched = features_id;
+    match.point_clouds_matched = point_clouds;
+    reduceVector(match.measurements_old, status);
+    reduceVector(match.measurements_matched, status);
+    reduceVector(match.features_id_matched, status);
+    reduceVector(match.point_clouds_matched, status);
 }
 
-void KeyFrame::PnPRANSAC(vector<cv::Point2f> &measurements_old,
-                         std::vector<cv::Point2f> &measurements_old_norm, 
-                         Eigen::Vector3d &PnP_T_old, Eigen::Matrix3d &PnP_R_old)
+void KeyFrame::PnPRANSAC(LoopMatch &match)
 {
     cv::Mat r, rvec, t, D, tmp_r;
     cv::Mat K = (cv::Mat_<double>(3, 3) << 1.0, 0, 0, 0, 1.0, 0, 0, 0, 1.0);
@@ -200,19 +289,19 @@ void KeyFrame::PnPRANSAC(vector<cv::Point2f> &measurements_old,
     cv::eigen2cv(P_inital, t);
 
     vector<cv::Point3f> pts_3_vector;
-    for(auto &it: point_clouds_matched)
+    for(auto &it: match.point_clouds_matched)
         pts_3_vector.push_back(cv::Point3f((float)it.x(),(float)it.y(),(float)it.z()));
 
     cv::Mat inliers;
     TicToc t_pnp_ransac;
     if(CV_MAJOR_VERSION < 3)
-        solvePnPRansac(pts_3_vector, measurements_old_norm, K, D, rvec, t, true, 100, 10.0 / 460.0, 100, inliers);
+        solvePnPRansac(pts_3_vector, match.measurements_old_norm, K, D, rvec, t, true, 100, 10.0 / 460.0, 100, inliers);
     else
-        solvePnPRansac(pts_3_vector, measurements_old_norm, K, D, rvec, t, true, 100, 10.0 / 460.0, 0.99, inliers);
+        solvePnPRansac(pts_3_vector, match.measurements_old_norm, K, D, rvec, t, true, 100, 10.0 / 460.0, 0.99, inliers);
     ROS_DEBUG("t_pnp_ransac %f ms", t_pnp_ransac.toc());
 
     std::vector<uchar> status;
-    for (int i = 0; i < (int)measurements_old_norm.size(); i++)
+    for (int i = 0; i < (int)match.measurements_old_norm.size(); i++)
         status.push_back(0);
 
     for( int i = 0; i < inliers.rows; i++)
@@ -229,32 +318,48 @@ void KeyFrame::PnPRANSAC(vector<cv::Point2f> &measurements_old,
     cv::cv2eigen(t, T_pnp);
     T_w_c_old = R_w_c_old * (-T_pnp);
 
-    PnP_R_old = R_w_c_old * qic.transpose();
-    PnP_T_old = T_w_c_old - PnP_R_old * tic;   
+    match.PnP_R_old = R_w_c_old * qic.transpose();
+    match.PnP_T_old = T_w_c_old - match.PnP_R_old * tic;   
 
-    reduceVector(measurements_old, status);
-    reduceVector(measurements_old_norm, status);
-    reduceVector(measurements_matched, status);
-    reduceVector(features_id_matched, status);
-    reduceVector(point_clouds_matched, status);
+    reduceVector(match.measurements_old, status);
+    reduceVector(match.measurements_old_norm, status);
+    reduceVector(match.measurements_matched, status);
+    reduceVector(match.features_id_matched, status);
+    reduceVector(match.point_clouds_matched, status);
 
 
 }
 
-bool KeyFrame::findConnectionWithOldFrame(const KeyFrame* old_kf,
-                                          std::vector<cv::Point2f> &measurements_old, std::vector<cv::Point2f> &measurements_old_norm,
-                                          Eigen::Vector3d &PnP_T_old, Eigen::Matrix3d &PnP_R_old,
-                                          const camodocal::CameraPtr &m_camera)
+bool KeyFrame::findConnectionWithOldFrame(LoopMatch &match, const camodocal::CameraPtr &m_camera,
+                                          const std::function<bool()> &cancelled)
 {
     TicToc t_match;
-    searchByDes(measurements_old, measurements_old_norm, old_kf->descriptors, old_kf->keypoints, m_camera);
-    FundmantalMatrixRANSAC(measurements_old, measurements_old_norm, m_camera);
-    if ((int)measurements_old_norm.size() > MIN_LOOP_NUM)
+    searchByDes(match, m_camera);
+    if (cancelled && cancelled())
+        return false;
+    FundmantalMatrixRANSAC(match, m_camera);
+    if ((int)match.measurements_old_norm.size() <= MIN_LOOP_NUM || (cancelled && cancelled()))
+        return false;
+    PnPRANSAC(match);
+    ROS_DEBUG("loop final use num %d %lf---------------", (int)match.measurements_old.size(), t_match.toc());
+    return (int)match.measurements_old_norm.size() > MIN_LOOP_NUM;
+}
+
+int KeyFrame::findConnectionWithOldFrames(std::vector<LoopMatch> &matches, const camodocal::CameraPtr &m_camera)
+{
+    // index of the best ranked candidate found connected so far
+    const int num = matches.size();
+    std::atomic<int> winner(num);
+    loopClosureWorkerPool().parallelFor(num, [&](int i)
     {
-        PnPRANSAC(measurements_old, measurements_old_norm, PnP_T_old, PnP_R_old);
-    }
-    ROS_DEBUG("loop final use num %d %lf---------------", (int)measurements_old.size(), t_match.toc());
-    return true;
+        std::function<bool()> cancelled = [&winner, i]() { return winner.load() < i; };
+        if (cancelled() || !findConnectionWithOldFrame(matches[i], m_camera, cancelled))
+            return;
+        int cur = winner.load();
+        while (i < cur && !winner.compare_exchange_weak(cur, i))
+            ;
+    });
+    return winner.load() < num ? winner.load() : -1;
 }
 
 void KeyFrame::updatePose(const Eigen::Vector3d &_T_w_i, const Eigen::Matrix3d &_R_w_i)
@@ -325,9 +430,7 @@ void KeyFrame::removeLoop()
 
 int KeyFrame::HammingDis(const BRIEF::bitset &a, const BRIEF::bitset &b)
 {
-    BRIEF::bitset xor_of_bitset = a ^ b;
-    int dis = xor_of_bitset.count();
-    return dis;
+    return BRIEF::distance(a, b);
 }
 
 BriefExtractor::BriefExtractor(const std::string &pattern_file)
@@ -350,6 +453,12 @@ BriefExtractor::BriefExtractor(const std::string &pattern_file)
   m_brief.importPairs(x1, y1, x2, y2);
 }
 
+const BriefExtractor &BriefExtractor::instance(const std::string &pattern_file)
+{
+  static BriefExtractor extractor(pattern_file);
+  return extractor;
+}
+
 void BriefExtractor::operator() (const cv::Mat &im, const std::vector<cv::Point2f> window_pts,
                                  vector<cv::KeyPoint> &keys, vector<BRIEF::bitset> &descriptors) const
 {
@@ -362,6 +471,14 @@ void BriefExtractor::operator() (const cv::Mat &im, const std::vector<cv::Point2
       key.pt = window_pts[i];
       keys.push_back(key);
   }
-  // compute their BRIEF descriptor
-  m_brief.compute(im, keys, descriptors);
+  // compute their BRIEF descriptor, smoothing only around the keypoints
+  cv::Mat im_smooth;
+  m_brief.smooth(im, keys, im_smooth);
+  descriptors.resize(keys.size());
+  const int CHUNK = 64;
+  int num_chunks = (keys.size() + CHUNK - 1) / CHUNK;
+  loopClosureWorkerPool().parallelFor(num_chunks, [&](int id)
+  {
+    m_brief.compute(im_smooth, keys, id * CHUNK, std::min((id + 1) * CHUNK, (int)keys.size()), descriptors);
+  });
 }
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <opencv2/core/eigen.hpp>
 #include <opencv2/opencv.hpp>
 #include "../utility/utility.h"
+#include "../utility/worker_pool.h"
 #include <algorithm>
 #include "math.h"
 #include "../estimator.h"
@@ -14,6 +15,9 @@
 #include "camodocal/camera_models/CataCamera.h"
 #include "camodocal/camera_models/PinholeCamera.h"
 #include <mutex>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include "loop_closure.h"
 
 using namespace Eigen;
@@ -26,18 +30,38 @@ public:
     vector<cv::KeyPoint> &keys, vector<BRIEF::bitset> &descriptors) const;
   BriefExtractor(const std::string &pattern_file);
 
+  // process-wide extractor, the pattern file is read on the first call only
+  static const BriefExtractor &instance(const std::string &pattern_file);
+
 private:
   DVision::BRIEF m_brief;
 };
 
+class KeyFrame;
+
+// Correspondences of a keyframe with an older one. They are kept out of the keyframe
+// so that several old keyframes can be checked against it at the same time.
+struct LoopMatch
+{
+	const KeyFrame *old_kf;
+	//old keyframe, in image plane and normalized
+	std::vector<cv::Point2f> measurements_old, measurements_old_norm;
+	//matched window features of the keyframe
+	std::vector<cv::Point2f> measurements_matched;
+	std::vector<int> features_id_matched;
+	std::vector<Eigen::Vector3d> point_clouds_matched;
+	//pose of the old keyframe from PnP
+	Eigen::Vector3d PnP_T_old;
+	Eigen::Matrix3d PnP_R_old;
+};
+
 class KeyFrame
 {
 public:
 	KeyFrame(double _header, Eigen::Vector3d _vio_T_w_c, Eigen::Matrix3d _vio_R_w_c, 
 				Eigen::Vector3d _cur_T_w_c, Eigen::Matrix3d _cur_R_w_c,cv::Mat &_image, const char *_brief_pattern_file);
 	void setExtrinsic(Eigen::Vector3d T, Eigen::Matrix3d R);	
-	void FundmantalMatrixRANSAC(vector<cv::Point2f> &measurements_old, vector<cv::Point2f> &measurements_old_norm,
-                 	 const camodocal::CameraPtr &m_camera);
+	void FundmantalMatrixRANSAC(LoopMatch &match, const camodocal::CameraPtr &m_camera);
 
 	void extractBrief(cv::Mat &image);
 	
@@ -46,25 +70,28 @@ public:
 	bool inAera(cv::Point2f pt, cv::Point2f center, float area_size);
 
 	bool searchInAera(cv::Point2f center_cur, float area_size,
-                      const BRIEF::bitset window_descriptor,
-                      const std::vector<BRIEF::bitset> &descriptors_old,
-                      const std::vector<cv::KeyPoint> &keypoints_old,
+                      const BRIEF::bitset &window_descriptor,
+                      const KeyFrame *old_kf,
                       cv::Point2f &best_match);
 
-	void searchByDes(std::vector<cv::Point2f> &measurements_old,
-					 std::vector<cv::Point2f> &measurements_old_norm,
-                     const std::vector<BRIEF::bitset> &descriptors_old,
-                     const std::vector<cv::KeyPoint> &keypoints_old,
-                     const camodocal::CameraPtr &m_camera);
+	bool searchInNode(DBoW2::NodeId node, const BRIEF::bitset &window_descriptor,
+                      const KeyFrame *old_kf,
+                      cv::Point2f &best_match);
+
+	void buildFeatureNodes(const BriefVocabulary &voc, int levelsup);
+
+	void searchByDes(LoopMatch &match, const camodocal::CameraPtr &m_camera);
 
-	bool findConnectionWithOldFrame(const KeyFrame* old_kf,
-	                                std::vector<cv::Point2f> &measurements_old, std::vector<cv::Point2f> &measurements_old_norm,
-	                                Eigen::Vector3d &PnP_T_old, Eigen::Matrix3d &PnP_R_old,
-	                                const camodocal::CameraPtr &m_camera);
+	// true if more than MIN_LOOP_NUM matches with match.old_kf pass both RANSACs,
+	// cancelled() is polled between the stages. Only reads this keyframe.
+	bool findConnectionWithOldFrame(LoopMatch &match, const camodocal::CameraPtr &m_camera,
+	                                const std::function<bool()> &cancelled = std::function<bool()>());
 
-	void PnPRANSAC(vector<cv::Point2f> &measurements_old,
-	               std::vector<cv::Point2f> &measurements_old_norm, 
-	               Eigen::Vector3d &PnP_T_old, Eigen::Matrix3d &PnP_R_old);
+	// checks the candidates concurrently, the first one (best ranked) that is connected
+	// wins and the ones after it are cancelled. Returns its index or -1.
+	int findConnectionWithOldFrames(std::vector<LoopMatch> &matches, const camodocal::CameraPtr &m_camera);
+
+	void PnPRANSAC(LoopMatch &match);
 
 	void updatePose(const Eigen::Vector3d &_T_w_i, const Eigen::Matrix3d &_R_w_i);
 
@@ -92,17 +119,21 @@ public:
 
 	// data 
 	double header;
-	std::vector<Eigen::Vector3d> point_clouds, point_clouds_matched;
+	std::vector<Eigen::Vector3d> point_clouds;
 	//feature in origin image plane
-	std::vector<cv::Point2f> measurements, measurements_matched;
+	std::vector<cv::Point2f> measurements;
 	//feature in normalize image plane
 	std::vector<cv::Point2f> pts_normalize;
 	//feature ID
-	std::vector<int> features_id, features_id_matched;
-	//feature descriptor
-	std::vector<BRIEF::bitset> descriptors;
-	//keypoints
-	std::vector<cv::KeyPoint> keypoints;
+	std::vector<int> features_id;
+	//keypoints and descriptors, shared with the loop detector. They are sorted
+	//by grid cell (row major), the ones in cell c are [grid_start[c], grid_start[c + 1])
+	LoopClosure::FeaturesPtr features;
+	static const int GRID_CELL = 32;
+	int grid_cols, grid_rows;
+	std::vector<int> grid_start;
+	//direct index, vocabulary node -> indices of the keypoints below it
+	DBoW2::FeatureVector featvec;
 
 	int global_index;
 	cv::Mat image;
@@ -131,10 +162,13 @@ private:
 	Eigen::Matrix3d vio_R_w_i;
 	std::mutex mMutexPose;
 	std::mutex mLoopInfo;
-	std::vector<cv::KeyPoint> window_keypoints;
-	std::vector<BRIEF::bitset> window_descriptors;
+	//vocabulary node of each window feature, with LOOP_MATCH_MODE 1
+	std::vector<DBoW2::NodeId> window_nodes;
 	Eigen::Matrix<double, 8, 1 > loop_info;
 
+	void buildGrid(const vector<cv::KeyPoint> &keypoints, const vector<BRIEF::bitset> &descriptors,
+	               BriefFeatures &sorted);
+
 };
 
 #endif
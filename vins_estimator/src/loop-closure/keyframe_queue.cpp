@@ -0,0 +1,73 @@
+#include "keyframe_queue.h"
+#include "keyframe.h"
+#include <algorithm>
+
+KeyFrameQueue::KeyFrameQueue(int _capacity)
+    : capacity{_capacity}, pushed_cnt{0}, dropped_cnt{0}, peak_depth{0}
+{
+}
+
+KeyFrameQueue::~KeyFrameQueue()
+{
+    for (KeyFrame *keyframe : buf)
+        delete keyframe;
+}
+
+void KeyFrameQueue::setCapacity(int _capacity)
+{
+    std::lock_guard<std::mutex> lk(m_buf);
+    capacity = _capacity;
+}
+
+void KeyFrameQueue::push(KeyFrame *keyframe)
+{
+    {
+        std::lock_guard<std::mutex> lk(m_buf);
+        while (capacity > 0 && (int)buf.size() >= capacity)
+        {
+            delete buf.front();
+            buf.pop_front();
+            dropped_cnt++;
+        }
+        buf.push_back(keyframe);
+        pushed_cnt++;
+        if ((int)buf.size() > peak_depth)
+            peak_depth = buf.size();
+    }
+    con.notify_one();
+}
+
+int KeyFrameQueue::popBatch(std::vector<KeyFrame *> &batch, int max_batch)
+{
+    std::unique_lock<std::mutex> lk(m_buf);
+    con.wait(lk, [&]
+             { return !buf.empty(); });
+    int num = std::min<int>(buf.size(), std::max(max_batch, 1));
+    batch.assign(buf.begin(), buf.begin() + num);
+    buf.erase(buf.begin(), buf.begin() + num);
+    return num;
+}
+
+int KeyFrameQueue::depth() const
+{
+    std::lock_guard<std::mutex> lk(m_buf);
+    return buf.size();
+}
+
+unsigned long KeyFrameQueue::pushed() const
+{
+    std::lock_guard<std::mutex> lk(m_buf);
+    return pushed_cnt;
+}
+
+unsigned long KeyFrameQueue::dropped() const
+{
+    std::lock_guard<std::mutex> lk(m_buf);
+    return dropped_cnt;
+}
+
+int KeyFrameQueue::peak() const
+{
+    std::lock_guard<std::mutex> lk(m_buf);
+    return peak_depth;
+}
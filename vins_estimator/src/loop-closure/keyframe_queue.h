@@ -0,0 +1,40 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+class KeyFrame;
+
+// Keyframes handed from the pose graph producer to the loop detection thread. The queue owns
+// what it holds. When it is full the oldest pending keyframe is deleted and counted as
+// dropped, the producer never waits for the detector. The counters can be read from any thread.
+class KeyFrameQueue
+{
+  public:
+    // capacity <= 0 does not bound the queue
+    explicit KeyFrameQueue(int _capacity = 0);
+    ~KeyFrameQueue();
+
+    void setCapacity(int _capacity);
+
+    void push(KeyFrame *keyframe);
+    // waits for at least one keyframe and moves up to max_batch of the oldest into batch
+    int popBatch(std::vector<KeyFrame *> &batch, int max_batch);
+
+    int depth() const;
+    unsigned long pushed() const;
+    unsigned long dropped() const;
+    // largest number of keyframes pending at once
+    int peak() const;
+
+  private:
+    mutable std::mutex m_buf;
+    std::condition_variable con;
+    std::deque<KeyFrame *> buf;
+    int capacity;
+    unsigned long pushed_cnt;
+    unsigned long dropped_cnt;
+    int peak_depth;
+};
@@ -20,15 +20,20 @@ void LoopClosure::initCameraModel(const std::string &calib_file)
       demo.initCameraModel(calib_file);
 }
 
-bool LoopClosure::startLoopClosure(std::vector<cv::KeyPoint> &keys, std::vector<BRIEF::bitset> &descriptors,
+void LoopClosure::setMaxCandidates(int n)
+{
+      demo.detector.setMaxCandidates(n);
+}
+
+bool LoopClosure::startLoopClosure(const FeaturesPtr &features,
                                    std::vector<cv::Point2f> &cur_pts,
                                    std::vector<cv::Point2f> &old_pts,
-                                   int &old_index)
+                                   std::vector<int> &old_indices)
 {
   try 
   {
     bool loop_succ = false;
-    loop_succ = demo.run("BRIEF", keys, descriptors, cur_pts, old_pts, old_index);
+    loop_succ = demo.run("BRIEF", features, cur_pts, old_pts, old_indices);
     return loop_succ;
   }
   catch(const std::string &ex)
@@ -38,6 +43,28 @@ bool LoopClosure::startLoopClosure(std::vector<cv::KeyPoint> &keys, std::vector<
   }
 }
 
+bool LoopClosure::startLoopClosure(const FeaturesPtr &features,
+                                   const BowVector &bowvec, const FeatureVector &featvec,
+                                   std::vector<cv::Point2f> &cur_pts,
+                                   std::vector<cv::Point2f> &old_pts,
+                                   std::vector<int> &old_indices)
+{
+  try 
+  {
+    return demo.run("BRIEF", features, bowvec, featvec, cur_pts, old_pts, old_indices);
+  }
+  catch(const std::string &ex)
+  {
+    cout << "Error: " << ex << endl;
+    return false;
+  }
+}
+
+void LoopClosure::transform(const std::vector<BRIEF::bitset> &descriptors, BowVector &bowvec, FeatureVector &featvec) const
+{
+  demo.detector.transform(descriptors, bowvec, featvec);
+}
+
 void LoopClosure::eraseIndex(std::vector<int> &erase_index)
 {
   demo.eraseIndex(erase_index);
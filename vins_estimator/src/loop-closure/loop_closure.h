@@ -28,11 +28,22 @@ class LoopClosure
 public:
 	LoopClosure(const char *voc_file, int _image_w, int _image_h);
 
-	bool startLoopClosure(std::vector<cv::KeyPoint> &keys, std::vector<BRIEF::bitset> &descriptors,
+	typedef BriefLoopDetector::FeaturesPtr FeaturesPtr;
+
+	bool startLoopClosure(const FeaturesPtr &features,
+                                   std::vector<cv::Point2f> &cur_pts,
+                                   std::vector<cv::Point2f> &old_pts,
+                                   std::vector<int> &old_indices);
+	// with the vectors from transform, which can be computed ahead in another thread
+	bool startLoopClosure(const FeaturesPtr &features,
+                                   const BowVector &bowvec, const FeatureVector &featvec,
                                    std::vector<cv::Point2f> &cur_pts,
                                    std::vector<cv::Point2f> &old_pts,
-                                   int &old_index);
+                                   std::vector<int> &old_indices);
+	void transform(const std::vector<BRIEF::bitset> &descriptors, BowVector &bowvec, FeatureVector &featvec) const;
 	void initCameraModel(const std::string &calib_file);
+	// number of loop candidates startLoopClosure returns at most
+	void setMaxCandidates(int n);
 
 	void eraseIndex(std::vector<int> &erase_index);
 	/* data */
@@ -0,0 +1,109 @@
+#include "measurement_sync.h"
+#include <cmath>
+#include <ros/console.h>
+
+MeasurementSync::MeasurementSync()
+    : emitted_cnt{0}, unsynced_cnt{0}, shed_cnt{0},
+      policy{KEEP_ALL}, max_depth{0}, max_age{0}, min_parallax{0}
+{
+}
+
+void MeasurementSync::setPolicy(int _policy, int _max_depth, double _max_age, double _min_parallax)
+{
+    policy = _policy == DROP_NON_KEYFRAME ? DROP_NON_KEYFRAME : KEEP_ALL;
+    max_depth = _max_depth;
+    max_age = _max_age;
+    min_parallax = _min_parallax;
+}
+
+void MeasurementSync::pushImu(const sensor_msgs::ImuConstPtr &imu_msg)
+{
+    imu_buf.push_back(imu_msg);
+}
+
+void MeasurementSync::pushFeature(const sensor_msgs::PointCloudConstPtr &feature_msg)
+{
+    feature_buf.push_back(feature_msg);
+}
+
+int MeasurementSync::depth() const
+{
+    return feature_buf.size();
+}
+
+double MeasurementSync::age() const
+{
+    if (imu_buf.empty() || feature_buf.empty())
+        return 0;
+    return imu_buf.back()->header.stamp.toSec() - feature_buf.front()->header.stamp.toSec();
+}
+
+// a limit <= 0 is not checked
+bool MeasurementSync::behind(double scale) const
+{
+    return (max_depth > 0 && depth() > scale * max_depth) || (max_age > 0 && age() > scale * max_age);
+}
+
+// mean displacement of the features shared with the last emitted image
+double MeasurementSync::parallax(const sensor_msgs::PointCloud &feature_msg) const
+{
+    double sum = 0;
+    int cnt = 0;
+    for (unsigned int i = 0; i < feature_msg.points.size(); i++)
+    {
+        auto it = last_points.find(feature_msg.channels[0].values[i] + 0.5);
+        if (it == last_points.end())
+            continue;
+        double du = feature_msg.points[i].x - it->second.first;
+        double dv = feature_msg.points[i].y - it->second.second;
+        sum += std::sqrt(du * du + dv * dv);
+        cnt++;
+    }
+    // nothing in common is as new as it gets
+    return cnt == 0 ? INFINITY : sum / cnt;
+}
+
+bool MeasurementSync::next(Measurement &measurement)
+{
+    while (!feature_buf.empty())
+    {
+        if (imu_buf.empty() || !(imu_buf.back()->header.stamp > feature_buf.front()->header.stamp))
+            return false;
+
+        if (!(imu_buf.front()->header.stamp < feature_buf.front()->header.stamp))
+        {
+            ROS_WARN("throw img, only should happen at the beginning");
+            unsynced_cnt++;
+            feature_buf.pop_front();
+            continue;
+        }
+
+        if (policy == DROP_NON_KEYFRAME && feature_buf.size() > 1 && behind(1.0) &&
+            (behind(2.0) || parallax(*feature_buf.front()) < min_parallax))
+        {
+            shed_cnt++;
+            feature_buf.pop_front();
+            continue;
+        }
+
+        measurement.second = feature_buf.front();
+        feature_buf.pop_front();
+        measurement.first.clear();
+        while (imu_buf.front()->header.stamp <= measurement.second->header.stamp)
+        {
+            measurement.first.emplace_back(imu_buf.front());
+            imu_buf.pop_front();
+        }
+
+        if (policy == DROP_NON_KEYFRAME)
+        {
+            const sensor_msgs::PointCloud &feature_msg = *measurement.second;
+            last_points.clear();
+            for (unsigned int i = 0; i < feature_msg.points.size(); i++)
+                last_points[feature_msg.channels[0].values[i] + 0.5] = std::make_pair(feature_msg.points[i].x, feature_msg.points[i].y);
+        }
+        emitted_cnt++;
+        return true;
+    }
+    return false;
+}
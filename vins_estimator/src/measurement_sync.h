@@ -0,0 +1,56 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+#include <sensor_msgs/Imu.h>
+#include <sensor_msgs/PointCloud.h>
+
+typedef std::pair<std::vector<sensor_msgs::ImuConstPtr>, sensor_msgs::PointCloudConstPtr> Measurement;
+
+// Pairs images with the imu messages up to their stamp, one bundle per call to next().
+// When the back-end falls behind (too many images pending, or the newest imu too far ahead
+// of the oldest pending image) the policy decides what to shed. Skipped images leave their
+// imu messages in place, the next bundle then spans the gap.
+class MeasurementSync
+{
+  public:
+    enum Policy
+    {
+        KEEP_ALL = 0,
+        // drop pending images that add little parallax to the last emitted one, drop the
+        // oldest ones regardless once twice the limits are exceeded
+        DROP_NON_KEYFRAME = 1
+    };
+
+    MeasurementSync();
+    void setPolicy(int _policy, int _max_depth, double _max_age, double _min_parallax);
+
+    void pushImu(const sensor_msgs::ImuConstPtr &imu_msg);
+    void pushFeature(const sensor_msgs::PointCloudConstPtr &feature_msg);
+    bool next(Measurement &measurement);
+
+    // images waiting for their imu or for the estimator
+    int depth() const;
+    // newest imu stamp minus oldest pending image stamp
+    double age() const;
+
+    unsigned long emitted_cnt;
+    unsigned long unsynced_cnt;
+    unsigned long shed_cnt;
+
+  private:
+    bool behind(double scale) const;
+    double parallax(const sensor_msgs::PointCloud &feature_msg) const;
+
+    Policy policy;
+    int max_depth;
+    double max_age;
+    double min_parallax;
+
+    std::deque<sensor_msgs::ImuConstPtr> imu_buf;
+    std::deque<sensor_msgs::PointCloudConstPtr> feature_buf;
+    // normalized points of the last emitted image by feature (and camera) id
+    std::unordered_map<int, std::pair<double, double>> last_points;
+};
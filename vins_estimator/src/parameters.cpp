@@ -4,6 +4,13 @@ double INIT_DEPTH;
 double MIN_PARALLAX;
 double ACC_N, ACC_W;
 double GYR_N, GYR_W;
+int IMU_PRESUM_NUM;
+int ESTIMATOR_PIPELINE;
+int SYNC_POLICY;
+int SYNC_MAX_DEPTH;
+double SYNC_MAX_AGE;
+int PATH_DECIMATION;
+double PATH_HISTORY_PERIOD;
 
 std::vector<Eigen::Matrix3d> RIC;
 std::vector<Eigen::Vector3d> TIC;
@@ -19,6 +26,12 @@ std::string EX_CALIB_RESULT_PATH;
 std::string VINS_RESULT_PATH;
 int LOOP_CLOSURE = 0;
 int MIN_LOOP_NUM;
+int LOOP_MATCH_MODE;
+int LOOP_MATCH_LEVEL;
+int LOOP_CANDIDATES;
+int LOOP_QUEUE_SIZE;
+int LOOP_BATCH_SIZE;
+int LOOP_THREADS;
 std::string CAM_NAMES;
 std::string PATTERN_FILE;
 std::string VOC_FILE;
@@ -65,6 +78,17 @@ void readParameters(ros::NodeHandle &n)
     NUM_ITERATIONS = fsSettings["max_num_iterations"];
     MIN_PARALLAX = fsSettings["keyframe_parallax"];
     MIN_PARALLAX = MIN_PARALLAX / FOCAL_LENGTH;
+    ESTIMATOR_PIPELINE = fsSettings["estimator_pipeline"];
+    if (ESTIMATOR_PIPELINE)
+        ROS_WARN("pipelined estimator");
+    SYNC_POLICY = fsSettings["sync_policy"];
+    SYNC_MAX_DEPTH = fsSettings["sync_max_depth"];
+    SYNC_MAX_AGE = fsSettings["sync_max_age"];
+    if (SYNC_POLICY)
+        ROS_WARN("shed images when more than %d pending or %f s behind", SYNC_MAX_DEPTH, SYNC_MAX_AGE);
+
+    PATH_DECIMATION = fsSettings["path_decimation"];
+    PATH_HISTORY_PERIOD = fsSettings["path_history_period"];
 
     fsSettings["output_path"] >> VINS_RESULT_PATH;
     VINS_RESULT_PATH = VINS_FOLDER_PATH + VINS_RESULT_PATH;
@@ -76,6 +100,9 @@ void readParameters(ros::NodeHandle &n)
     GYR_N = fsSettings["gyr_n"];
     GYR_W = fsSettings["gyr_w"];
     G.z() = fsSettings["g_norm"];
+    IMU_PRESUM_NUM = fsSettings["imu_presum_num"];
+    if (IMU_PRESUM_NUM > 1)
+        ROS_WARN("pre-sum %d imu samples per integration step", IMU_PRESUM_NUM);
 
     ESTIMATE_EXTRINSIC = fsSettings["estimate_extrinsic"];
     if (ESTIMATE_EXTRINSIC == 2)
@@ -122,8 +149,28 @@ void readParameters(ros::NodeHandle &n)
         fsSettings["voc_file"] >> VOC_FILE;;
         fsSettings["pattern_file"] >> PATTERN_FILE;
         VOC_FILE = VINS_FOLDER_PATH + VOC_FILE;
+        // without the binary vocabulary at build time no flat one was generated
+        if (!std::ifstream(VOC_FILE) && VOC_FILE.rfind('.') != std::string::npos)
+        {
+            std::string bin_file = VOC_FILE.substr(0, VOC_FILE.rfind('.')) + ".bin";
+            if (std::ifstream(bin_file))
+            {
+                ROS_WARN("%s not found, loading %s instead", VOC_FILE.c_str(), bin_file.c_str());
+                VOC_FILE = bin_file;
+            }
+        }
         PATTERN_FILE = VINS_FOLDER_PATH + PATTERN_FILE;
         MIN_LOOP_NUM = fsSettings["min_loop_num"];
+        LOOP_MATCH_MODE = fsSettings["loop_match_mode"];
+        LOOP_MATCH_LEVEL = fsSettings["loop_match_level"];
+        LOOP_CANDIDATES = fsSettings["loop_candidates"];
+        if (LOOP_CANDIDATES < 1)
+            LOOP_CANDIDATES = 1;
+        LOOP_QUEUE_SIZE = fsSettings["loop_queue_size"];
+        LOOP_BATCH_SIZE = fsSettings["loop_batch_size"];
+        if (LOOP_BATCH_SIZE < 1)
+            LOOP_BATCH_SIZE = 1;
+        LOOP_THREADS = fsSettings["loop_threads"];
         CAM_NAMES = config_file;
     }
 
@@ -23,6 +23,13 @@ extern int ESTIMATE_EXTRINSIC;
 
 extern double ACC_N, ACC_W;
 extern double GYR_N, GYR_W;
+extern int IMU_PRESUM_NUM;
+extern int ESTIMATOR_PIPELINE;
+extern int SYNC_POLICY;
+extern int SYNC_MAX_DEPTH;
+extern double SYNC_MAX_AGE;
+extern int PATH_DECIMATION;
+extern double PATH_HISTORY_PERIOD;
 
 extern std::vector<Eigen::Matrix3d> RIC;
 extern std::vector<Eigen::Vector3d> TIC;
@@ -38,6 +45,12 @@ extern std::string VINS_FOLDER_PATH;
 
 extern int LOOP_CLOSURE;
 extern int MIN_LOOP_NUM;
+extern int LOOP_MATCH_MODE;
+extern int LOOP_MATCH_LEVEL;
+extern int LOOP_CANDIDATES;
+extern int LOOP_QUEUE_SIZE;
+extern int LOOP_BATCH_SIZE;
+extern int LOOP_THREADS;
 extern int MAX_KEYFRAME_NUM;
 extern std::string PATTERN_FILE;
 extern std::string VOC_FILE;
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <cstddef>
+
+// Bounded lock-free ring for exactly one producer and one consumer thread. Neither side
+// ever blocks: when the ring is full push() rejects the new element and counts it as
+// dropped, the producer decides what that means for its stream. The counters can be read
+// from any thread.
+template <typename T>
+class SpscRing
+{
+  public:
+    // the capacity is rounded up to a power of two
+    explicit SpscRing(size_t _capacity)
+        : head(0), tail(0), head_cache(0), tail_cache(0), pushed_cnt(0), dropped_cnt(0), peak_size(0)
+    {
+        size_t size = 1;
+        while (size < _capacity)
+            size <<= 1;
+        buffer.resize(size);
+        mask = size - 1;
+    }
+
+    // producer thread only
+    bool push(const T &value)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail_cache > mask)
+        {
+            tail_cache = tail.load(std::memory_order_acquire);
+            if (h - tail_cache > mask)
+            {
+                dropped_cnt.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        buffer[h & mask] = value;
+        head.store(h + 1, std::memory_order_release);
+        pushed_cnt.fetch_add(1, std::memory_order_relaxed);
+        if (h + 1 - tail_cache > peak_size.load(std::memory_order_relaxed))
+            peak_size.store(h + 1 - tail_cache, std::memory_order_relaxed);
+        return true;
+    }
+
+    // consumer thread only
+    bool pop(T &value)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head_cache)
+        {
+            head_cache = head.load(std::memory_order_acquire);
+            if (t == head_cache)
+                return false;
+        }
+        value = std::move(buffer[t & mask]);
+        // do not keep the popped message alive until the slot is reused
+        buffer[t & mask] = T();
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // exact on the consumer side, a snapshot anywhere else
+    size_t size() const
+    {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    size_t capacity() const
+    {
+        return mask + 1;
+    }
+
+    unsigned long pushed() const
+    {
+        return pushed_cnt.load(std::memory_order_relaxed);
+    }
+
+    unsigned long dropped() const
+    {
+        return dropped_cnt.load(std::memory_order_relaxed);
+    }
+
+    // largest fill level seen by the producer, may overestimate by what was popped meanwhile
+    size_t peak() const
+    {
+        return peak_size.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::vector<T> buffer;
+    size_t mask;
+
+    // written by the producer and the consumer respectively, kept on separate cache lines
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    // each side's last view of the other index, saves the shared load in the common case
+    alignas(64) size_t head_cache;
+    alignas(64) size_t tail_cache;
+
+    alignas(64) std::atomic<unsigned long> pushed_cnt;
+    std::atomic<unsigned long> dropped_cnt;
+    std::atomic<size_t> peak_size;
+};
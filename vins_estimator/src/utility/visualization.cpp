@@ -3,23 +3,84 @@
 using namespace ros;
 using namespace Eigen;
 ros::Publisher pub_odometry, pub_latest_odometry;
-ros::Publisher pub_path, pub_loop_path;
+PathPublisher path_publisher, loop_path_publisher;
 ros::Publisher pub_point_cloud, pub_margin_cloud;
 ros::Publisher pub_key_poses;
 
 ros::Publisher pub_camera_pose;
 ros::Publisher pub_camera_pose_visual, pub_pose_graph;
-nav_msgs::Path path, loop_path;
 CameraPoseVisualization cameraposevisual(0, 0, 1, 1);
 CameraPoseVisualization keyframebasevisual(0.0, 0.0, 1.0, 1.0);
 static double sum_of_path = 0;
 static Vector3d last_path(0.0, 0.0, 0.0);
 
+PathPublisher::PathPublisher()
+    : decimation{1}, history_period{0}, has_last_pose{false}, add_cnt{0}, last_path_time{-1}, last_subscribers{0}, path_dirty{false}
+{
+}
+
+void PathPublisher::advertise(ros::NodeHandle &n, const std::string &topic, int _decimation, double _history_period)
+{
+    decimation = _decimation < 1 ? 1 : _decimation;
+    history_period = _history_period;
+    pub_path = n.advertise<nav_msgs::Path>(topic, 10);
+    pub_segment = n.advertise<nav_msgs::Path>(topic + "_segment", 1000);
+}
+
+void PathPublisher::add(const geometry_msgs::PoseStamped &pose)
+{
+    std::lock_guard<std::mutex> lk(m_path);
+    if (add_cnt++ % decimation == 0)
+        path.poses.push_back(pose);
+
+    // the previous pose starts the segment, so that consecutive segments join up
+    nav_msgs::Path segment;
+    segment.header = pose.header;
+    segment.header.frame_id = "world";
+    if (has_last_pose)
+        segment.poses.push_back(last_pose);
+    segment.poses.push_back(pose);
+    pub_segment.publish(segment);
+    last_pose = pose;
+    has_last_pose = true;
+
+    unsigned int subscribers = pub_path.getNumSubscribers();
+    double t = pose.header.stamp.toSec();
+    if (path_dirty || subscribers > last_subscribers ||
+        (history_period > 0 && (last_path_time < 0 || t - last_path_time >= history_period)))
+    {
+        publishPath(segment.header);
+        last_path_time = t;
+        path_dirty = false;
+    }
+    last_subscribers = subscribers;
+}
+
+// the pose graph replaced the trajectory, the next segment must not join the old last pose
+void PathPublisher::reset(const nav_msgs::Path &_path)
+{
+    std::lock_guard<std::mutex> lk(m_path);
+    path.poses.clear();
+    for (int i = 0; i < (int)_path.poses.size(); i++)
+        if (i % decimation == 0 || i + 1 == (int)_path.poses.size())
+            path.poses.push_back(_path.poses[i]);
+    add_cnt = 0;
+    has_last_pose = false;
+    path_dirty = true;
+}
+
+void PathPublisher::publishPath(const std_msgs::Header &header)
+{
+    path.header = header;
+    path.header.frame_id = "world";
+    pub_path.publish(path);
+}
+
 void registerPub(ros::NodeHandle &n)
 {
     pub_latest_odometry = n.advertise<nav_msgs::Odometry>("imu_propagate", 1000);
-    pub_path = n.advertise<nav_msgs::Path>("path_no_loop", 1000);
-    pub_loop_path = n.advertise<nav_msgs::Path>("path", 1000);
+    path_publisher.advertise(n, "path_no_loop", PATH_DECIMATION, PATH_HISTORY_PERIOD);
+    loop_path_publisher.advertise(n, "path", PATH_DECIMATION, PATH_HISTORY_PERIOD);
     pub_odometry = n.advertise<nav_msgs::Odometry>("odometry", 1000);
     pub_point_cloud = n.advertise<sensor_msgs::PointCloud>("point_cloud", 1000);
     pub_margin_cloud = n.advertise<sensor_msgs::PointCloud>("history_cloud", 1000);
@@ -54,24 +115,75 @@ void pubLatestOdometry(const Eigen::Vector3d &P, const Eigen::Quaterniond &Q, co
     pub_latest_odometry.publish(odometry);
 }
 
-void printStatistics(const Estimator &estimator, double t)
+void EstimatorRecord::capture(const Estimator &estimator)
+{
+    non_linear = estimator.solver_flag == Estimator::SolverFlag::NON_LINEAR;
+    P = estimator.Ps[WINDOW_SIZE];
+    R = estimator.Rs[WINDOW_SIZE];
+    V = estimator.Vs[WINDOW_SIZE];
+    for (int i = 0; i < NUM_OF_CAM; i++)
+    {
+        tic[i] = estimator.tic[i];
+        ric[i] = estimator.ric[i];
+    }
+}
+
+void EstimatorSnapshot::capture(const Estimator &estimator)
+{
+    non_linear = estimator.solver_flag == Estimator::SolverFlag::NON_LINEAR;
+    camera_P = estimator.Ps[WINDOW_SIZE - 1];
+    camera_R = estimator.Rs[WINDOW_SIZE - 1];
+    camera_stamp = estimator.Headers[WINDOW_SIZE - 1].stamp;
+    for (int i = 0; i < NUM_OF_CAM; i++)
+    {
+        tic[i] = estimator.tic[i];
+        ric[i] = estimator.ric[i];
+    }
+    key_poses = estimator.key_poses;
+
+    // one pass over the features for both clouds, still without the loop correction
+    point_cloud.clear();
+    margin_cloud.clear();
+    for (auto &it_per_id : estimator.f_manager.feature)
+    {
+        int used_num;
+        used_num = it_per_id.feature_per_frame.size();
+        if (!(used_num >= 2 && it_per_id.start_frame < WINDOW_SIZE - 2))
+            continue;
+        if (it_per_id.solve_flag != 1)
+            continue;
+        bool in_cloud = it_per_id.start_frame <= WINDOW_SIZE * 3.0 / 4.0;
+        bool in_margin = it_per_id.start_frame == 0 && it_per_id.feature_per_frame.size() <= 2;
+        if (!in_cloud && !in_margin)
+            continue;
+        int imu_i = it_per_id.start_frame;
+        Vector3d pts_i = it_per_id.feature_per_frame[0].point * it_per_id.estimated_depth;
+        Vector3d w_pts_i = estimator.Rs[imu_i] * (estimator.ric[0] * pts_i + estimator.tic[0]) + estimator.Ps[imu_i];
+        if (in_cloud)
+            point_cloud.push_back(w_pts_i);
+        if (in_margin)
+            margin_cloud.push_back(w_pts_i);
+    }
+}
+
+void printStatistics(const EstimatorRecord &record)
 {
-    if (estimator.solver_flag != Estimator::SolverFlag::NON_LINEAR)
+    if (!record.non_linear)
         return;
-    ROS_INFO_STREAM("position: " << estimator.Ps[WINDOW_SIZE].transpose());
-    ROS_DEBUG_STREAM("orientation: " << estimator.Vs[WINDOW_SIZE].transpose());
+    ROS_INFO_STREAM("position: " << record.P.transpose());
+    ROS_DEBUG_STREAM("orientation: " << record.V.transpose());
     for (int i = 0; i < NUM_OF_CAM; i++)
     {
         //ROS_DEBUG("calibration result for camera %d", i);
-        ROS_DEBUG_STREAM("extirnsic tic: " << estimator.tic[i].transpose());
-        ROS_DEBUG_STREAM("extrinsic ric: " << Utility::R2ypr(estimator.ric[i]).transpose());
+        ROS_DEBUG_STREAM("extirnsic tic: " << record.tic[i].transpose());
+        ROS_DEBUG_STREAM("extrinsic ric: " << Utility::R2ypr(record.ric[i]).transpose());
         if (ESTIMATE_EXTRINSIC)
         {
             cv::FileStorage fs(EX_CALIB_RESULT_PATH, cv::FileStorage::WRITE);
             Eigen::Matrix3d eigen_R;
             Eigen::Vector3d eigen_T;
-            eigen_R = estimator.ric[i];
-            eigen_T = estimator.tic[i];
+            eigen_R = record.ric[i];
+            eigen_T = record.tic[i];
             cv::Mat cv_R, cv_T;
             cv::eigen2cv(eigen_R, cv_R);
             cv::eigen2cv(eigen_T, cv_T);
@@ -80,6 +192,7 @@ void printStatistics(const Estimator &estimator, double t)
         }
     }
 
+    double t = record.whole_t;
     static double sum_of_time = 0;
     static int sum_of_calculation = 0;
     sum_of_time += t;
@@ -87,43 +200,42 @@ void printStatistics(const Estimator &estimator, double t)
     ROS_DEBUG("vo solver costs: %f ms", t);
     ROS_DEBUG("average of time %f ms", sum_of_time / sum_of_calculation);
 
-    sum_of_path += (estimator.Ps[WINDOW_SIZE] - last_path).norm();
-    last_path = estimator.Ps[WINDOW_SIZE];
+    sum_of_path += (record.P - last_path).norm();
+    last_path = record.P;
     ROS_DEBUG("sum of path %f", sum_of_path);
 }
 
-void pubOdometry(const Estimator &estimator, const std_msgs::Header &header, Eigen::Vector3d loop_correct_t,
-                Eigen::Matrix3d loop_correct_r)
+void pubOdometry(const EstimatorRecord &record)
 {
-    if (estimator.solver_flag == Estimator::SolverFlag::NON_LINEAR)
+    const std_msgs::Header &header = record.header;
+    const Eigen::Vector3d &loop_correct_t = record.loop_correct_t;
+    const Eigen::Matrix3d &loop_correct_r = record.loop_correct_r;
+    if (record.non_linear)
     {
         nav_msgs::Odometry odometry;
         odometry.header = header;
         odometry.header.frame_id = "world";
         odometry.child_frame_id = "world";
-        odometry.pose.pose.position.x = estimator.Ps[WINDOW_SIZE].x();
-        odometry.pose.pose.position.y = estimator.Ps[WINDOW_SIZE].y();
-        odometry.pose.pose.position.z = estimator.Ps[WINDOW_SIZE].z();
-        odometry.pose.pose.orientation.x = Quaterniond(estimator.Rs[WINDOW_SIZE]).x();
-        odometry.pose.pose.orientation.y = Quaterniond(estimator.Rs[WINDOW_SIZE]).y();
-        odometry.pose.pose.orientation.z = Quaterniond(estimator.Rs[WINDOW_SIZE]).z();
-        odometry.pose.pose.orientation.w = Quaterniond(estimator.Rs[WINDOW_SIZE]).w();
+        odometry.pose.pose.position.x = record.P.x();
+        odometry.pose.pose.position.y = record.P.y();
+        odometry.pose.pose.position.z = record.P.z();
+        odometry.pose.pose.orientation.x = Quaterniond(record.R).x();
+        odometry.pose.pose.orientation.y = Quaterniond(record.R).y();
+        odometry.pose.pose.orientation.z = Quaterniond(record.R).z();
+        odometry.pose.pose.orientation.w = Quaterniond(record.R).w();
         
         geometry_msgs::PoseStamped pose_stamped;
         pose_stamped.header = header;
         pose_stamped.header.frame_id = "world";
         pose_stamped.pose = odometry.pose.pose;
-        path.header = header;
-        path.header.frame_id = "world";
-        path.poses.push_back(pose_stamped);
-        pub_path.publish(path);
+        path_publisher.add(pose_stamped);
 
         Vector3d correct_t;
         Vector3d correct_v;
         Quaterniond correct_q;
-        correct_t = loop_correct_r * estimator.Ps[WINDOW_SIZE] + loop_correct_t;
-        correct_q = loop_correct_r * estimator.Rs[WINDOW_SIZE];
-        correct_v = loop_correct_r * estimator.Vs[WINDOW_SIZE];
+        correct_t = loop_correct_r * record.P + loop_correct_t;
+        correct_q = loop_correct_r * record.R;
+        correct_v = loop_correct_r * record.V;
         odometry.pose.pose.position.x = correct_t.x();
         odometry.pose.pose.position.y = correct_t.y();
         odometry.pose.pose.position.z = correct_t.z();
@@ -137,10 +249,7 @@ void pubOdometry(const Estimator &estimator, const std_msgs::Header &header, Eig
         pub_odometry.publish(odometry);
 
         pose_stamped.pose = odometry.pose.pose;
-        loop_path.header = header;
-        loop_path.header.frame_id = "world";
-        loop_path.poses.push_back(pose_stamped);
-        pub_loop_path.publish(loop_path);
+        loop_path_publisher.add(pose_stamped);
 
         // write result to file
         ofstream foutC(VINS_RESULT_PATH, ios::app);
@@ -162,10 +271,10 @@ void pubOdometry(const Estimator &estimator, const std_msgs::Header &header, Eig
     }
 }
 
-void pubKeyPoses(const Estimator &estimator, const std_msgs::Header &header, Eigen::Vector3d loop_correct_t,
-                Eigen::Matrix3d loop_correct_r)
+void pubKeyPoses(const EstimatorSnapshot &snapshot)
 {
-    if (estimator.key_poses.size() == 0)
+    const std_msgs::Header &header = snapshot.header;
+    if (snapshot.key_poses.size() == 0)
         return;
     visualization_msgs::Marker key_poses;
     key_poses.header = header;
@@ -188,7 +297,7 @@ void pubKeyPoses(const Estimator &estimator, const std_msgs::Header &header, Eig
     {
         geometry_msgs::Point pose_marker;
         Vector3d correct_pose;
-        correct_pose = loop_correct_r * estimator.key_poses[i] + loop_correct_t;
+        correct_pose = snapshot.loop_correct_r * snapshot.key_poses[i] + snapshot.loop_correct_t;
         pose_marker.x = correct_pose.x();
         pose_marker.y = correct_pose.y();
         pose_marker.z = correct_pose.z();
@@ -197,20 +306,17 @@ void pubKeyPoses(const Estimator &estimator, const std_msgs::Header &header, Eig
     pub_key_poses.publish(key_poses);
 }
 
-void pubCameraPose(const Estimator &estimator, const std_msgs::Header &header, Eigen::Vector3d loop_correct_t,
-                   Eigen::Matrix3d loop_correct_r)
+void pubCameraPose(const EstimatorSnapshot &snapshot)
 {
-    int idx2 = WINDOW_SIZE - 1;
-    if (estimator.solver_flag == Estimator::SolverFlag::NON_LINEAR)
+    const Eigen::Vector3d &loop_correct_t = snapshot.loop_correct_t;
+    const Eigen::Matrix3d &loop_correct_r = snapshot.loop_correct_r;
+    if (snapshot.non_linear)
     {
-        int i = idx2;
         geometry_msgs::PoseStamped camera_pose;
-        camera_pose.header = header;
-        camera_pose.header.frame_id = std::to_string(estimator.Headers[i].stamp.toNSec());
-        Vector3d P = estimator.Ps[i] + estimator.Rs[i] * estimator.tic[0];
-        Quaterniond R = Quaterniond(estimator.Rs[i] * estimator.ric[0]);
-        P = (loop_correct_r * estimator.Ps[i] + loop_correct_t) + (loop_correct_r * estimator.Rs[i]) * estimator.tic[0];
-        R = Quaterniond((loop_correct_r * estimator.Rs[i]) * estimator.ric[0]);
+        camera_pose.header = snapshot.header;
+        camera_pose.header.frame_id = std::to_string(snapshot.camera_stamp.toNSec());
+        Vector3d P = (loop_correct_r * snapshot.camera_P + loop_correct_t) + (loop_correct_r * snapshot.camera_R) * snapshot.tic[0];
+        Quaterniond R = Quaterniond((loop_correct_r * snapshot.camera_R) * snapshot.ric[0]);
         camera_pose.pose.position.x = P.x();
         camera_pose.pose.position.y = P.y();
         camera_pose.pose.position.z = P.z();
@@ -229,63 +335,33 @@ void pubCameraPose(const Estimator &estimator, const std_msgs::Header &header, E
 }
 
 
-void pubPointCloud(const Estimator &estimator, const std_msgs::Header &header, Eigen::Vector3d loop_correct_t,
-                   Eigen::Matrix3d loop_correct_r)
+void pubPointCloud(const EstimatorSnapshot &snapshot)
 {
-    sensor_msgs::PointCloud point_cloud, loop_point_cloud;
-    point_cloud.header = header;
-    loop_point_cloud.header = header;
-
-    for (auto &it_per_id : estimator.f_manager.feature)
+    sensor_msgs::PointCloud point_cloud;
+    point_cloud.header = snapshot.header;
+    for (auto &w_pts_i : snapshot.point_cloud)
     {
-        int used_num;
-        used_num = it_per_id.feature_per_frame.size();
-        if (!(used_num >= 2 && it_per_id.start_frame < WINDOW_SIZE - 2))
-            continue;
-        if (it_per_id.start_frame > WINDOW_SIZE * 3.0 / 4.0 || it_per_id.solve_flag != 1)
-            continue;
-        int imu_i = it_per_id.start_frame;
-        Vector3d pts_i = it_per_id.feature_per_frame[0].point * it_per_id.estimated_depth;
-        Vector3d w_pts_i = loop_correct_r * estimator.Rs[imu_i] * (estimator.ric[0] * pts_i + estimator.tic[0])
-                              + loop_correct_r * estimator.Ps[imu_i] + loop_correct_t;
-
+        Vector3d correct_pts = snapshot.loop_correct_r * w_pts_i + snapshot.loop_correct_t;
         geometry_msgs::Point32 p;
-        p.x = w_pts_i(0);
-        p.y = w_pts_i(1);
-        p.z = w_pts_i(2);
+        p.x = correct_pts(0);
+        p.y = correct_pts(1);
+        p.z = correct_pts(2);
         point_cloud.points.push_back(p);
     }
     pub_point_cloud.publish(point_cloud);
 
 
     // pub margined potin
-    sensor_msgs::PointCloud margin_cloud, loop_margin_cloud;
-    margin_cloud.header = header;
-    loop_margin_cloud.header = header;
-
-    for (auto &it_per_id : estimator.f_manager.feature)
-    { 
-        int used_num;
-        used_num = it_per_id.feature_per_frame.size();
-        if (!(used_num >= 2 && it_per_id.start_frame < WINDOW_SIZE - 2))
-            continue;
-        //if (it_per_id->start_frame > WINDOW_SIZE * 3.0 / 4.0 || it_per_id->solve_flag != 1)
-        //        continue;
-
-        if (it_per_id.start_frame == 0 && it_per_id.feature_per_frame.size() <= 2 
-            && it_per_id.solve_flag == 1 )
-        {
-            int imu_i = it_per_id.start_frame;
-            Vector3d pts_i = it_per_id.feature_per_frame[0].point * it_per_id.estimated_depth;
-            Vector3d w_pts_i = loop_correct_r * estimator.Rs[imu_i] * (estimator.ric[0] * pts_i + estimator.tic[0])
-                             + loop_correct_r * estimator.Ps[imu_i] + loop_correct_t;
-
-            geometry_msgs::Point32 p;
-            p.x = w_pts_i(0);
-            p.y = w_pts_i(1);
-            p.z = w_pts_i(2);
-            margin_cloud.points.push_back(p);
-        }
+    sensor_msgs::PointCloud margin_cloud;
+    margin_cloud.header = snapshot.header;
+    for (auto &w_pts_i : snapshot.margin_cloud)
+    {
+        Vector3d correct_pts = snapshot.loop_correct_r * w_pts_i + snapshot.loop_correct_t;
+        geometry_msgs::Point32 p;
+        p.x = correct_pts(0);
+        p.y = correct_pts(1);
+        p.z = correct_pts(2);
+        margin_cloud.points.push_back(p);
     }
     pub_margin_cloud.publish(margin_cloud);
 }
@@ -298,22 +374,22 @@ void pubPoseGraph(CameraPoseVisualization* posegraph, const std_msgs::Header &he
 
 void updateLoopPath(nav_msgs::Path _loop_path)
 {
-    loop_path = _loop_path;
+    loop_path_publisher.reset(_loop_path);
 }
 
-void pubTF(const Estimator &estimator, const std_msgs::Header &header, Eigen::Vector3d loop_correct_t,
-                   Eigen::Matrix3d loop_correct_r)
+void pubTF(const EstimatorRecord &record)
 {
-    if( estimator.solver_flag != Estimator::SolverFlag::NON_LINEAR)
+    if (!record.non_linear)
         return;
+    const std_msgs::Header &header = record.header;
     static tf::TransformBroadcaster br;
     tf::Transform transform;
     tf::Quaternion q;
     // body frame
     Vector3d correct_t;
     Quaterniond correct_q;
-    correct_t = loop_correct_r * estimator.Ps[WINDOW_SIZE] + loop_correct_t;
-    correct_q = loop_correct_r * estimator.Rs[WINDOW_SIZE];
+    correct_t = record.loop_correct_r * record.P + record.loop_correct_t;
+    correct_q = record.loop_correct_r * record.R;
 
     transform.setOrigin(tf::Vector3(correct_t(0),
                                     correct_t(1),
@@ -326,13 +402,13 @@ void pubTF(const Estimator &estimator, const std_msgs::Header &header, Eigen::Ve
     br.sendTransform(tf::StampedTransform(transform, header.stamp, "world", "body"));
 
     // camera frame
-    transform.setOrigin(tf::Vector3(estimator.tic[0].x(),
-                                    estimator.tic[0].y(),
-                                    estimator.tic[0].z()));
-    q.setW(Quaterniond(estimator.ric[0]).w());
-    q.setX(Quaterniond(estimator.ric[0]).x());
-    q.setY(Quaterniond(estimator.ric[0]).y());
-    q.setZ(Quaterniond(estimator.ric[0]).z());
+    transform.setOrigin(tf::Vector3(record.tic[0].x(),
+                                    record.tic[0].y(),
+                                    record.tic[0].z()));
+    q.setW(Quaterniond(record.ric[0]).w());
+    q.setX(Quaterniond(record.ric[0]).x());
+    q.setY(Quaterniond(record.ric[0]).y());
+    q.setZ(Quaterniond(record.ric[0]).z());
     transform.setRotation(q);
     br.sendTransform(tf::StampedTransform(transform, header.stamp, "body", "camera"));
 }
\ No newline at end of file
@@ -17,9 +17,11 @@
 #include "../estimator.h"
 #include "../parameters.h"
 #include <fstream>
+#include <deque>
+#include <mutex>
 
 extern ros::Publisher pub_odometry;
-extern ros::Publisher pub_path, pub_pose;
+extern ros::Publisher pub_pose;
 extern ros::Publisher pub_cloud, pub_map;
 extern ros::Publisher pub_key_poses;
 
@@ -27,35 +29,102 @@ extern ros::Publisher pub_ref_pose, pub_cur_pose;
 
 extern ros::Publisher pub_key;
 
-extern nav_msgs::Path path;
-
 extern ros::Publisher pub_pose_graph;
 
 extern int IMAGE_ROW, IMAGE_COL;
 
+// Publishes a growing trajectory at constant cost per frame. Every add publishes only the new
+// segment (the previous pose and the new one) on <topic>_segment. The full path, every
+// `decimation`-th pose, goes out on <topic> every `history_period` seconds, when a new
+// subscriber connects, or after the pose graph replaced it.
+class PathPublisher
+{
+  public:
+    PathPublisher();
+    void advertise(ros::NodeHandle &n, const std::string &topic, int _decimation, double _history_period);
+    void add(const geometry_msgs::PoseStamped &pose);
+    void reset(const nav_msgs::Path &_path);
+
+  private:
+    void publishPath(const std_msgs::Header &header);
+
+    ros::Publisher pub_path, pub_segment;
+    int decimation;
+    double history_period;
+
+    std::mutex m_path;
+    nav_msgs::Path path;
+    geometry_msgs::PoseStamped last_pose;
+    bool has_last_pose;
+    int add_cnt;
+    double last_path_time;
+    unsigned int last_subscribers;
+    bool path_dirty;
+};
+
+// What is published for every estimator frame: odometry, paths, tf and the result file. It is
+// captured on the estimator thread so that building and serializing the messages can happen on
+// the publisher thread, and small enough that the publisher never drops one.
+struct EstimatorRecord
+{
+    void capture(const Estimator &estimator);
+
+    std_msgs::Header header;
+    double whole_t;
+    bool non_linear;
+    // republished odometry after a pose graph update, P, R and V of the newest record
+    bool odometry_only;
+    Eigen::Vector3d loop_correct_t;
+    Eigen::Matrix3d loop_correct_r;
+
+    // newest frame
+    Eigen::Vector3d P, V;
+    Eigen::Matrix3d R;
+    Eigen::Vector3d tic[NUM_OF_CAM];
+    Eigen::Matrix3d ric[NUM_OF_CAM];
+};
+
+// The visualization of one estimator frame. A publisher that falls behind only shows the
+// newest one, the others are skipped.
+struct EstimatorSnapshot
+{
+    void capture(const Estimator &estimator);
+
+    std_msgs::Header header;
+    bool non_linear;
+    Eigen::Vector3d loop_correct_t;
+    Eigen::Matrix3d loop_correct_r;
+
+    // second newest frame, published as camera pose
+    Eigen::Vector3d camera_P;
+    Eigen::Matrix3d camera_R;
+    ros::Time camera_stamp;
+    Eigen::Vector3d tic[NUM_OF_CAM];
+    Eigen::Matrix3d ric[NUM_OF_CAM];
+
+    std::vector<Eigen::Vector3d> key_poses;
+    // features in the vio world frame, the loop correction is applied when published
+    std::vector<Eigen::Vector3d> point_cloud, margin_cloud;
+};
+
 void registerPub(ros::NodeHandle &n);
 
 void pubLatestOdometry(const Eigen::Vector3d &P, const Eigen::Quaterniond &Q, const Eigen::Vector3d &V, const std_msgs::Header &header);
 
-void printStatistics(const Estimator &estimator, double t);
+void printStatistics(const EstimatorRecord &record);
 
-void pubOdometry(const Estimator &estimator, const std_msgs::Header &header, Eigen::Vector3d loop_correct_t,
-                Eigen::Matrix3d loop_correct_r);
+void pubOdometry(const EstimatorRecord &record);
 
 void pubInitialGuess(const Estimator &estimator, const std_msgs::Header &header);
 
-void pubKeyPoses(const Estimator &estimator, const std_msgs::Header &header, Eigen::Vector3d loop_correct_t,
-				Eigen::Matrix3d loop_correct_r);
+void pubKeyPoses(const EstimatorSnapshot &snapshot);
 
-void pubCameraPose(const Estimator &estimator, const std_msgs::Header &header, Eigen::Vector3d loop_correct_t,
-                   Eigen::Matrix3d loop_correct_r);
+void pubCameraPose(const EstimatorSnapshot &snapshot);
 
-void pubPointCloud(const Estimator &estimator, const std_msgs::Header &header, Eigen::Vector3d loop_correct_t,
-                   Eigen::Matrix3d loop_correct_r);
+void pubPointCloud(const EstimatorSnapshot &snapshot);
 
 void pubPoseGraph(CameraPoseVisualization* posegraph, const std_msgs::Header &header);
 
 void updateLoopPath(nav_msgs::Path _loop_path);
 
-void pubTF(const Estimator &estimator, const std_msgs::Header &header, Eigen::Vector3d loop_correct_t,
-                   Eigen::Matrix3d loop_correct_r);
\ No newline at end of file
+void pubTF(const EstimatorRecord &record);
\ No newline at end of file
@@ -0,0 +1,113 @@
+#include "worker_pool.h"
+#include <algorithm>
+
+// > 0 while this thread runs a task of some pool
+static thread_local int task_depth = 0;
+
+static int loop_closure_threads = 0;
+
+void setLoopClosureThreads(int num_threads)
+{
+    loop_closure_threads = num_threads;
+}
+
+WorkerPool &loopClosureWorkerPool()
+{
+    static WorkerPool pool(loop_closure_threads > 0 ? loop_closure_threads : std::max((int)std::thread::hardware_concurrency() - 2, 1));
+    return pool;
+}
+
+WorkerPool::WorkerPool(int num_threads)
+    : cur_task(nullptr), num_tasks(0), next_task(0), active(0), generation(0), stop(false)
+{
+    if (num_threads <= 0)
+        num_threads = std::thread::hardware_concurrency();
+    if (num_threads <= 0)
+        num_threads = 1;
+    for (int i = 1; i < num_threads; i++)
+        workers.emplace_back(&WorkerPool::workerLoop, this);
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lk(m_pool);
+        stop = true;
+    }
+    con_start.notify_all();
+    for (auto &it : workers)
+        it.join();
+}
+
+int WorkerPool::size() const
+{
+    return static_cast<int>(workers.size()) + 1;
+}
+
+void WorkerPool::parallelFor(int _num_tasks, const std::function<void(int)> &task)
+{
+    if (_num_tasks <= 0)
+        return;
+    if (task_depth > 0)
+    {
+        for (int i = 0; i < _num_tasks; i++)
+            task(i);
+        return;
+    }
+    // nothing to share, run it here before m_call: the tasks may call into this pool again
+    // and must not wait for their own call
+    if (workers.empty() || _num_tasks == 1)
+    {
+        for (int i = 0; i < _num_tasks; i++)
+            task(i);
+        return;
+    }
+    std::lock_guard<std::mutex> call_lk(m_call);
+
+    {
+        std::lock_guard<std::mutex> lk(m_pool);
+        cur_task = &task;
+        num_tasks = _num_tasks;
+        next_task = 0;
+        active = static_cast<int>(workers.size());
+        generation++;
+    }
+    con_start.notify_all();
+    runTasks();
+
+    // every worker has to see the batch before the task goes out of scope
+    std::unique_lock<std::mutex> lk(m_pool);
+    con_done.wait(lk, [&]
+                  { return active == 0; });
+    cur_task = nullptr;
+}
+
+void WorkerPool::workerLoop()
+{
+    unsigned long seen_generation = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lk(m_pool);
+            con_start.wait(lk, [&]
+                           { return stop || generation != seen_generation; });
+            if (stop)
+                return;
+            seen_generation = generation;
+        }
+        runTasks();
+        {
+            std::lock_guard<std::mutex> lk(m_pool);
+            if (--active == 0)
+                con_done.notify_one();
+        }
+    }
+}
+
+void WorkerPool::runTasks()
+{
+    task_depth++;
+    for (int i = next_task++; i < num_tasks; i = next_task++)
+        (*cur_task)(i);
+    task_depth--;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+// Persistent pool of worker threads. parallelFor() hands out task indices dynamically and
+// the calling thread works along, so the threads are created once instead of every frame.
+// Called from inside a task of any pool, parallelFor() runs its tasks inline: the outer
+// level already keeps the threads busy, and waiting for another pool would serialize them.
+// A single task, or a pool without workers, runs on the caller without taking the pool, so
+// it may call parallelFor() on the same pool again.
+class WorkerPool
+{
+  public:
+    // num_threads <= 0 sizes the pool from the hardware, the caller counts as one thread
+    explicit WorkerPool(int num_threads = 0);
+    ~WorkerPool();
+
+    int size() const;
+    void parallelFor(int num_tasks, const std::function<void(int)> &task);
+
+  private:
+    void workerLoop();
+    void runTasks();
+
+    std::vector<std::thread> workers;
+    std::mutex m_call;
+    std::mutex m_pool;
+    std::condition_variable con_start, con_done;
+
+    const std::function<void(int)> *cur_task;
+    int num_tasks;
+    std::atomic<int> next_task;
+    int active;
+    unsigned long generation;
+    bool stop;
+};
+
+// Pool shared by the loop closure stages (BRIEF extraction, vocabulary transform, candidate
+// checks, keyframe batches). They all run from the loop detection thread, so one pool is
+// enough. num_threads <= 0 keeps all cores but two for the estimator and the front-end.
+// Must be set before the first use of the pool.
+void setLoopClosureThreads(int num_threads);
+WorkerPool &loopClosureWorkerPool();
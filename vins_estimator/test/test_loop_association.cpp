@@ -0,0 +1,124 @@
+#include <gtest/gtest.h>
+#include <random>
+#include "../src/feature_manager.h"
+
+// loop matches as (position in features_ids, para_Feature index)
+typedef vector<pair<int, int>> Association;
+
+// the association Estimator::optimization used before the index: walks features_ids forward
+// alongside the feature list, both sorted by id. Bounded here, the original ran past the end.
+Association sortedWalk(FeatureManager &f_manager, const vector<int> &features_ids, int frame)
+{
+    Association association;
+    int retrive_feature_index = 0;
+    int feature_index = -1;
+    for (auto &it_per_id : f_manager.feature)
+    {
+        it_per_id.used_num = it_per_id.feature_per_frame.size();
+        if (!(it_per_id.used_num >= 2 && it_per_id.start_frame < WINDOW_SIZE - 2))
+            continue;
+
+        ++feature_index;
+        if (it_per_id.start_frame <= frame)
+        {
+            while (retrive_feature_index < (int)features_ids.size() && features_ids[retrive_feature_index] < it_per_id.feature_id)
+                retrive_feature_index++;
+            if (retrive_feature_index < (int)features_ids.size() && features_ids[retrive_feature_index] == it_per_id.feature_id)
+            {
+                association.emplace_back(retrive_feature_index, feature_index);
+                retrive_feature_index++;
+            }
+        }
+    }
+    return association;
+}
+
+Association indexLookup(FeatureManager &f_manager, const vector<int> &features_ids, int frame)
+{
+    Association association;
+    for (auto &match : FeatureManager::matchLoopFeatures(f_manager.getOptimizedFeatureIndex(), features_ids, frame))
+        association.emplace_back(match.first, match.second.first);
+    return association;
+}
+
+class LoopAssociationTest : public ::testing::Test
+{
+  protected:
+    LoopAssociationTest()
+        : f_manager(Rs), rng(7)
+    {
+    }
+
+    // a window of features with ascending ids as the feature tracker hands them out, some
+    // tracked too briefly or starting too late to be optimized
+    void buildWindow(int feature_num)
+    {
+        std::uniform_int_distribution<int> start_dist(0, WINDOW_SIZE);
+        for (int id = 0; id < feature_num; id++)
+        {
+            int start = start_dist(rng);
+            std::uniform_int_distribution<int> length_dist(1, WINDOW_SIZE + 1 - start);
+            int length = length_dist(rng);
+            f_manager.feature.push_back(FeaturePerId(3 * id + 1, start));
+            for (int i = 0; i < length; i++)
+                f_manager.feature.back().feature_per_frame.push_back(FeaturePerFrame(Vector3d(0.1 * i, 0.2, 1.0)));
+        }
+    }
+
+    // sorted ids seen by a relocalization frame, partly unknown to the window
+    vector<int> loopFeatureIds(int feature_num)
+    {
+        vector<int> features_ids;
+        std::bernoulli_distribution take(0.4);
+        for (int id = 0; id < 3 * feature_num + 5; id++)
+            if (take(rng))
+                features_ids.push_back(id);
+        return features_ids;
+    }
+
+    Matrix3d Rs[WINDOW_SIZE + 1];
+    FeatureManager f_manager;
+    std::mt19937 rng;
+};
+
+TEST_F(LoopAssociationTest, MatchesSortedWalk)
+{
+    buildWindow(300);
+    for (int trial = 0; trial < 20; trial++)
+    {
+        vector<int> features_ids = loopFeatureIds(300);
+        for (int frame = 0; frame < WINDOW_SIZE; frame++)
+        {
+            Association expected = sortedWalk(f_manager, features_ids, frame);
+            EXPECT_EQ(expected, indexLookup(f_manager, features_ids, frame)) << "frame " << frame;
+        }
+    }
+}
+
+TEST_F(LoopAssociationTest, IndependentOfIdOrder)
+{
+    buildWindow(300);
+    vector<int> features_ids = loopFeatureIds(300);
+    int frame = WINDOW_SIZE - 3;
+    Association expected = sortedWalk(f_manager, features_ids, frame);
+    ASSERT_FALSE(expected.empty());
+
+    vector<int> shuffled_ids = features_ids;
+    std::shuffle(shuffled_ids.begin(), shuffled_ids.end(), rng);
+    // compare by feature id, the positions in features_ids moved
+    map<int, int> expected_by_id, found_by_id;
+    for (auto &match : expected)
+        expected_by_id[features_ids[match.first]] = match.second;
+    for (auto &match : indexLookup(f_manager, shuffled_ids, frame))
+        found_by_id[shuffled_ids[match.first]] = match.second;
+    EXPECT_EQ(expected_by_id, found_by_id);
+}
+
+TEST_F(LoopAssociationTest, IdsPastLastFeature)
+{
+    buildWindow(50);
+    // the old walk read past the end when the last optimized id exceeded all loop ids
+    vector<int> features_ids{1, 4, 7};
+    EXPECT_EQ(sortedWalk(f_manager, features_ids, WINDOW_SIZE - 1),
+              indexLookup(f_manager, features_ids, WINDOW_SIZE - 1));
+}
@@ -0,0 +1,244 @@
+#include <gtest/gtest.h>
+#include <future>
+#include <random>
+#include "../src/loop-closure/keyframe.h"
+#include "../src/loop-closure/ThirdParty/VocabularyFlat.hpp"
+
+// A textured scene seen by an old keyframe and, from a pose moved and turned a little, by
+// the keyframes of a loop batch. The batch goes through the stages of process_loop_detection
+// and the candidate check of detect_loop, once with a single keyframe and once with several.
+
+const int IMAGE_WIDTH = 752, IMAGE_HEIGHT = 480;
+// half size of a texture patch, it covers the BRIEF patch and the smoothing around it
+const int PATCH = 28;
+// patches closer than 2 * PATCH + 1 would reach into each other's descriptors
+const int SPACING = 64;
+
+struct LoopScene
+{
+    std::unique_ptr<LoopClosure> loop_closure;
+    camodocal::CameraPtr camera;
+    std::vector<Eigen::Vector3d> points;
+    std::vector<cv::Point2f> old_pts, cur_pts;
+    cv::Mat old_image, other_image, cur_image;
+    Eigen::Vector3d cur_T;
+    Eigen::Matrix3d cur_R;
+    std::unique_ptr<KeyFrame> old_kf, other_kf;
+};
+
+// what a batch leaves behind: every keyframe's descriptors and vectors, and the candidate
+// found connected for {other, old} and for {old, other}
+struct BatchResult
+{
+    std::vector<std::vector<BRIEF::bitset>> descriptors;
+    std::vector<DBoW2::BowVector> bowvecs;
+    std::vector<DBoW2::FeatureVector> featvecs;
+    std::vector<int> old_last, old_first;
+};
+
+// a noise patch per point, seeded by its index so that every view draws the same one
+cv::Mat drawScene(const std::vector<cv::Point2f> &pts, int seed)
+{
+    cv::Mat image(IMAGE_HEIGHT, IMAGE_WIDTH, CV_8UC1, cv::Scalar(128));
+    for (int i = 0; i < (int)pts.size(); i++)
+    {
+        std::mt19937 rng(seed + i);
+        std::uniform_int_distribution<int> intensity(0, 255);
+        for (int y = -PATCH; y <= PATCH; y++)
+            for (int x = -PATCH; x <= PATCH; x++)
+                image.at<uchar>((int)pts[i].y + y, (int)pts[i].x + x) = intensity(rng);
+    }
+    return image;
+}
+
+// a full tree of random nodes, k = 8 and two levels, written as a flat vocabulary
+void writeVocabulary(const std::string &filename)
+{
+    const int k = 8;
+    std::mt19937_64 rng(5);
+    VINSLoop::Vocabulary voc;
+    voc.k = k;
+    voc.L = 2;
+    voc.scoringType = DBoW2::L1_NORM;
+    voc.weightingType = DBoW2::TF_IDF;
+    voc.nNodes = k + k * k;
+    voc.nWords = k * k;
+    voc.nodes = new VINSLoop::Node[voc.nNodes];
+    voc.words = new VINSLoop::Word[voc.nWords];
+    for (int i = 0; i < voc.nNodes; i++)
+    {
+        VINSLoop::Node &node = voc.nodes[i];
+        node.nodeId = i + 1;
+        node.parentId = i < k ? 0 : (i - k) / k + 1;
+        node.weight = 1.0;
+        for (auto &word : node.descriptor)
+            word = rng();
+    }
+    for (int i = 0; i < voc.nWords; i++)
+    {
+        voc.words[i].nodeId = k + i + 1;
+        voc.words[i].wordId = i;
+    }
+    VINSLoop::FlatVocabulary::write(voc, filename);
+}
+
+class LoopPipelineTest : public ::testing::Test
+{
+  protected:
+    static void SetUpTestCase()
+    {
+        // more than one thread, so a batch takes the shared path of the pool
+        setLoopClosureThreads(3);
+        MIN_LOOP_NUM = 25;
+        LOOP_MATCH_MODE = 0;
+        LOOP_MATCH_LEVEL = 1;
+
+        scene = new LoopScene;
+        writeVocabulary("test_loop_pipeline.flat");
+        scene->loop_closure.reset(new LoopClosure("test_loop_pipeline.flat", IMAGE_WIDTH, IMAGE_HEIGHT));
+        scene->camera.reset(new camodocal::PinholeCamera("camera", IMAGE_WIDTH, IMAGE_HEIGHT, 0.0, 0.0, 0.0, 0.0,
+                                                         FOCAL_LENGTH, FOCAL_LENGTH, IMAGE_WIDTH / 2.0, IMAGE_HEIGHT / 2.0));
+
+        // the old keyframe is the world frame, camera and imu coincide
+        scene->cur_T = Eigen::Vector3d(0.05, 0.03, 0.1);
+        scene->cur_R = Eigen::AngleAxisd(0.01, Eigen::Vector3d::UnitY()).toRotationMatrix();
+        for (int v = 100; v + 100 <= IMAGE_HEIGHT; v += SPACING)
+        {
+            for (int u = 100; u + 100 <= IMAGE_WIDTH; u += SPACING)
+            {
+                double depth = 4.0 + scene->points.size() % 3;
+                Eigen::Vector3d point = depth * Eigen::Vector3d((u - IMAGE_WIDTH / 2.0) / FOCAL_LENGTH, (v - IMAGE_HEIGHT / 2.0) / FOCAL_LENGTH, 1.0);
+                Eigen::Vector3d p_c = scene->cur_R.transpose() * (point - scene->cur_T);
+                scene->points.push_back(point);
+                scene->old_pts.push_back(cv::Point2f(u, v));
+                scene->cur_pts.push_back(cv::Point2f(cvRound(FOCAL_LENGTH * p_c.x() / p_c.z() + IMAGE_WIDTH / 2.0),
+                                                     cvRound(FOCAL_LENGTH * p_c.y() / p_c.z() + IMAGE_HEIGHT / 2.0)));
+            }
+        }
+        scene->old_image = drawScene(scene->old_pts, 0);
+        scene->cur_image = drawScene(scene->cur_pts, 0);
+        // the same layout with other textures, nothing in it matches
+        scene->other_image = drawScene(scene->old_pts, 1000);
+
+        scene->old_kf.reset(oldKeyFrame(scene->old_image));
+        scene->other_kf.reset(oldKeyFrame(scene->other_image));
+    }
+
+    static void TearDownTestCase()
+    {
+        // a batch that did not finish may still hold on to the scene
+        if (!stuck)
+            delete scene;
+        scene = NULL;
+    }
+
+    static KeyFrame *oldKeyFrame(cv::Mat &image)
+    {
+        KeyFrame *kf = new KeyFrame(0.0, Eigen::Vector3d::Zero(), Eigen::Matrix3d::Identity(),
+                                    Eigen::Vector3d::Zero(), Eigen::Matrix3d::Identity(), image,
+                                    BRIEF_PATTERN_YML);
+        kf->setExtrinsic(Eigen::Vector3d::Zero(), Eigen::Matrix3d::Identity());
+        kf->measurements = scene->old_pts;
+        kf->extractBrief(image);
+        return kf;
+    }
+
+    static std::shared_ptr<KeyFrame> curKeyFrame(double header)
+    {
+        std::shared_ptr<KeyFrame> kf(new KeyFrame(header, scene->cur_T, scene->cur_R, scene->cur_T, scene->cur_R,
+                                                  scene->cur_image, BRIEF_PATTERN_YML));
+        kf->setExtrinsic(Eigen::Vector3d::Zero(), Eigen::Matrix3d::Identity());
+        for (int i = 0; i < (int)scene->points.size(); i++)
+        {
+            Eigen::Vector3d p_c = scene->cur_R.transpose() * (scene->points[i] - scene->cur_T);
+            kf->measurements.push_back(scene->cur_pts[i]);
+            kf->pts_normalize.push_back(cv::Point2f(p_c.x() / p_c.z(), p_c.y() / p_c.z()));
+            kf->features_id.push_back(i);
+            kf->point_clouds.push_back(scene->points[i]);
+        }
+        return kf;
+    }
+
+    // a batch as process_loop_detection runs it, then detect_loop's candidate check. The
+    // batch runs on its own thread, false if it did not finish in time: it is then left
+    // behind holding the keyframes, so a deadlock fails the test instead of hanging it
+    static bool runBatch(int num, BatchResult &result)
+    {
+        auto batch = std::make_shared<std::vector<std::shared_ptr<KeyFrame>>>();
+        for (int i = 0; i < num; i++)
+            batch->push_back(curKeyFrame(i + 1.0));
+        auto shared_result = std::make_shared<BatchResult>();
+        auto done = std::make_shared<std::promise<void>>();
+        std::future<void> finished = done->get_future();
+        LoopScene *s = scene;
+        std::thread([s, batch, shared_result, done]
+                    {
+                        BatchResult &r = *shared_result;
+                        int num = batch->size();
+                        r.bowvecs.assign(num, DBoW2::BowVector());
+                        r.featvecs.assign(num, DBoW2::FeatureVector());
+                        loopClosureWorkerPool().parallelFor(num, [&](int i)
+                        {
+                            KeyFrame *kf = (*batch)[i].get();
+                            kf->extractBrief(kf->image);
+                            if (LOOP_MATCH_MODE == 1)
+                                kf->buildFeatureNodes(s->loop_closure->demo.voc, LOOP_MATCH_LEVEL);
+                            s->loop_closure->transform(kf->features->descriptors, r.bowvecs[i], r.featvecs[i]);
+                        });
+                        for (auto &kf : *batch)
+                        {
+                            r.descriptors.push_back(kf->features->descriptors);
+                            std::vector<LoopMatch> matches(2);
+                            matches[0].old_kf = s->other_kf.get();
+                            matches[1].old_kf = s->old_kf.get();
+                            r.old_last.push_back(kf->findConnectionWithOldFrames(matches, s->camera));
+                            matches.assign(2, LoopMatch());
+                            matches[0].old_kf = s->old_kf.get();
+                            matches[1].old_kf = s->other_kf.get();
+                            r.old_first.push_back(kf->findConnectionWithOldFrames(matches, s->camera));
+                        }
+                        done->set_value();
+                    })
+            .detach();
+        if (finished.wait_for(std::chrono::seconds(30)) != std::future_status::ready)
+        {
+            stuck = true;
+            return false;
+        }
+        result = *shared_result;
+        return true;
+    }
+
+    static LoopScene *scene;
+    static bool stuck;
+};
+
+LoopScene *LoopPipelineTest::scene = NULL;
+bool LoopPipelineTest::stuck = false;
+
+TEST_F(LoopPipelineTest, SingleKeyFrameBatch)
+{
+    BatchResult result;
+    ASSERT_TRUE(runBatch(1, result)) << "a batch of one keyframe did not finish";
+    // more keypoints than one chunk, so extraction and transform called the pool again
+    ASSERT_GT(result.descriptors[0].size(), 64u);
+    EXPECT_FALSE(result.bowvecs[0].empty());
+    EXPECT_EQ(1, result.old_last[0]);
+    EXPECT_EQ(0, result.old_first[0]);
+}
+
+TEST_F(LoopPipelineTest, SeveralKeyFramesBatch)
+{
+    BatchResult single, several;
+    ASSERT_TRUE(runBatch(1, single)) << "a batch of one keyframe did not finish";
+    ASSERT_TRUE(runBatch(4, several)) << "a batch of four keyframes did not finish";
+    // the keyframes are the same, each must come out as the single one did
+    for (int i = 0; i < 4; i++)
+    {
+        EXPECT_TRUE(single.descriptors[0] == several.descriptors[i]) << "keyframe " << i;
+        EXPECT_EQ(single.bowvecs[0], several.bowvecs[i]) << "keyframe " << i;
+        EXPECT_EQ(single.featvecs[0], several.featvecs[i]) << "keyframe " << i;
+        EXPECT_EQ(1, several.old_last[i]) << "keyframe " << i;
+        EXPECT_EQ(0, several.old_first[i]) << "keyframe " << i;
+    }
+}
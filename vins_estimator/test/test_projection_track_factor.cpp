@@ -0,0 +1,198 @@
+#include <gtest/gtest.h>
+#include <random>
+#include "../src/factor/projection_track_factor.h"
+
+// one feature seen from an anchor frame and several observing frames, all looking down +z
+class ProjectionTrackFactorTest : public ::testing::Test
+{
+  protected:
+    ProjectionTrackFactorTest()
+        : rng(11)
+    {
+        ProjectionFactor::sqrt_info = FOCAL_LENGTH / 1.5 * Eigen::Matrix2d::Identity();
+    }
+
+    void setPose(double *pose, const Eigen::Vector3d &P, const Eigen::Quaterniond &Q)
+    {
+        pose[0] = P.x();
+        pose[1] = P.y();
+        pose[2] = P.z();
+        pose[3] = Q.x();
+        pose[4] = Q.y();
+        pose[5] = Q.z();
+        pose[6] = Q.w();
+    }
+
+    Eigen::Quaterniond smallRotation(double angle)
+    {
+        std::uniform_real_distribution<double> dist(-angle, angle);
+        return Eigen::Quaterniond(Eigen::AngleAxisd(dist(rng), Eigen::Vector3d::UnitX()) *
+                                  Eigen::AngleAxisd(dist(rng), Eigen::Vector3d::UnitY()) *
+                                  Eigen::AngleAxisd(dist(rng), Eigen::Vector3d::UnitZ()));
+    }
+
+    // observations slightly off the true projection, so the residuals are not zero
+    void buildTrack(int obs_num)
+    {
+        std::uniform_real_distribution<double> offset(-0.3, 0.3), noise(-0.01, 0.01);
+        setPose(pose_i, Eigen::Vector3d(offset(rng), offset(rng), offset(rng)), smallRotation(0.2));
+        setPose(ex_pose, Eigen::Vector3d(0.05, -0.02, 0.01), smallRotation(0.05));
+        pts_i = Eigen::Vector3d(offset(rng), offset(rng), 1.0);
+        inv_dep[0] = 1.0 / 4.0;
+
+        poses_j.assign(obs_num, std::vector<double>(SIZE_POSE));
+        pts_j.clear();
+        for (int k = 0; k < obs_num; k++)
+        {
+            setPose(poses_j[k].data(), Eigen::Vector3d(offset(rng), offset(rng), offset(rng)), smallRotation(0.2));
+            pts_j.push_back(Eigen::Vector3d(pts_i.x() + noise(rng), pts_i.y() + noise(rng), 1.0));
+        }
+
+        parameters = {pose_i, ex_pose, inv_dep};
+        for (auto &pose_j : poses_j)
+            parameters.push_back(pose_j.data());
+    }
+
+    // residuals and jacobians of every parameter block
+    void evaluate(const ProjectionTrackFactor &f, bool float_jacobian, std::vector<double> &residuals,
+                  std::vector<std::vector<double>> &jacobians)
+    {
+        int num_blocks = static_cast<int>(f.parameter_block_sizes().size());
+        residuals.assign(f.num_residuals(), 0.0);
+        jacobians.resize(num_blocks);
+        std::vector<double *> jacobian_ptr(num_blocks);
+        for (int b = 0; b < num_blocks; b++)
+        {
+            jacobians[b].assign(f.num_residuals() * f.parameter_block_sizes()[b], 0.0);
+            jacobian_ptr[b] = jacobians[b].data();
+        }
+        ASSERT_TRUE(f.Evaluate(parameters.data(), residuals.data(), jacobian_ptr.data(), float_jacobian));
+    }
+
+    // every observation must give the residual and jacobians of a single ProjectionFactor
+    void expectMatchesProjectionFactor(const std::shared_ptr<ceres::LossFunction> &loss_function)
+    {
+        ProjectionTrackFactor f(pts_i, pts_j, loss_function);
+        std::vector<double> residuals;
+        std::vector<std::vector<double>> jacobians;
+        evaluate(f, false, residuals, jacobians);
+
+        int os = f.observationSize();
+        for (int k = 0; k < static_cast<int>(pts_j.size()); k++)
+        {
+            ProjectionFactor single(pts_i, pts_j[k]);
+            double res[2], jaco_pose_i[14], jaco_pose_j[14], jaco_ex[14], jaco_feature[2];
+            double *jaco[4] = {jaco_pose_i, jaco_pose_j, jaco_ex, jaco_feature};
+            double *single_parameters[4] = {pose_i, poses_j[k].data(), ex_pose, inv_dep};
+            single.Evaluate(single_parameters, res, jaco);
+
+            // the cauchy loss has rho'' < 0, where ceres only scales the rows by sqrt(rho')
+            double scale = 1.0;
+            if (loss_function)
+            {
+                double rho[3];
+                loss_function->Evaluate(Eigen::Map<Eigen::Vector2d>(res).squaredNorm(), rho);
+                scale = sqrt(rho[1]);
+            }
+            const int cols[4] = {7, 7, 1, 7};
+            const int blocks[4] = {0, 1, 2, 3 + k};
+            const double *refs[4] = {jaco_pose_i, jaco_ex, jaco_feature, jaco_pose_j};
+            for (int a = 0; a < 2; a++)
+            {
+                EXPECT_NEAR(scale * res[a], residuals[k * os + a], 1e-9 * std::max(1.0, std::abs(res[a])));
+                for (int b = 0; b < 4; b++)
+                {
+                    for (int c = 0; c < cols[b]; c++)
+                    {
+                        double ref = scale * refs[b][a * cols[b] + c];
+                        EXPECT_NEAR(ref, jacobians[blocks[b]][(k * os + a) * cols[b] + c], 1e-9 * std::max(1.0, std::abs(ref)))
+                            << "observation " << k << " row " << a << " block " << b << " col " << c;
+                    }
+                }
+            }
+        }
+    }
+
+    std::mt19937 rng;
+    double pose_i[SIZE_POSE], ex_pose[SIZE_POSE], inv_dep[SIZE_FEATURE];
+    std::vector<std::vector<double>> poses_j;
+    Eigen::Vector3d pts_i;
+    std::vector<Eigen::Vector3d> pts_j;
+    std::vector<double *> parameters;
+};
+
+TEST_F(ProjectionTrackFactorTest, MatchesProjectionFactor)
+{
+    // more observations than one kernel batch, and a partial last batch
+    buildTrack(SphereProjectionBatch::MAX_SIZE + 3);
+    expectMatchesProjectionFactor(nullptr);
+}
+
+TEST_F(ProjectionTrackFactorTest, MatchesProjectionFactorWithLoss)
+{
+    buildTrack(SphereProjectionBatch::MAX_SIZE + 3);
+    expectMatchesProjectionFactor(std::make_shared<ceres::CauchyLoss>(1.0));
+}
+
+TEST_F(ProjectionTrackFactorTest, FloatJacobianWithinTolerance)
+{
+    for (int trial = 0; trial < 10; trial++)
+    {
+        buildTrack(SphereProjectionBatch::MAX_SIZE + 3);
+        ProjectionTrackFactor f(pts_i, pts_j, std::make_shared<ceres::CauchyLoss>(1.0));
+        std::vector<double> residuals, float_residuals;
+        std::vector<std::vector<double>> jacobians, float_jacobians;
+        evaluate(f, false, residuals, jacobians);
+        evaluate(f, true, float_residuals, float_jacobians);
+
+        // residuals always stay in double
+        EXPECT_EQ(residuals, float_residuals);
+        for (int b = 0; b < static_cast<int>(jacobians.size()); b++)
+        {
+            double max_jacobian = 0.0, max_diff = 0.0;
+            for (int i = 0; i < static_cast<int>(jacobians[b].size()); i++)
+            {
+                max_jacobian = std::max(max_jacobian, std::abs(jacobians[b][i]));
+                max_diff = std::max(max_diff, std::abs(jacobians[b][i] - float_jacobians[b][i]));
+            }
+            EXPECT_LE(max_diff, 1e-5 * max_jacobian) << "block " << b;
+        }
+    }
+}
+
+// the dispatched kernel, avx2 on capable cpus, against the scalar one
+TEST_F(ProjectionTrackFactorTest, KernelMatchesScalar)
+{
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    for (int size = 1; size <= SphereProjectionBatch::MAX_SIZE; size++)
+    {
+        SphereProjectionBatch batch;
+        batch.size = size;
+        for (int l = 0; l < size; l++)
+        {
+            batch.x[l] = dist(rng);
+            batch.y[l] = dist(rng);
+            batch.z[l] = 3.0 + dist(rng);
+            for (int i = 0; i < 6; i++)
+                batch.t[i][l] = 300.0 * dist(rng);
+            batch.c[0][l] = dist(rng);
+            batch.c[1][l] = dist(rng);
+        }
+
+        for (bool float_jacobian : {false, true})
+        {
+            SphereProjectionBatch scalar = batch, dispatched = batch;
+            evaluateSphereProjectionScalar(scalar, true, float_jacobian);
+            evaluateSphereProjection(dispatched, true, float_jacobian);
+            double tolerance = float_jacobian ? 1e-5 : 1e-12;
+            for (int l = 0; l < size; l++)
+            {
+                for (int a = 0; a < 2; a++)
+                    EXPECT_NEAR(scalar.r[a][l], dispatched.r[a][l], 1e-12 * std::max(1.0, std::abs(scalar.r[a][l])));
+                for (int i = 0; i < 6; i++)
+                    EXPECT_NEAR(scalar.reduce[i][l], dispatched.reduce[i][l], tolerance * std::max(1.0, std::abs(scalar.reduce[i][l])))
+                        << "size " << size << " float " << float_jacobian;
+            }
+        }
+    }
+}
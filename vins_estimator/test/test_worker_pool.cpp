@@ -0,0 +1,81 @@
+#include <gtest/gtest.h>
+#include <future>
+#include <memory>
+#include "../src/utility/worker_pool.h"
+
+// runs body on its own thread; false if it did not finish in time, the thread is then left
+// behind with its pool so a deadlock fails the test instead of hanging it
+bool finishesInTime(const std::shared_ptr<WorkerPool> &pool, const std::function<void(WorkerPool &)> &body)
+{
+    auto done = std::make_shared<std::promise<void>>();
+    std::future<void> finished = done->get_future();
+    std::thread([pool, body, done]
+                {
+                    body(*pool);
+                    done->set_value();
+                })
+        .detach();
+    return finished.wait_for(std::chrono::seconds(10)) == std::future_status::ready;
+}
+
+// outer_num tasks, each calling parallelFor on the same pool with inner_num tasks
+void expectNestedSum(int pool_size, int outer_num, int inner_num)
+{
+    auto pool = std::make_shared<WorkerPool>(pool_size);
+    auto sum = std::make_shared<std::atomic<int>>(0);
+    ASSERT_TRUE(finishesInTime(pool, [=](WorkerPool &p)
+                               { p.parallelFor(outer_num, [&](int i)
+                                               { p.parallelFor(inner_num, [&](int j)
+                                                               { *sum += i * inner_num + j + 1; }); }); }))
+        << "pool " << pool_size << " outer " << outer_num << " inner " << inner_num;
+    int n = outer_num * inner_num;
+    EXPECT_EQ(n * (n + 1) / 2, sum->load());
+}
+
+TEST(WorkerPoolTest, NestedSingleTask)
+{
+    expectNestedSum(4, 1, 1);
+    expectNestedSum(4, 1, 8);
+    expectNestedSum(4, 8, 1);
+}
+
+TEST(WorkerPoolTest, NestedSeveralTasks)
+{
+    expectNestedSum(4, 6, 5);
+    expectNestedSum(2, 16, 3);
+}
+
+TEST(WorkerPoolTest, NestedPoolOfSizeOne)
+{
+    expectNestedSum(1, 1, 1);
+    expectNestedSum(1, 1, 4);
+    expectNestedSum(1, 4, 4);
+}
+
+// a single task calls the pool while another thread keeps it busy with its own batches
+TEST(WorkerPoolTest, NestedSingleTaskWhileBusy)
+{
+    auto pool = std::make_shared<WorkerPool>(3);
+    auto stop = std::make_shared<std::atomic<bool>>(false);
+    std::thread other([pool, stop]
+                      {
+                          while (!*stop)
+                              pool->parallelFor(8, [](int) {});
+                      });
+    auto sum = std::make_shared<std::atomic<int>>(0);
+    bool finished = finishesInTime(pool, [=](WorkerPool &p)
+                                   {
+                                       for (int k = 0; k < 100; k++)
+                                           p.parallelFor(1, [&](int)
+                                                         { p.parallelFor(4, [&](int j)
+                                                                         { *sum += j; }); });
+                                   });
+    *stop = true;
+    // a deadlocked pool would keep the other caller waiting as well
+    if (finished)
+        other.join();
+    else
+        other.detach();
+    ASSERT_TRUE(finished);
+    EXPECT_EQ(600, sum->load());
+}